@@ -0,0 +1,387 @@
+// Microbenchmarks for the simulation and serializer kernels, over a range of
+// player and projectile counts. Prints a table, or one JSON object per result
+// with --json; --compare reads such a file from an earlier run and shows the
+// change next to each result. --perf-counters adds cycles, IPC, and cache and
+// branch misses per operation, counted on the thread that runs the kernel.
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cmath>
+#include <memory>
+#include <vector>
+#include <string>
+#include <map>
+#include <tuple>
+#include <chrono>
+#include <algorithm>
+
+#include "protocol.h"
+#include "match.h"
+#include "job_system.h"
+#include "sound.h"
+#include "log.h"
+#include "profile.h"
+#include "perf_counters.h"
+#include "client_net.h"
+
+using namespace std;
+
+#define LINE_SPHERE_BATCH 4096
+
+struct BenchOptions {
+    vector<uint32_t> players = {16, 64, 256, 1024};
+    vector<uint32_t> projectiles = {100, 1000};
+    double min_time_s = 0.25;  // per result, not counting setup
+    int threads = 1;
+    uint64_t seed = 1;
+    bool json = false;
+    bool perf_counters = false;
+    const char* filter = nullptr;
+    const char* compare_path = nullptr;
+};
+
+BenchOptions options;
+JobSystem jobs;
+
+// Results of an earlier run by (benchmark, players, projectiles), in ns per op
+map<tuple<string, uint32_t, uint32_t>, double> baseline;
+
+// Keeps the compiler from dropping work whose result is otherwise unused
+volatile uint64_t sink;
+
+// Times run() until min_time_s has passed, calling setup() untimed before
+// each run. One run does ops operations; results are per operation.
+template <typename Setup, typename Run>
+void run_bench(const char* name, uint32_t players, uint32_t projectiles, uint64_t ops, Setup setup, Run run) {
+    if (options.filter && !strstr(name, options.filter)) return;
+    LatencyHistogram h;
+    uint64_t iterations = 0;
+    uint64_t total_ns = 0;
+    // Hardware counts over the timed runs, when on; the reads sit outside the
+    // timed part
+    uint64_t counts[NUM_PERF_COUNTERS] = {};
+    bool counting = perf_counters_on;
+    setup();
+    run();  // warm-up
+    while (total_ns < options.min_time_s * 1e9 || iterations < 5) {
+        setup();
+        PerfSample before, after;
+        counting = counting && perf_read(before);
+        auto start = Clock::now();
+        run();
+        uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count();
+        counting = counting && perf_read(after);
+        for (int c = 0; counting && c < NUM_PERF_COUNTERS; c++) counts[c] += after.values[c] - before.values[c];
+        histogram_record(h, ns);
+        total_ns += ns;
+        iterations++;
+    }
+    double ns_per_op = (double)total_ns / iterations / ops;
+    double p50 = histogram_percentile(h, 0.5) / (double)ops;
+    double p99 = histogram_percentile(h, 0.99) / (double)ops;
+    double per_op = 1.0 / ((double)iterations * ops);
+    double ipc = counts[PERF_CYCLES] ? (double)counts[PERF_INSTRUCTIONS] / counts[PERF_CYCLES] : 0.0;
+    if (options.json) {
+        printf("{\"bench\":\"%s\",\"players\":%u,\"projectiles\":%u,\"threads\":%d,\"ops\":%llu,\"iterations\":%llu,"
+               "\"ns_per_op\":%.2f,\"p50_ns_per_op\":%.2f,\"p99_ns_per_op\":%.2f", name, players, projectiles,
+               options.threads, (unsigned long long)ops, (unsigned long long)iterations, ns_per_op, p50, p99);
+        if (counting) {
+            printf(",\"cycles_per_op\":%.2f,\"ipc\":%.3f,\"cache_misses_per_op\":%.4f,\"branch_misses_per_op\":%.4f",
+                   counts[PERF_CYCLES] * per_op, ipc, counts[PERF_CACHE_MISSES] * per_op, counts[PERF_BRANCH_MISSES] * per_op);
+        }
+        printf("}\n");
+    } else {
+        printf("%-28s %8u %11u %14.1f %14.1f %14.1f %10llu", name, players, projectiles, ns_per_op, p50, p99,
+               (unsigned long long)iterations);
+        if (counting) {
+            printf(" %12.1f %6.2f %13.3f %12.3f", counts[PERF_CYCLES] * per_op, ipc, counts[PERF_CACHE_MISSES] * per_op,
+                   counts[PERF_BRANCH_MISSES] * per_op);
+        }
+        auto it = baseline.find({name, players, projectiles});
+        if (it != baseline.end()) printf(" %+9.1f%%", (ns_per_op / it->second - 1.0) * 100.0);
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+static bool load_baseline(const char* path) {
+    ifstream in(path);
+    if (!in) return false;
+    string line;
+    while (getline(in, line)) {
+        char name[64];
+        unsigned players, projectiles;
+        double ns_per_op;
+        if (sscanf(line.c_str(), "{\"bench\":\"%63[^\"]\",\"players\":%u,\"projectiles\":%u,\"threads\":%*d,\"ops\":%*u,"
+                   "\"iterations\":%*u,\"ns_per_op\":%lf", name, &players, &projectiles, &ns_per_op) == 4) {
+            baseline[{name, players, projectiles}] = ns_per_op;
+        }
+    }
+    return true;
+}
+
+static uint32_t random_u32(uint64_t& state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (uint32_t)(state >> 32);
+}
+
+static float random_float(uint64_t& state, float lo, float hi) {
+    return lo + (hi - lo) * (random_u32(state) / 4294967296.0f);
+}
+
+static glm::vec3 random_dir(uint64_t& state) {
+    float yaw = random_float(state, 0.0f, 2.0f * (float)M_PI);
+    float pitch = random_float(state, -0.3f, 0.3f);
+    return glm::vec3(cosf(yaw) * cosf(pitch), sinf(pitch), sinf(yaw) * cosf(pitch));
+}
+
+// A match with the given number of players moving about and projectiles in flight
+static unique_ptr<Match> make_match(uint32_t players, uint32_t projectiles) {
+    match_config.max_players = max(1u, players);
+    match_config.max_projectiles = max(1u, projectiles);
+    auto m = make_unique<Match>();
+    m->start(0, options.seed, nullptr, nullptr);
+    uint64_t rng = options.seed * 0x9E3779B97F4A7C15ULL | 1;
+    for (uint32_t i = 0; i < players; i++) {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(0x7F000001 + i / 60000);
+        addr.sin_port = htons(1024 + i % 60000);
+        ClientInfo& client = *m->clients.get(m->add_player(addr, addr_key(addr)));
+        client.state.movement_dir = (MovementDirection)(random_u32(rng) % (NONE + 1));
+        client.state.view_dir = random_dir(rng);
+    }
+    m->simulate(FIXED_DT, {});
+    for (uint32_t i = 0; i < projectiles && players > 0; i++) {
+        const ClientInfo& owner = *m->client_list[i % m->client_list.size()].second;
+        m->spawn_projectile(owner.state.player_id, owner.state.pos, random_dir(rng));
+    }
+    return m;
+}
+
+// What the projectile kernels change, so every run starts from the same state
+struct ProjectileSave {
+    vector<ProjectileState> projectiles;
+    vector<glm::vec3> prev_pos;
+    vector<uint32_t> despawn_tick;
+    vector<uint8_t> alive;  // per client_list entry
+
+    void save(const Match& m) {
+        projectiles = m.projectiles;
+        prev_pos = m.projectile_prev_pos;
+        despawn_tick = m.projectile_despawn_tick;
+        alive.clear();
+        for (auto& [id, client] : m.client_list) alive.push_back(client->state.is_alive);
+    }
+    void restore(Match& m) const {
+        copy(projectiles.begin(), projectiles.end(), m.projectiles.begin());
+        copy(prev_pos.begin(), prev_pos.end(), m.projectile_prev_pos.begin());
+        copy(despawn_tick.begin(), despawn_tick.end(), m.projectile_despawn_tick.begin());
+        for (size_t c = 0; c < alive.size(); c++) m.client_list[c].second->state.is_alive = alive[c];
+    }
+};
+
+// What update_players changes, so each run starts from the same positions
+struct PlayerSave {
+    vector<PlayerState> states;  // per client_list entry
+    vector<glm::vec3> pos_at_last_step;
+    vector<float> velocity_y;
+
+    void save(const Match& m) {
+        states.clear();
+        pos_at_last_step.clear();
+        velocity_y.clear();
+        for (auto& [id, client] : m.client_list) {
+            states.push_back(client->state);
+            pos_at_last_step.push_back(client->pos_at_last_step);
+            velocity_y.push_back(client->velocityY);
+        }
+    }
+    void restore(Match& m) const {
+        for (size_t c = 0; c < states.size(); c++) {
+            ClientInfo& client = *m.client_list[c].second;
+            client.state = states[c];
+            client.pos_at_last_step = pos_at_last_step[c];
+            client.velocityY = velocity_y[c];
+        }
+    }
+};
+
+static void drain_sounds(Match& m) {
+    SoundEventPacket pkt;
+    while (m.sound_queue.pop(pkt)) {}
+}
+
+static void bench_map_kernels() {
+    auto m = make_match(0, 1);
+    run_bench("generate_map", 0, 0, 1,
+              [&] { m->sim_rng.state = options.seed; },
+              [&] { m->generate_map(); });
+
+    vector<uint8_t> field(MAP_VOXELS);
+    size_t source = 0;
+    run_bench("sound_propagate", 0, 0, 1,
+              [&] { source = (source + 1) % m->spawn_points.size(); },
+              [&] { sound_propagate(m->game_map, sound_voxel(m->spawn_points[source]), field.data()); sink = field[0]; });
+
+    uint64_t rng = options.seed | 1;
+    vector<glm::vec3> starts(LINE_SPHERE_BATCH), ends(LINE_SPHERE_BATCH), centers(LINE_SPHERE_BATCH);
+    for (int i = 0; i < LINE_SPHERE_BATCH; i++) {
+        starts[i] = glm::vec3(random_float(rng, 0, MAP_WIDTH), random_float(rng, 0, MAP_HEIGHT), random_float(rng, 0, MAP_LENGTH));
+        ends[i] = starts[i] + random_dir(rng) * 3.3f;  // one tick of flight
+        centers[i] = starts[i] + glm::vec3(random_float(rng, -2, 2), random_float(rng, -1, 1), random_float(rng, -2, 2));
+    }
+    run_bench("check_line_sphere_collision", 0, 0, LINE_SPHERE_BATCH, [] {}, [&] {
+        uint64_t hits = 0;
+        for (int i = 0; i < LINE_SPHERE_BATCH; i++) hits += check_line_sphere_collision(starts[i], ends[i], centers[i], 0.35f);
+        sink = hits;
+    });
+}
+
+static void bench_match_kernels(uint32_t players, uint32_t projectiles, bool first_players, bool first_projectiles) {
+    auto m = make_match(players, projectiles);
+    ProjectileSave save;
+    save.save(*m);
+    PlayerSave player_save;
+    player_save.save(*m);
+
+    // Kernels that only depend on one of the counts run once per value of it
+    if (first_projectiles) {
+        run_bench("update_players", players, 0, players,
+                  [&] { player_save.restore(*m); drain_sounds(*m); },
+                  [&] { m->update_players(FIXED_DT); });
+        player_save.restore(*m);
+
+        vector<uint64_t> keys;
+        for (auto& [id, client] : m->client_list) keys.push_back(client->client_key);
+        run_bench("client_key_lookup", players, 0, players, [] {}, [&] {
+            uint64_t found = 0;
+            for (uint64_t key : keys) {
+                auto it = m->addr_to_id.find(key);
+                if (it != m->addr_to_id.end()) found += it->second;
+            }
+            sink = found;
+        });
+    }
+    if (first_players) {
+        run_bench("move_projectiles", 0, projectiles, projectiles,
+                  [&] { save.restore(*m); },
+                  [&] { m->move_projectiles(FIXED_DT); });
+    }
+    // Hits are tested against where the projectiles are headed
+    save.restore(*m);
+    m->move_projectiles(FIXED_DT);
+    save.save(*m);
+    run_bench("resolve_projectile_hits", players, projectiles, (uint64_t)players * projectiles,
+              [&] { save.restore(*m); },
+              [&] { m->resolve_projectile_hits(); });
+
+    // Every client's snapshot from one tick, built but not sent
+    WorldSnapshot snap;
+    snap.projectiles.resize(match_config.max_projectiles);
+    snap.projectile_despawn_tick.resize(match_config.max_projectiles);
+    save.restore(*m);
+    m->fill_snapshot(snap, m->current_tick, FIXED_DT);
+    m->track_snapshot_players(snap);
+    run_bench("build_snapshots", players, projectiles, players, [] {}, [&] {
+        m->build_aoi_index(snap);
+        for (size_t p = 0; p < snap.players.size(); p++) {
+            ClientSendState& viewer = m->send_states[player_slot(snap.players[p].state.player_id)];
+            m->build_client_snapshot(m->scratch[0], snap, p, viewer);
+        }
+        sink = m->scratch[0].snapshot_buf.size();
+    });
+
+    // One client's snapshot applied to its world, every part of it
+    if (players > 1) {
+        SnapshotScratch& out = m->scratch[0];
+        m->build_aoi_index(snap);
+        m->build_client_snapshot(out, snap, 0, m->send_states[player_slot(snap.players[0].state.player_id)]);
+        vector<uint8_t> parts = out.snapshot_buf;
+        vector<size_t> offsets = out.snapshot_part_offsets;
+        offsets.push_back(parts.size());
+        auto client = make_unique<ClientConnection>();  // too big for the stack
+        ClientConnection& conn = *client;
+        client_world_reset(conn.world, match_config.max_players, match_config.max_projectiles);
+        run_bench("apply_snapshot", players, projectiles, 1, [] {}, [&] {
+            for (size_t k = 0; k + 1 < offsets.size(); k++) {
+                apply_snapshot_part(conn, &parts[offsets[k]], offsets[k + 1] - offsets[k]);
+            }
+            sink = conn.world.players.size();
+        });
+    }
+}
+
+static bool parse_list(const char* arg, vector<uint32_t>& out, uint32_t max_value) {
+    out.clear();
+    stringstream in(arg);
+    string item;
+    while (getline(in, item, ',')) {
+        unsigned long v = strtoul(item.c_str(), nullptr, 10);
+        if (v < 1 || v > max_value) return false;
+        out.push_back((uint32_t)v);
+    }
+    return !out.empty();
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--players") == 0 && i + 1 < argc) {
+            if (!parse_list(argv[++i], options.players, MAX_PLAYERS_LIMIT)) { cerr << "Player counts must be between 1 and " << MAX_PLAYERS_LIMIT << "\n"; return 1; }
+        } else if (strcmp(argv[i], "--projectiles") == 0 && i + 1 < argc) {
+            if (!parse_list(argv[++i], options.projectiles, MAX_PROJECTILES_LIMIT)) { cerr << "Projectile counts must be between 1 and " << MAX_PROJECTILES_LIMIT << "\n"; return 1; }
+        } else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+            options.min_time_s = max(0.01, atof(argv[++i]));
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            options.threads = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            options.seed = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            options.filter = argv[++i];
+        } else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+            options.compare_path = argv[++i];
+        } else if (strcmp(argv[i], "--json") == 0) {
+            options.json = true;
+        } else if (strcmp(argv[i], "--perf-counters") == 0) {
+            options.perf_counters = true;
+        } else {
+            cerr << "Usage: " << argv[0] << " [--players <n,...>] [--projectiles <n,...>] [--min-time <s>] [--threads <n>] "
+                    "[--seed <n>] [--filter <name>] [--json] [--compare <results.json>] [--perf-counters]\n";
+            return 1;
+        }
+    }
+    if (options.compare_path && !load_baseline(options.compare_path)) { cerr << "Can't read " << options.compare_path << "\n"; return 1; }
+    log_min_level = LOG_WARNING;
+    log_start();
+    if (options.perf_counters && !perf_counters_enable()) {
+        cerr << "hardware counters: " << perf_counters_error(errno) << "; timing only\n";
+    }
+    job_system_start(jobs, options.threads);
+    match_config.jobs = &jobs;
+    sort(options.players.begin(), options.players.end());
+    sort(options.projectiles.begin(), options.projectiles.end());
+
+    if (!options.json) {
+        printf("map seed %llu, %d threads, at least %.2f s per result\n", (unsigned long long)options.seed, options.threads,
+               options.min_time_s);
+        printf("%-28s %8s %11s %14s %14s %14s %10s", "benchmark", "players", "projectiles", "ns/op mean", "ns/op p50",
+               "ns/op p99", "runs");
+        if (perf_counters_on) printf(" %12s %6s %13s %12s", "cycles/op", "IPC", "cache miss/op", "br miss/op");
+        printf("%s\n", options.compare_path ? "  vs base" : "");
+    }
+    bench_map_kernels();
+    for (size_t p = 0; p < options.players.size(); p++) {
+        for (size_t q = 0; q < options.projectiles.size(); q++) {
+            bench_match_kernels(options.players[p], options.projectiles[q], p == 0, q == 0);
+        }
+    }
+    job_system_stop(jobs);
+    log_stop();
+    return 0;
+}
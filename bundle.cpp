@@ -0,0 +1,72 @@
+#include <cstring>
+#include <algorithm>
+
+#include "bundle.h"
+#include "net.h"
+
+using namespace std;
+
+static const size_t MESSAGE_PREFIX = sizeof(uint16_t);
+
+void bundle_begin(PacketBundler& b, int sock, const sockaddr_in& addr, size_t mtu, uint32_t tick_id) {
+    b.sock = sock;
+    b.addr = addr;
+    b.mtu = min(mtu, (size_t)MAX_MTU);
+    b.tick_id = tick_id;
+    b.len = 0;
+    b.num_messages = 0;
+}
+
+void bundle_add(PacketBundler& b, const void* pkt, size_t len) {
+    uint8_t type = ((const ProtoHeader*)pkt)->type;
+    if (type < NUM_PACKET_TYPES) b.bytes_by_type[type] += len;
+    if (sizeof(ProtoHeader) + MESSAGE_PREFIX + len > b.mtu) {
+        net_sendto(b.sock, pkt, len, b.addr);
+        b.datagrams_sent++;
+        b.bytes_sent += len;
+        return;
+    }
+    if (b.len + MESSAGE_PREFIX + len > b.mtu) {
+        bundle_flush(b);
+    }
+    if (b.len == 0) {
+        ProtoHeader* hdr = (ProtoHeader*)b.buf;
+        hdr->type = BUNDLE;
+        hdr->tick_id = b.tick_id;
+        b.len = sizeof(ProtoHeader);
+    }
+    uint16_t msg_len = (uint16_t)len;
+    memcpy(b.buf + b.len, &msg_len, MESSAGE_PREFIX);
+    memcpy(b.buf + b.len + MESSAGE_PREFIX, pkt, len);
+    b.len += MESSAGE_PREFIX + len;
+    b.num_messages++;
+}
+
+void bundle_flush(PacketBundler& b) {
+    if (b.num_messages == 1) {
+        size_t offset = sizeof(ProtoHeader) + MESSAGE_PREFIX;
+        net_sendto(b.sock, b.buf + offset, b.len - offset, b.addr);
+        b.datagrams_sent++;
+        b.bytes_sent += b.len - offset;
+    } else if (b.num_messages > 1) {
+        net_sendto(b.sock, b.buf, b.len, b.addr);
+        b.datagrams_sent++;
+        b.bytes_sent += b.len;
+    }
+    b.len = 0;
+    b.num_messages = 0;
+}
+
+bool bundle_next(const uint8_t* buf, size_t len, size_t* offset, const uint8_t** msg, size_t* msg_len) {
+    if (*offset == 0) *offset = sizeof(ProtoHeader);
+    if (*offset + MESSAGE_PREFIX > len) return false;
+
+    uint16_t n;
+    memcpy(&n, buf + *offset, MESSAGE_PREFIX);
+    if (n < sizeof(ProtoHeader) || *offset + MESSAGE_PREFIX + n > len) return false;
+
+    *msg = buf + *offset + MESSAGE_PREFIX;
+    *msg_len = n;
+    *offset += MESSAGE_PREFIX + n;
+    return true;
+}
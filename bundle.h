@@ -0,0 +1,37 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <netinet/in.h>
+
+#include "protocol.h"
+
+// Packs the packets going to one destination into as few MTU-sized BUNDLE
+// datagrams as possible. A datagram that ends up holding a single packet is
+// sent as that packet, without bundle framing.
+struct PacketBundler {
+    int sock = -1;
+    sockaddr_in addr{};
+    size_t mtu = DEFAULT_MTU;
+    uint32_t tick_id = 0;
+    size_t len = 0;
+    int num_messages = 0;
+    uint32_t datagrams_sent = 0;
+    uint64_t bytes_sent = 0;
+    uint64_t bytes_by_type[NUM_PACKET_TYPES] = {};  // packets added, without bundle framing
+    uint8_t buf[MAX_MTU];
+};
+
+void bundle_begin(PacketBundler& b, int sock, const sockaddr_in& addr, size_t mtu, uint32_t tick_id);
+
+// Adds a complete packet. Packets too large to share a datagram are sent on their own.
+void bundle_add(PacketBundler& b, const void* pkt, size_t len);
+
+void bundle_flush(PacketBundler& b);
+
+// Walks the messages of a BUNDLE datagram; start with *offset = 0. Returns
+// false at the end or on a malformed length.
+bool bundle_next(const uint8_t* buf, size_t len, size_t* offset, const uint8_t** msg, size_t* msg_len);
+
+#endif
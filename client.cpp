@@ -1,6 +1,7 @@
 #include <iostream>
 #include <cstring>
 #include <cstdlib>
+#include <cstddef>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -18,21 +19,27 @@
 #include <glm/gtc/type_ptr.hpp>
 #include <chrono>
 #include <unordered_map>
-#include <queue>
 #include <AL/al.h>
 #include <AL/alc.h>
 #include <sndfile.h>
 
 #include "protocol.h"
-
-#define BUFLEN 1024
+#include "reliable.h"
+#include "bundle.h"
+#include "client_net.h"
+#include "pvs.h"
+#include "sound.h"
+#include "trace.h"
+
+#define JOIN_TIMEOUT_S 10
+#define LEAVE_LINGER_MS 1000
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
 using Clock = std::chrono::steady_clock;
 
-int game_map[MAP_WIDTH][MAP_HEIGHT][MAP_LENGTH];
-float sound_distance_map[MAP_WIDTH][MAP_HEIGHT][MAP_LENGTH];
+Pvs map_pvs;  // built once the whole map has arrived
+uint8_t sound_distance_map[MAP_VOXELS];  // path cost from the listener, by sound_voxel()
 auto last_fire_time = Clock::now();
 float cameraYaw   = 0.0f;
 float cameraPitch = 0.0f;
@@ -45,15 +52,9 @@ ALCcontext* audio_context;
 std::unordered_map<SoundType, ALuint> sound_buffers;
 GLuint pistol_texture;
 GLuint player_texture;
-
-struct PathNode {
-    float cost;
-    glm::ivec3 pos;
-
-    bool operator>(const PathNode& other) const {
-        return cost > other.cost;
-    }
-};
+ALuint audio_sources[16];
+int next_source = 0;
+ClientConnection conn;
 
 GLuint load_texture(const char* filename) {
     GLuint texture_id;
@@ -142,59 +143,6 @@ void init_audio() {
     sound_buffers[FOOTSTEP] = load_sound("assets/footstep.wav");
 }
 
-void calculate_sound_map(glm::vec3 start_pos) {
-    for (int x = 0; x < MAP_WIDTH; ++x) {
-        for (int y = 0; y < MAP_HEIGHT; ++y) {
-            for (int z = 0; z < MAP_LENGTH; ++z) {
-                sound_distance_map[x][y][z] = std::numeric_limits<float>::max();
-            }
-        }
-    }
-    
-    glm::ivec3 start_node = {(int)start_pos.x, (int)start_pos.y, (int)start_pos.z};
-
-    if (start_node.x < 0 || start_node.x >= MAP_WIDTH || start_node.y < 0 || start_node.y >= MAP_HEIGHT || start_node.z < 0 || start_node.z >= MAP_LENGTH) {
-        return;
-    }
-
-    std::priority_queue<PathNode, std::vector<PathNode>, std::greater<PathNode>> pq;
-
-    sound_distance_map[start_node.x][start_node.y][start_node.z] = 0.0f;
-    pq.push({0.0f, start_node});
-
-    int d[] = {-1, 1, 0, 0, 0, 0};
-    int d_len = sizeof(d) / sizeof(int);
-
-    while (!pq.empty()) {
-        PathNode current = pq.top();
-        pq.pop();
-
-        if (current.cost > sound_distance_map[current.pos.x][current.pos.y][current.pos.z]) {
-            continue;
-        }
-
-        for (int i = 0; i < d_len; ++i) {
-            glm::ivec3 neighbor_pos = {current.pos.x + d[i], current.pos.y + d[(i+2)%d_len], current.pos.z + d[(i+4)%d_len]};
-
-            if (neighbor_pos.x >= 0 && neighbor_pos.x < MAP_WIDTH &&
-                neighbor_pos.y >= 0 && neighbor_pos.y < MAP_HEIGHT &&
-                neighbor_pos.z >= 0 && neighbor_pos.z < MAP_LENGTH)
-            {
-                float move_cost = 1.0f; // Cost standard pentru a trece prin aer
-                if (game_map[neighbor_pos.x][neighbor_pos.y][neighbor_pos.z] == SOLID) {
-                }
-
-                float new_cost = current.cost + move_cost;
-
-                if (new_cost < sound_distance_map[neighbor_pos.x][neighbor_pos.y][neighbor_pos.z]) {
-                    sound_distance_map[neighbor_pos.x][neighbor_pos.y][neighbor_pos.z] = new_cost;
-                    pq.push({new_cost, neighbor_pos});
-                }
-            }
-        }
-    }
-}
-
 void draw_cube(float x, float y, float z, float height) {
     glPushMatrix();
     glTranslatef(x + 0.5f, y + height / 2.0f, z + 0.5f);
@@ -245,7 +193,8 @@ void draw_sphere(float radius, int sectors, int stacks) {
     }
 }
 
-void draw_minimap(const StatePacket& state, uint32_t self_id, float player_y) {
+void draw_minimap(const ClientWorld& world, uint32_t self_id, float player_y) {
+    TraceScope trace("draw_minimap");
     glPushAttrib(GL_VIEWPORT_BIT | GL_ENABLE_BIT);
     glMatrixMode(GL_PROJECTION); glPushMatrix();
     glMatrixMode(GL_MODELVIEW); glPushMatrix();
@@ -282,7 +231,7 @@ void draw_minimap(const StatePacket& state, uint32_t self_id, float player_y) {
     glBegin(GL_QUADS);
     for (int x = 0; x < MAP_WIDTH; x++) {
         for (int z = 0; z < MAP_LENGTH; z++) {
-            if (game_map[x][current_level_y][z] != AIR) {
+            if (conn.map[x][current_level_y][z] != AIR) {
                 glVertex2f(x, z); glVertex2f(x + 1, z); glVertex2f(x + 1, z + 1); glVertex2f(x, z + 1);
             }
         }
@@ -290,8 +239,7 @@ void draw_minimap(const StatePacket& state, uint32_t self_id, float player_y) {
     glEnd();
 
     glBegin(GL_POINTS);
-    for (int i = 0; i < state.num_players; i++) {
-        const PlayerState& p = state.players[i];
+    for (const PlayerState& p : world.players) {
         if (!p.is_alive) continue;
 
         int other_player_level = (int)p.pos.y;
@@ -406,7 +354,8 @@ void draw_pistol() {
     glPopMatrix();
 }
 
-void renderGL(const StatePacket& state, uint32_t self_id, float playerX, float playerY, float playerZ) {
+void renderGL(const ClientWorld& world, uint32_t self_id, float playerX, float playerY, float playerZ) {
+    TraceScope trace("renderGL");
     glEnable(GL_DEPTH_TEST);
     glClearColor(0.1f, 0.1f, 0.2f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -432,10 +381,15 @@ void renderGL(const StatePacket& state, uint32_t self_id, float playerX, float p
     glm::mat4 view = glm::lookAt(playerEyePos, cameraTarget, glm::vec3(0.0f, 1.0f, 0.0f));
     glLoadMatrixf(glm::value_ptr(view));
 
+    // Skip whatever the PVS says can't be seen from the camera's cluster
+    uint8_t visible[PVS_ROW_BYTES];
+    bool cull = pvs_row(map_pvs, pvs_cluster(playerEyePos), visible);
+    auto hidden = [&](const glm::vec3& pos) { return cull && !pvs_row_test(visible, pvs_cluster(pos)); };
+
     for (int x = 0; x < MAP_WIDTH; x++) {
         for (int y = 0; y < MAP_HEIGHT; y++) {
             for (int z = 0; z < MAP_LENGTH; z++) {
-                if (game_map[x][y][z] == SOLID) {
+                if (conn.map[x][y][z] == SOLID && !hidden(glm::vec3(x, y, z))) {
                     draw_cube((float)x, (float)y, (float)z, 1.0f); 
                 }
             }
@@ -447,9 +401,8 @@ void renderGL(const StatePacket& state, uint32_t self_id, float playerX, float p
     glBindTexture(GL_TEXTURE_2D, player_texture);
     glColor3f(1.0f, 1.0f, 1.0f);
 
-    for (int i = 0; i < state.num_players; ++i) {
-        const PlayerState& p = state.players[i];
-        if (!p.is_alive || p.player_id == self_id) continue;
+    for (const PlayerState& p : world.players) {
+        if (!p.is_alive || p.player_id == self_id || hidden(p.pos)) continue;
     
         glPushMatrix();
         glTranslatef(p.pos.x, p.pos.y - 0.2f, p.pos.z);
@@ -463,9 +416,8 @@ void renderGL(const StatePacket& state, uint32_t self_id, float playerX, float p
     glDisable(GL_TEXTURE_2D);
 
     // Draw the projectiles
-    for (int i = 0; i < state.num_projectiles; ++i) {
-        const ProjectileState& proj = state.projectiles[i];
-        if (proj.is_active) {
+    for (const ProjectileState& proj : world.projectiles) {
+        if (proj.is_active && !hidden(proj.pos)) {
             glColor3f(1.0f, 1.0f, 0.0f);
             glPushMatrix();
             glTranslatef(proj.pos.x, proj.pos.y, proj.pos.z);
@@ -474,10 +426,35 @@ void renderGL(const StatePacket& state, uint32_t self_id, float playerX, float p
         }
     }
     draw_pistol();
-    draw_minimap(state, self_id, playerY);
+    draw_minimap(world, self_id, playerY);
     draw_crosshair();
 }
 
+void play_sound_event(const SoundEventPacket& sound_event) {
+    int sound_v = sound_voxel(sound_event.pos);
+
+    if (sound_v >= 0) {
+        float path_cost = sound_distance_map[sound_v];
+
+        if (path_cost <= SOUND_MAX_PATH_COST) {
+            ALuint source = audio_sources[next_source];
+            next_source = (next_source + 1) % 16;
+            
+            float attenuation_factor = 0.1f;
+            float gain = exp(-path_cost * attenuation_factor);
+            
+            alSourceStop(source);
+            alSource3f(source, AL_POSITION, sound_event.pos.x, sound_event.pos.y, sound_event.pos.z);
+            alSourcef(source, AL_GAIN, gain);
+            alSourcei(source, AL_BUFFER, sound_buffers[sound_event.sound_type]);
+            
+            alSourcef(source, AL_ROLLOFF_FACTOR, 0.0f);
+            
+            alSourcePlay(source);
+        }
+    }
+}
+
 MovementDirection get_movement_dir(GLFWwindow* window) {
     bool w = glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS;
     bool a = glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS;
@@ -509,9 +486,20 @@ void mouse_callback(GLFWwindow* window, double xpos, double ypos) {
 }
 
 int main(int argc, char *argv[]) {
-    if (argc < 3) { std::cerr << "Usage: " << argv[0] << " <server_ip> <port>\n"; return 1; }
+    if (argc < 3) { std::cerr << "Usage: " << argv[0] << " <server_ip> <port> [--trace <file>]\n"; return 1; }
     const char* server_ip = argv[1];
     int port = atoi(argv[2]);
+    const char* trace_path = nullptr;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else {
+            std::cerr << "Unknown option " << argv[i] << "\n";
+            return 1;
+        }
+    }
+    trace_thread_name("main");
+    if (trace_path) trace_start(trace_path);
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0) { perror("socket"); return 1; }
     int flags = fcntl(sockfd, F_GETFL, 0);
@@ -528,46 +516,60 @@ int main(int argc, char *argv[]) {
     player_texture = load_texture("assets/player_texture.png");
 
     init_audio();
-    ALuint audio_sources[16];
     alGenSources(16, audio_sources);
-    int next_source = 0;
+    conn.on_sound = play_sound_event;
 
     sockaddr_in serv_addr{};
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_port = htons(port);
     inet_aton(server_ip, &serv_addr.sin_addr);
-    socklen_t serv_len = sizeof(serv_addr);
     uint32_t tick_id = 0;
-    ProtoHeader join_pkt{};
-    join_pkt.type = JOIN;
-    join_pkt.tick_id = tick_id++;
-    sendto(sockfd, &join_pkt, sizeof(join_pkt), 0, (sockaddr*)&serv_addr, serv_len);
-
-    JoinAckPacket ack_pkt{};
-    fcntl(sockfd, F_SETFL, flags & ~O_NONBLOCK);
-    recvfrom(sockfd, &ack_pkt, sizeof(ack_pkt), 0, nullptr, nullptr);
-    MapPacket map_pkt;
-    recvfrom(sockfd, &map_pkt, sizeof(map_pkt), 0, nullptr, nullptr);
-    fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
-
-    uint32_t self_id = ack_pkt.your_id;
-    if (map_pkt.hdr.type == MAP_DATA) {
-        memcpy(game_map, map_pkt.map, sizeof(game_map));
+    ControlPacket join_pkt{};
+    join_pkt.hdr.type = JOIN;
+    join_pkt.hdr.tick_id = tick_id++;
+    reliable_send(conn.channel, &join_pkt, sizeof(join_pkt));
+
+    auto join_start = Clock::now();
+    while (!conn.joined || conn.map_chunks_received < MAP_CHUNK_COUNT) {
+        if (conn.join_denied || Clock::now() - join_start > std::chrono::seconds(JOIN_TIMEOUT_S)) {
+            std::cerr << (conn.join_denied ? "Server is full\n" : "No answer from server\n");
+            glfwDestroyWindow(window);
+            glfwTerminate();
+            close(sockfd);
+            return 1;
+        }
+        send_to_server(conn, sockfd, serv_addr, nullptr);
+        usleep(1000);
+        poll_server(conn, sockfd);
+    }
+    {
+        TraceScope trace("pvs_build");
+        pvs_build(map_pvs, conn.map, nullptr);
     }
 
     float posX = 1.0f, posY = 0.5f, posZ = 1.0f;
     bool am_i_alive = true;
-    StatePacket last_valid_state{};
 
     while (!glfwWindowShouldClose(window)) {
+        TraceScope frame_trace("frame");
         glfwPollEvents();
         if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS) {
-            ProtoHeader leave_pkt;
-            leave_pkt.type = LEAVE;
-            sendto(sockfd, &leave_pkt, sizeof(leave_pkt), 0, (sockaddr*)&serv_addr, serv_len);
+            ControlPacket leave_pkt{};
+            leave_pkt.hdr.type = LEAVE;
+            leave_pkt.hdr.tick_id = tick_id++;
+            reliable_send(conn.channel, &leave_pkt, sizeof(leave_pkt));
+
+            // Stay around until the server confirms, so our slot is freed right away
+            auto leave_start = Clock::now();
+            while (conn.channel.num_unacked > 0 && Clock::now() - leave_start < std::chrono::milliseconds(LEAVE_LINGER_MS)) {
+                send_to_server(conn, sockfd, serv_addr, nullptr);
+                usleep(1000);
+                poll_server(conn, sockfd);
+            }
             break;
         }
 
+        ActionPacket pkt{};
         if (am_i_alive) {
             glm::vec3 view_dir_3d;
             view_dir_3d.x = cos(glm::radians(cameraYaw)) * cos(glm::radians(cameraPitch));
@@ -575,9 +577,12 @@ int main(int argc, char *argv[]) {
             view_dir_3d.z = sin(glm::radians(cameraYaw)) * cos(glm::radians(cameraPitch));
             view_dir_3d = glm::normalize(view_dir_3d);
 
-            ActionPacket pkt{};
             pkt.hdr.type = ACT;
             pkt.hdr.tick_id = tick_id++;
+            auto sent = Clock::now();
+            pkt.send_time_us = (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(sent.time_since_epoch()).count();
+            pkt.echo_tick = conn.world.latest_tick != 0 ? conn.world.latest_tick : ECHO_NONE;
+            pkt.echo_delay_us = (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(sent - conn.world.latest_tick_time).count();
             pkt.view_dir = view_dir_3d;
             pkt.movement_dir = get_movement_dir(window);
             
@@ -595,47 +600,9 @@ int main(int argc, char *argv[]) {
             } else {
                 pkt.is_jumping = false;
             }
-            sendto(sockfd, &pkt, sizeof(pkt), 0, (sockaddr*)&serv_addr, serv_len);
-        }
-
-        StatePacket received_state{};
-        SoundEventPacket sound_event{};
-
-        ssize_t len = recvfrom(sockfd, &received_state, sizeof(received_state), 0, nullptr, nullptr);
-        if (len >= (ssize_t)sizeof(ProtoHeader)) {
-            ProtoHeader* hdr = (ProtoHeader*)&received_state;
-            
-            if (hdr->type == STATE) {
-                last_valid_state = received_state;
-            } else if (hdr->type == SOUND_EVENT) {
-                memcpy(&sound_event, &received_state, sizeof(sound_event));
-                
-                int sound_x = (int)sound_event.pos.x;
-                int sound_y = (int)sound_event.pos.y;
-                int sound_z = (int)sound_event.pos.z;
-
-                if (sound_x >= 0 && sound_x < MAP_WIDTH && sound_y >= 0 && sound_y < MAP_HEIGHT && sound_z >= 0 && sound_z < MAP_LENGTH) {
-                    float path_cost = sound_distance_map[sound_x][sound_y][sound_z];
-    
-                    if (path_cost < 1000.0f) {
-                        ALuint source = audio_sources[next_source];
-                        next_source = (next_source + 1) % 16;
-                        
-                        float attenuation_factor = 0.1f;
-                        float gain = exp(-path_cost * attenuation_factor);
-                        
-                        alSourceStop(source);
-                        alSource3f(source, AL_POSITION, sound_event.pos.x, sound_event.pos.y, sound_event.pos.z);
-                        alSourcef(source, AL_GAIN, gain);
-                        alSourcei(source, AL_BUFFER, sound_buffers[sound_event.sound_type]);
-                        
-                        alSourcef(source, AL_ROLLOFF_FACTOR, 0.0f);
-                        
-                        alSourcePlay(source);
-                    }
-                }
-            }
         }
+        send_to_server(conn, sockfd, serv_addr, am_i_alive ? &pkt : nullptr);
+        poll_server(conn, sockfd);
 
         glm::vec3 cameraPos = glm::vec3(posX, posY, posZ) + glm::vec3(0, 0.3f, 0);
         alListener3f(AL_POSITION, cameraPos.x, cameraPos.y, cameraPos.z);
@@ -654,22 +621,27 @@ int main(int argc, char *argv[]) {
         };
         alListenerfv(AL_ORIENTATION, orientation_vectors);
 
-        for (int i = 0; i < last_valid_state.num_players; i++) {
-            if (last_valid_state.players[i].player_id == self_id) {
-                posX = last_valid_state.players[i].pos.x;
-                posY = last_valid_state.players[i].pos.y;
-                posZ = last_valid_state.players[i].pos.z;
-                am_i_alive = last_valid_state.players[i].is_alive;
+        for (const PlayerState& p : conn.world.players) {
+            if (p.player_id == conn.self_id) {
+                posX = p.pos.x;
+                posY = p.pos.y;
+                posZ = p.pos.z;
+                am_i_alive = p.is_alive;
                 break;
             }
         }
-        calculate_sound_map({posX, posY, posZ});
+        {
+            TraceScope trace("sound_propagate");
+            sound_propagate(conn.map, sound_voxel({posX, posY, posZ}), sound_distance_map);
+        }
 
-        renderGL(last_valid_state, self_id, posX, posY, posZ);
+        renderGL(conn.world, conn.self_id, posX, posY, posZ);
+        TraceScope swap_trace("glfwSwapBuffers");
         glfwSwapBuffers(window);
     }
     glfwDestroyWindow(window);
     glfwTerminate();
     close(sockfd);
+    trace_stop();
     return 0;
 }
\ No newline at end of file
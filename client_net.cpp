@@ -0,0 +1,176 @@
+#include <cstring>
+#include <sys/socket.h>
+
+#include "client_net.h"
+#include "trace.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+#define BUFLEN 4096
+#define ENTITY_EXPIRY_TICKS 30
+
+void client_world_reset(ClientWorld& world, uint32_t max_players, uint32_t max_projectiles) {
+    world = ClientWorld{};
+    world.players.reserve(max_players);
+    world.player_ticks.reserve(max_players);
+    world.projectiles.assign(max_projectiles, ProjectileState{});
+    world.projectile_ticks.assign(max_projectiles, 0);
+}
+
+static void handle_reliable_packet(ClientConnection& conn, const uint8_t* buf, size_t len) {
+    if (len < sizeof(ProtoHeader) + sizeof(ReliableHeader)) return;
+
+    const ReliableHeader* rel = (const ReliableHeader*)(buf + sizeof(ProtoHeader));
+    reliable_process_ack(conn.channel, rel->ack, Clock::now());
+    reliable_receive(conn.channel, buf, len);
+
+    size_t msg_len;
+    while (const uint8_t* msg = reliable_next_message(conn.channel, &msg_len)) {
+        uint8_t msg_type = ((const ProtoHeader*)msg)->type;
+        if (msg_type == JOIN_ACK && msg_len >= sizeof(JoinAckPacket)) {
+            const JoinAckPacket* ack = (const JoinAckPacket*)msg;
+            conn.self_id = ack->your_id;
+            client_world_reset(conn.world, ack->max_players, ack->max_projectiles);
+            conn.joined = true;
+        } else if (msg_type == MAP_DATA && msg_len >= sizeof(MapChunkPacket)) {
+            const MapChunkPacket* chunk = (const MapChunkPacket*)msg;
+            int* voxels = &conn.map[0][0][0];
+            for (int i = 0; i < MAP_CHUNK_SIZE; i++) {
+                int v = chunk->chunk_index * MAP_CHUNK_SIZE + i;
+                if (v < MAP_VOXELS) voxels[v] = chunk->voxels[i];
+            }
+            conn.map_chunks_received++;
+        }
+    }
+}
+
+static void remove_world_player(ClientWorld& world, size_t j) {
+    world.players[j] = world.players.back();
+    world.players.pop_back();
+    world.player_ticks[j] = world.player_ticks.back();
+    world.player_ticks.pop_back();
+}
+
+void apply_snapshot_part(ClientConnection& conn, const uint8_t* buf, size_t len) {
+    if (len < sizeof(SnapshotPacket)) return;
+    SnapshotPacket part;
+    memcpy(&part, buf, sizeof(part));
+    if (len < sizeof(SnapshotPacket) + part.num_players * sizeof(PlayerState) + part.num_projectiles * sizeof(ProjectileState)
+              + part.num_removed * sizeof(EntityRemoval)) return;
+    reliable_process_ack(conn.channel, part.ack, Clock::now());
+
+    ClientWorld& world = conn.world;
+    uint32_t tick = part.hdr.tick_id;
+    trace_instant("snapshot part", "tick", tick);
+    const uint8_t* cursor = buf + sizeof(SnapshotPacket);
+    for (int i = 0; i < part.num_players; i++, cursor += sizeof(PlayerState)) {
+        PlayerState p;
+        memcpy(&p, cursor, sizeof(p));
+        size_t j = 0;
+        while (j < world.players.size() && world.players[j].player_id != p.player_id) j++;
+        if (j == world.players.size()) {
+            if (tick < world.latest_tick) continue;
+            world.players.push_back(p);
+            world.player_ticks.push_back(tick);
+        } else if (tick >= world.player_ticks[j]) {
+            world.players[j] = p;
+            world.player_ticks[j] = tick;
+        }
+    }
+    for (int i = 0; i < part.num_projectiles; i++, cursor += sizeof(ProjectileState)) {
+        ProjectileState proj;
+        memcpy(&proj, cursor, sizeof(proj));
+        if (proj.id >= world.projectiles.size()) continue;
+        if (tick >= world.projectile_ticks[proj.id]) {
+            world.projectiles[proj.id] = proj;
+            world.projectile_ticks[proj.id] = tick;
+        }
+    }
+    for (int i = 0; i < part.num_removed; i++, cursor += sizeof(EntityRemoval)) {
+        EntityRemoval removal;
+        memcpy(&removal, cursor, sizeof(removal));
+        if (removal.is_player) {
+            size_t j = 0;
+            while (j < world.players.size() && world.players[j].player_id != removal.id) j++;
+            if (j < world.players.size() && tick >= world.player_ticks[j]) remove_world_player(world, j);
+        } else if (removal.id < world.projectiles.size() && tick >= world.projectile_ticks[removal.id]) {
+            world.projectiles[removal.id].is_active = false;
+            world.projectile_ticks[removal.id] = tick;
+        }
+    }
+
+    if (tick <= world.latest_tick) return;
+    world.latest_tick = tick;
+    world.latest_tick_time = Clock::now();
+    // Whatever hasn't been mentioned for a while is gone: every part carrying
+    // its removal or the projectile's despawn was lost
+    for (size_t j = 0; j < world.players.size();) {
+        if (tick - world.player_ticks[j] > ENTITY_EXPIRY_TICKS) {
+            remove_world_player(world, j);
+        } else {
+            j++;
+        }
+    }
+    for (size_t i = 0; i < world.projectiles.size(); i++) {
+        if (world.projectiles[i].is_active && tick - world.projectile_ticks[i] > ENTITY_EXPIRY_TICKS) {
+            world.projectiles[i].is_active = false;
+        }
+    }
+}
+
+void handle_server_packet(ClientConnection& conn, const uint8_t* buf, size_t len) {
+    uint8_t type = ((const ProtoHeader*)buf)->type;
+    if (type == STATE) {
+        apply_snapshot_part(conn, buf, len);
+    } else if (type == SOUND_EVENT && len >= sizeof(SoundEventPacket)) {
+        SoundEventPacket sound_event;
+        memcpy(&sound_event, buf, sizeof(sound_event));
+        if (conn.on_sound) conn.on_sound(sound_event);
+    } else if (type == ACK && len >= sizeof(AckPacket)) {
+        reliable_process_ack(conn.channel, ((const AckPacket*)buf)->ack, Clock::now());
+    } else if (type == JOIN_ACK || type == MAP_DATA) {
+        handle_reliable_packet(conn, buf, len);
+    } else if (type == JOIN_DENIED && len >= sizeof(JoinDeniedPacket) && !conn.joined) {
+        conn.join_denied = true;
+    }
+}
+
+void poll_server(ClientConnection& conn, int sockfd) {
+    static_assert(MAX_MTU <= BUFLEN, "receive buffer smaller than the largest datagram");
+    static uint8_t buf[BUFLEN];
+    TraceScope trace("poll_server");
+    int received = 0;
+    ssize_t len;
+    while ((len = recvfrom(sockfd, buf, sizeof(buf), 0, nullptr, nullptr)) >= (ssize_t)sizeof(ProtoHeader)) {
+        received++;
+        if (((ProtoHeader*)buf)->type == BUNDLE) {
+            size_t offset = 0;
+            const uint8_t* msg;
+            size_t msg_len;
+            while (bundle_next(buf, len, &offset, &msg, &msg_len)) {
+                handle_server_packet(conn, msg, msg_len);
+            }
+        } else {
+            handle_server_packet(conn, buf, len);
+        }
+    }
+    if (received) trace_counter("datagrams received", received);
+}
+
+void send_to_server(ClientConnection& conn, int sockfd, const sockaddr_in& serv_addr, ActionPacket* action) {
+    TraceScope trace("send_to_server");
+    bundle_begin(conn.bundler, sockfd, serv_addr, DEFAULT_MTU, 0);
+    reliable_update(conn.channel, Clock::now(), conn.bundler);
+    if (action) {
+        reliable_write_ack(conn.channel, action->ack);
+        bundle_add(conn.bundler, action, sizeof(*action));
+    } else if (conn.channel.ack_pending) {
+        AckPacket pkt{};
+        pkt.hdr.type = ACK;
+        reliable_write_ack(conn.channel, pkt.ack);
+        bundle_add(conn.bundler, &pkt, sizeof(pkt));
+    }
+    bundle_flush(conn.bundler);
+}
+
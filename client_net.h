@@ -0,0 +1,59 @@
+#ifndef CLIENT_NET_H
+#define CLIENT_NET_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <vector>
+#include <netinet/in.h>
+
+#include "protocol.h"
+#include "reliable.h"
+#include "bundle.h"
+
+// The client's side of the connection to the server: the join handshake,
+// the map download and the world rebuilt from snapshot parts. No graphics or
+// audio, so the benchmarks and tools can link it.
+
+// Entities rebuilt from snapshot parts. Each entity remembers the tick it was
+// last updated in, so parts can be applied in any order and a lost part only
+// leaves its entities a tick behind. A player only appears from a part at
+// least as new as any seen, so a late part can't bring back one removed since.
+struct ClientWorld {
+    uint32_t latest_tick = 0;
+    std::chrono::steady_clock::time_point latest_tick_time;  // when latest_tick arrived
+    std::vector<PlayerState> players;
+    std::vector<uint32_t> player_ticks;
+    // Sized to the match capacity from JOIN_ACK
+    std::vector<ProjectileState> projectiles;
+    std::vector<uint32_t> projectile_ticks;
+};
+
+struct ClientConnection {
+    ReliableEndpoint channel;
+    PacketBundler bundler;
+    ClientWorld world;
+    VoxelMap map;
+    uint32_t self_id = 0;
+    bool joined = false;
+    bool join_denied = false;
+    int map_chunks_received = 0;
+    // Called for each SOUND_EVENT; may be empty
+    std::function<void(const SoundEventPacket&)> on_sound;
+};
+
+// Empties the world and sizes it for a match's capacity
+void client_world_reset(ClientWorld& world, uint32_t max_players, uint32_t max_projectiles);
+
+void apply_snapshot_part(ClientConnection& conn, const uint8_t* buf, size_t len);
+// Handles one packet from the server, unbundled
+void handle_server_packet(ClientConnection& conn, const uint8_t* buf, size_t len);
+// Drains the socket, unpacking bundles
+void poll_server(ClientConnection& conn, int sockfd);
+
+// Sends everything due this frame in one bundle: retransmissions, the action
+// (which carries our acks) or, without an action, a bare ack if one is owed.
+void send_to_server(ClientConnection& conn, int sockfd, const sockaddr_in& serv_addr, ActionPacket* action);
+
+#endif
@@ -0,0 +1,148 @@
+#include <algorithm>
+
+#include "job_system.h"
+#include "trace.h"
+
+using namespace std;
+
+// Index of the worker running on this thread, -1 on other threads
+static thread_local int worker_index = -1;
+
+static bool take_job(JobSystem& js, int self, Job& job) {
+    if (self >= 0) {
+        WorkerQueue& own = js.queues[self];
+        lock_guard<mutex> lock(own.mutex);
+        if (!own.jobs.empty()) {
+            job = move(own.jobs.back());
+            own.jobs.pop_back();
+            js.queued--;
+            return true;
+        }
+    }
+    int start = self >= 0 ? self + 1 : 0;
+    for (int i = 0; i < js.num_workers; i++) {
+        int victim = (start + i) % js.num_workers;
+        if (victim == self) continue;
+        WorkerQueue& other = js.queues[victim];
+        lock_guard<mutex> lock(other.mutex);
+        if (!other.jobs.empty()) {
+            job = move(other.jobs.front());
+            other.jobs.pop_front();
+            js.queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void worker_main(JobSystem& js, int self) {
+    worker_index = self;
+    trace_thread_name("worker");
+    Job job;
+    while (true) {
+        if (take_job(js, self, job)) {
+            job();
+            job = nullptr;
+            continue;
+        }
+        unique_lock<mutex> lock(js.sleep_mutex);
+        js.wake.wait(lock, [&] { return js.stopping || js.queued > 0; });
+        if (js.stopping && js.queued <= 0) return;
+    }
+}
+
+void job_system_start(JobSystem& js, int num_workers) {
+    js.num_workers = max(num_workers, 1);
+    js.queues.reset(new WorkerQueue[js.num_workers]);
+    for (int i = 0; i < js.num_workers; i++) {
+        js.workers.emplace_back(worker_main, ref(js), i);
+    }
+}
+
+void job_system_stop(JobSystem& js) {
+    {
+        lock_guard<mutex> lock(js.sleep_mutex);
+        js.stopping = true;
+    }
+    js.wake.notify_all();
+    for (thread& t : js.workers) {
+        t.join();
+    }
+    js.workers.clear();
+}
+
+void job_system_submit(JobSystem& js, Job job) {
+    int q = worker_index >= 0 ? worker_index : (int)(js.next_queue++ % js.num_workers);
+    {
+        lock_guard<mutex> lock(js.queues[q].mutex);
+        js.queues[q].jobs.push_back(move(job));
+    }
+    js.queued++;
+    // Taking the lock orders this wakeup after a sleeper's check of queued
+    { lock_guard<mutex> lock(js.sleep_mutex); }
+    js.wake.notify_one();
+}
+
+int job_worker_index(const JobSystem& js) {
+    return worker_index >= 0 ? worker_index : js.num_workers;
+}
+
+// The parts of one parallel_for or parallel_invoke. The caller and helper
+// jobs on the pool claim parts by index; the caller runs only its own
+// group's parts, never other queued jobs, so a tick doesn't end up waiting
+// on another match's tick or a serializer. Helpers hold the group, since one
+// may only start after the caller has returned, and then finds nothing left.
+struct JobGroup {
+    size_t parts = 0;
+    atomic<size_t> next{0};
+    atomic<size_t> done{0};
+    mutex done_mutex;
+    condition_variable finished;
+};
+
+static void run_parts(JobGroup& group, const function<void(size_t)>& part) {
+    for (size_t i; (i = group.next.fetch_add(1, memory_order_relaxed)) < group.parts;) {
+        part(i);
+        if (group.done.fetch_add(1, memory_order_acq_rel) + 1 == group.parts) {
+            // Taking the lock orders this wakeup after the caller's check of done
+            { lock_guard<mutex> lock(group.done_mutex); }
+            group.finished.notify_all();
+        }
+    }
+}
+
+static void run_group(JobSystem& js, size_t parts, const function<void(size_t)>& part) {
+    auto group = make_shared<JobGroup>();
+    group->parts = parts;
+    // The caller takes parts too, so one fewer helper than parts is enough
+    size_t helpers = min(parts - 1, (size_t)js.num_workers);
+    const function<void(size_t)>* run = &part;
+    for (size_t h = 0; h < helpers; h++) {
+        // run is only used while a part is claimed, and the caller waits for those
+        job_system_submit(js, [group, run] { run_parts(*group, *run); });
+    }
+    run_parts(*group, part);
+    unique_lock<mutex> lock(group->done_mutex);
+    group->finished.wait(lock, [&] { return group->done.load(memory_order_acquire) == parts; });
+}
+
+void parallel_for(JobSystem& js, size_t count, size_t grain, const function<void(size_t, size_t)>& fn) {
+    grain = max<size_t>(grain, 1);
+    if (count <= grain || js.num_workers <= 1) {
+        if (count > 0) fn(0, count);
+        return;
+    }
+    run_group(js, (count + grain - 1) / grain, [&](size_t r) {
+        size_t begin = r * grain;
+        fn(begin, min(begin + grain, count));
+    });
+}
+
+void parallel_invoke(JobSystem& js, initializer_list<function<void()>> fns) {
+    if (fns.size() == 0) return;
+    if (js.num_workers <= 1) {
+        for (const function<void()>& fn : fns) fn();
+        return;
+    }
+    run_group(js, fns.size(), [&](size_t i) { fns.begin()[i](); });
+}
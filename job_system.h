@@ -0,0 +1,61 @@
+#ifndef JOB_SYSTEM_H
+#define JOB_SYSTEM_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed pool of worker threads with work stealing. Each worker takes jobs from
+// the back of its own queue; when that is empty it steals from the front of
+// the other workers' queues, so a burst submitted to one queue spreads over
+// the whole pool.
+
+using Job = std::function<void()>;
+
+struct WorkerQueue {
+    std::mutex mutex;
+    std::deque<Job> jobs;
+};
+
+struct JobSystem {
+    std::vector<std::thread> workers;
+    std::unique_ptr<WorkerQueue[]> queues;
+    int num_workers = 0;
+    std::atomic<uint32_t> next_queue{0};
+    std::atomic<int> queued{0};
+    std::atomic<bool> stopping{false};
+
+    // Idle workers sleep here until a job is submitted
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+};
+
+void job_system_start(JobSystem& js, int num_workers);
+
+// Runs the jobs already queued, then joins the workers.
+void job_system_stop(JobSystem& js);
+
+// Queues a job. Submitted from a worker it goes to that worker's own queue,
+// otherwise the queues are filled round-robin.
+void job_system_submit(JobSystem& js, Job job);
+
+// Index of the calling worker, or num_workers on any other thread, for
+// picking a per-thread buffer
+int job_worker_index(const JobSystem& js);
+
+// Splits [0, count) into ranges of at most grain items and runs fn(begin, end)
+// on them across the pool. The calling thread runs ranges too, then sleeps
+// until the ones other workers took are done; it never runs unrelated jobs,
+// so this can be used from inside a job. Small counts run inline.
+void parallel_for(JobSystem& js, size_t count, size_t grain, const std::function<void(size_t, size_t)>& fn);
+
+// Runs the functions concurrently and returns once all have finished.
+void parallel_invoke(JobSystem& js, std::initializer_list<std::function<void()>> fns);
+
+#endif
@@ -0,0 +1,556 @@
+// Headless load generator: thousands of simulated players from one process,
+// each with a socket of its own, so the server sees them as separate clients.
+// Players join at a set rate, play a script or move at random, fire, jump,
+// and optionally leave and come back. Reports snapshot inter-arrival times,
+// join latency and bytes received every second, and at the end the largest
+// player count at which the server kept up.
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+#include "protocol.h"
+#include "reliable.h"
+#include "bundle.h"
+#include "net.h"
+#include "profile.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+#define MAX_EVENTS 256
+#define SERVER_TICK_RATE (1000.0 / 33.0)
+
+const int JOIN_TIMEOUT_S = 10;
+const int LEAVE_LINGER_MS = 1000;
+const int REJOIN_DELAY_MS = 1000;
+// A window where players get at least this share of the tick rate, with
+// 99% of snapshots at most HEALTHY_P99_MS apart, kept up
+const double HEALTHY_RATE_SHARE = 0.95;
+const double HEALTHY_P99_MS = 100.0;
+
+// One line of a --script file: for this many seconds move this way, turn
+// at this rate, and fire and jump or not. Players loop over the script.
+struct ScriptStep {
+    float seconds;
+    MovementDirection movement;
+    float turn_deg_per_s;
+    bool fire;
+    bool jump;
+};
+
+struct LoadgenConfig {
+    int clients = 1000;
+    double join_rate = 100.0;    // joins per second at the start
+    double act_rate = 30.0;      // ACTs per second per player
+    int duration_s = 30;
+    int threads = 1;
+    double lifetime_s = 0.0;     // mean time a player stays; 0 stays to the end
+    double fire_chance = 0.03;   // per ACT, for random players
+    double jump_chance = 0.015;
+    vector<ScriptStep> script;
+};
+
+LoadgenConfig config;
+sockaddr_in server_addr{};
+
+enum BotState {
+    BOT_IDLE,
+    BOT_JOINING,
+    BOT_PLAYING,
+    BOT_LEAVING,
+    BOT_DENIED,
+};
+
+struct Bot {
+    int sock = -1;
+    ReliableEndpoint channel;
+    PacketBundler bundler;
+    BotState state = BOT_IDLE;
+    Clock::time_point join_at;      // when idle
+    Clock::time_point join_start;
+    Clock::time_point leave_at;     // when playing; max() stays
+    Clock::time_point leave_start;
+    Clock::time_point next_send;
+    bool joined = false;
+    int map_chunks = 0;
+    uint32_t seq = 0;
+    uint64_t rng = 0;
+    float yaw = 0.0f;
+    MovementDirection movement = FORWARD;
+    size_t script_step = 0;
+    Clock::time_point step_start;
+    bool have_tick = false;
+    uint32_t last_tick = 0;
+    Clock::time_point last_tick_time;
+};
+
+struct Stats {
+    uint64_t snapshots = 0;  // new snapshot ticks received while playing
+    uint64_t datagrams = 0;
+    uint64_t bytes = 0;
+    uint64_t acts = 0;
+    uint64_t joins = 0;
+    uint64_t denied = 0;
+    uint64_t join_timeouts = 0;
+    uint64_t leaves = 0;
+    double player_seconds = 0.0;  // time spent playing, summed over players
+    LatencyHistogram interarrival;
+    LatencyHistogram join_latency;
+};
+
+static void stats_merge(Stats& into, const Stats& from) {
+    into.snapshots += from.snapshots;
+    into.datagrams += from.datagrams;
+    into.bytes += from.bytes;
+    into.acts += from.acts;
+    into.joins += from.joins;
+    into.denied += from.denied;
+    into.join_timeouts += from.join_timeouts;
+    into.leaves += from.leaves;
+    into.player_seconds += from.player_seconds;
+    histogram_merge(into.interarrival, from.interarrival);
+    histogram_merge(into.join_latency, from.join_latency);
+}
+
+// The players one thread runs. The reporter takes the window stats each second.
+struct Shard {
+    int epfd = -1;
+    vector<unique_ptr<Bot>> bots;
+    thread worker;
+    mutex stats_mutex;
+    Stats window;
+    atomic<int> playing{0};
+    atomic<int> joining{0};
+};
+
+atomic<bool> stopping{false};
+
+static uint32_t next_random(Bot& b) {
+    b.rng ^= b.rng << 13;
+    b.rng ^= b.rng >> 7;
+    b.rng ^= b.rng << 17;
+    return (uint32_t)(b.rng >> 32);
+}
+
+static double random_unit(Bot& b) {
+    return next_random(b) / 4294967296.0;
+}
+
+static uint64_t elapsed_ns(Clock::time_point from, Clock::time_point to) {
+    return chrono::duration_cast<chrono::nanoseconds>(to - from).count();
+}
+
+static bool open_socket(Shard& shard, Bot& b) {
+    b.sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (b.sock < 0) return false;
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = &b;
+    epoll_ctl(shard.epfd, EPOLL_CTL_ADD, b.sock, &ev);
+    return true;
+}
+
+static void close_socket(Bot& b) {
+    if (b.sock >= 0) close(b.sock);
+    b.sock = -1;
+}
+
+static void set_state(Shard& shard, Bot& b, BotState state) {
+    if (b.state == BOT_PLAYING) shard.playing--;
+    if (b.state == BOT_JOINING) shard.joining--;
+    b.state = state;
+    if (state == BOT_PLAYING) shard.playing++;
+    if (state == BOT_JOINING) shard.joining++;
+}
+
+// Fresh socket and channel, so a rejoining player is a new connection
+static void start_join(Shard& shard, Bot& b, Clock::time_point now) {
+    if (!open_socket(shard, b)) {
+        b.join_at = now + chrono::milliseconds(REJOIN_DELAY_MS);
+        return;
+    }
+    b.channel = ReliableEndpoint{};
+    b.joined = false;
+    b.map_chunks = 0;
+    b.have_tick = false;
+    b.join_start = now;
+    ControlPacket join_pkt{};
+    join_pkt.hdr.type = JOIN;
+    join_pkt.hdr.tick_id = b.seq++;
+    reliable_send(b.channel, &join_pkt, sizeof(join_pkt));
+    set_state(shard, b, BOT_JOINING);
+}
+
+static void finish_join(Shard& shard, Bot& b, Clock::time_point now, Stats& stats) {
+    set_state(shard, b, BOT_PLAYING);
+    stats.joins++;
+    histogram_record(stats.join_latency, elapsed_ns(b.join_start, now));
+    b.leave_at = Clock::time_point::max();
+    if (config.lifetime_s > 0.0) {
+        double lifetime = -log(1.0 - random_unit(b)) * config.lifetime_s;
+        b.leave_at = now + chrono::microseconds((int64_t)(lifetime * 1e6));
+    }
+    b.script_step = 0;
+    b.step_start = now;
+}
+
+static void handle_message(Shard& shard, Bot& b, const uint8_t* buf, size_t len, Clock::time_point now, Stats& stats) {
+    uint8_t type = ((const ProtoHeader*)buf)->type;
+    if (type == STATE && len >= sizeof(SnapshotPacket)) {
+        SnapshotPacket part;
+        memcpy(&part, buf, sizeof(part));
+        reliable_process_ack(b.channel, part.ack, now);
+        uint32_t tick = part.hdr.tick_id;
+        if (!b.have_tick || tick > b.last_tick) {
+            if (b.have_tick && b.state == BOT_PLAYING) {
+                histogram_record(stats.interarrival, elapsed_ns(b.last_tick_time, now));
+                stats.snapshots++;
+            }
+            b.have_tick = true;
+            b.last_tick = tick;
+            b.last_tick_time = now;
+        }
+    } else if (type == ACK && len >= sizeof(AckPacket)) {
+        reliable_process_ack(b.channel, ((const AckPacket*)buf)->ack, now);
+    } else if (type == JOIN_DENIED) {
+        if (b.state == BOT_JOINING) {
+            stats.denied++;
+            close_socket(b);
+            set_state(shard, b, BOT_DENIED);
+        }
+    } else if ((type == JOIN_ACK || type == MAP_DATA) && len >= sizeof(ProtoHeader) + sizeof(ReliableHeader)) {
+        reliable_process_ack(b.channel, ((const ReliableHeader*)(buf + sizeof(ProtoHeader)))->ack, now);
+        reliable_receive(b.channel, buf, len);
+        size_t msg_len;
+        while (const uint8_t* msg = reliable_next_message(b.channel, &msg_len)) {
+            uint8_t msg_type = ((const ProtoHeader*)msg)->type;
+            if (msg_type == JOIN_ACK) b.joined = true;
+            if (msg_type == MAP_DATA) b.map_chunks++;
+        }
+        if (b.state == BOT_JOINING && b.joined && b.map_chunks >= MAP_CHUNK_COUNT) finish_join(shard, b, now, stats);
+    }
+}
+
+static void receive(Shard& shard, Bot& b, Stats& stats) {
+    static thread_local uint8_t buf[MAX_MTU];
+    ssize_t len;
+    while (b.sock >= 0 && (len = recv(b.sock, buf, sizeof(buf), MSG_DONTWAIT)) >= (ssize_t)sizeof(ProtoHeader)) {
+        auto now = Clock::now();
+        stats.datagrams++;
+        stats.bytes += len;
+        if (((ProtoHeader*)buf)->type == BUNDLE) {
+            size_t offset = 0;
+            const uint8_t* msg;
+            size_t msg_len;
+            while (bundle_next(buf, len, &offset, &msg, &msg_len)) {
+                handle_message(shard, b, msg, msg_len, now, stats);
+            }
+        } else {
+            handle_message(shard, b, buf, len, now, stats);
+        }
+    }
+}
+
+// Steers by the script, or turns slowly and changes direction now and then
+static void fill_action(Bot& b, ActionPacket& action, Clock::time_point now) {
+    float dt = 1.0f / (float)config.act_rate;
+    if (!config.script.empty()) {
+        while (chrono::duration<float>(now - b.step_start).count() >= config.script[b.script_step].seconds) {
+            b.step_start += chrono::microseconds((int64_t)(config.script[b.script_step].seconds * 1e6));
+            b.script_step = (b.script_step + 1) % config.script.size();
+        }
+        const ScriptStep& step = config.script[b.script_step];
+        b.yaw += step.turn_deg_per_s * dt * (float)M_PI / 180.0f;
+        action.movement_dir = step.movement;
+        action.is_firing = step.fire;
+        action.is_jumping = step.jump;
+    } else {
+        b.yaw += 3.0f * dt;
+        if (random_unit(b) < dt / 2.0f) b.movement = (MovementDirection)(next_random(b) % (NONE + 1));
+        action.movement_dir = b.movement;
+        action.is_firing = random_unit(b) < config.fire_chance;
+        action.is_jumping = random_unit(b) < config.jump_chance;
+    }
+    action.view_dir = glm::vec3(cosf(b.yaw), 0.0f, sinf(b.yaw));
+}
+
+static void send_to_server(Bot& b, Clock::time_point now, Stats& stats) {
+    bundle_begin(b.bundler, b.sock, server_addr, DEFAULT_MTU, 0);
+    reliable_update(b.channel, now, b.bundler);
+    if (b.state == BOT_PLAYING) {
+        ActionPacket action{};
+        action.hdr.type = ACT;
+        action.hdr.tick_id = b.seq++;
+        action.send_time_us = (uint32_t)chrono::duration_cast<chrono::microseconds>(now.time_since_epoch()).count();
+        action.echo_tick = b.have_tick ? b.last_tick : ECHO_NONE;
+        action.echo_delay_us = (uint32_t)chrono::duration_cast<chrono::microseconds>(now - b.last_tick_time).count();
+        fill_action(b, action, now);
+        reliable_write_ack(b.channel, action.ack);
+        bundle_add(b.bundler, &action, sizeof(action));
+        stats.acts++;
+    } else if (b.channel.ack_pending) {
+        AckPacket pkt{};
+        pkt.hdr.type = ACK;
+        reliable_write_ack(b.channel, pkt.ack);
+        bundle_add(b.bundler, &pkt, sizeof(pkt));
+    }
+    bundle_flush(b.bundler);
+}
+
+static void start_leave(Shard& shard, Bot& b, Clock::time_point now) {
+    ControlPacket leave_pkt{};
+    leave_pkt.hdr.type = LEAVE;
+    leave_pkt.hdr.tick_id = b.seq++;
+    reliable_send(b.channel, &leave_pkt, sizeof(leave_pkt));
+    b.leave_start = now;
+    set_state(shard, b, BOT_LEAVING);
+}
+
+// Moves a player along its life cycle and sends whatever is due
+static void step_bot(Shard& shard, Bot& b, Clock::time_point now, Stats& stats) {
+    if (b.state == BOT_IDLE) {
+        if (now < b.join_at) return;
+        start_join(shard, b, now);
+        b.next_send = now;
+    }
+    if (b.state == BOT_DENIED || b.state == BOT_IDLE || now < b.next_send) return;
+    b.next_send += chrono::microseconds((int64_t)(1e6 / config.act_rate));
+    if (b.next_send < now) b.next_send = now;
+
+    if (b.state == BOT_JOINING && now - b.join_start > chrono::seconds(JOIN_TIMEOUT_S)) {
+        stats.join_timeouts++;
+        close_socket(b);
+        set_state(shard, b, BOT_IDLE);
+        b.join_at = now + chrono::milliseconds(REJOIN_DELAY_MS);
+        return;
+    }
+    if (b.state == BOT_PLAYING && now >= b.leave_at) start_leave(shard, b, now);
+    if (b.state == BOT_LEAVING
+        && (b.channel.num_unacked == 0 || now - b.leave_start > chrono::milliseconds(LEAVE_LINGER_MS))) {
+        stats.leaves++;
+        close_socket(b);
+        set_state(shard, b, BOT_IDLE);
+        b.join_at = now + chrono::milliseconds(REJOIN_DELAY_MS);
+        return;
+    }
+    send_to_server(b, now, stats);
+}
+
+static void run_shard(Shard& shard) {
+    epoll_event events[MAX_EVENTS];
+    Stats stats;
+    auto last_pass = Clock::now();
+    while (!stopping.load(memory_order_relaxed)) {
+        int nfds = epoll_wait(shard.epfd, events, MAX_EVENTS, 1);
+        for (int i = 0; i < nfds; i++) {
+            receive(shard, *(Bot*)events[i].data.ptr, stats);
+        }
+        auto now = Clock::now();
+        stats.player_seconds += shard.playing * chrono::duration<double>(now - last_pass).count();
+        last_pass = now;
+        // With --net io_uring the sends of one pass go out in one submission
+        net_batch_begin();
+        for (auto& b : shard.bots) step_bot(shard, *b, now, stats);
+        net_batch_end();
+
+        lock_guard<mutex> lock(shard.stats_mutex);
+        stats_merge(shard.window, stats);
+        stats = Stats{};
+    }
+    // One LEAVE attempt each so the server frees the slots without waiting for timeouts
+    auto now = Clock::now();
+    for (auto& b : shard.bots) {
+        if (b->state == BOT_PLAYING || b->state == BOT_JOINING) {
+            start_leave(shard, *b, now);
+            send_to_server(*b, now, stats);
+        }
+        close_socket(*b);
+    }
+}
+
+static bool load_script(const char* path) {
+    ifstream in(path);
+    if (!in) return false;
+    string line;
+    while (getline(in, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        istringstream fields(line);
+        ScriptStep step;
+        int movement, fire, jump;
+        if (!(fields >> step.seconds >> movement >> step.turn_deg_per_s >> fire >> jump) || step.seconds <= 0.0f
+            || movement < FORWARD || movement > NONE) {
+            cerr << path << ": bad line: " << line << "\n";
+            return false;
+        }
+        step.movement = (MovementDirection)movement;
+        step.fire = fire != 0;
+        step.jump = jump != 0;
+        config.script.push_back(step);
+    }
+    return !config.script.empty();
+}
+
+static double ms(uint64_t ns) {
+    return ns / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        cerr << "Usage: " << argv[0] << " <server_ip> <port> [--clients <n>] [--join-rate <joins/s>] [--rate <ACTs/s>] "
+                "[--duration <s>] [--threads <n>] [--lifetime <s>] [--script <file>] [--net epoll|io_uring]\n";
+        return 1;
+    }
+    bool use_io_uring = false;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+            config.clients = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--join-rate") == 0 && i + 1 < argc) {
+            config.join_rate = max(0.1, atof(argv[++i]));
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            config.act_rate = max(1.0, atof(argv[++i]));
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            config.duration_s = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            config.threads = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--lifetime") == 0 && i + 1 < argc) {
+            config.lifetime_s = max(0.0, atof(argv[++i]));
+        } else if (strcmp(argv[i], "--script") == 0 && i + 1 < argc) {
+            if (!load_script(argv[++i])) { cerr << "Can't use script " << argv[i] << "\n"; return 1; }
+        } else if (strcmp(argv[i], "--net") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "io_uring") == 0) use_io_uring = true;
+            else if (strcmp(argv[i], "epoll") != 0) { cerr << "Unknown network backend " << argv[i] << "\n"; return 1; }
+        } else {
+            cerr << "Unknown option " << argv[i] << "\n";
+            return 1;
+        }
+    }
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(atoi(argv[2]));
+    inet_aton(argv[1], &server_addr.sin_addr);
+    net_enable_batching(use_io_uring);
+
+    // A socket per player
+    rlimit files;
+    getrlimit(RLIMIT_NOFILE, &files);
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+    if ((rlim_t)config.clients + 64 > files.rlim_cur) {
+        cerr << "Only " << files.rlim_cur << " file descriptors are allowed; raise the limit for " << config.clients << " clients\n";
+        return 1;
+    }
+
+    vector<unique_ptr<Shard>> shards;
+    for (int t = 0; t < config.threads; t++) {
+        shards.push_back(make_unique<Shard>());
+        shards.back()->epfd = epoll_create1(0);
+    }
+    auto start = Clock::now();
+    for (int i = 0; i < config.clients; i++) {
+        auto b = make_unique<Bot>();
+        b->join_at = start + chrono::microseconds((int64_t)(i * 1e6 / config.join_rate));
+        b->rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        b->yaw = (float)(i % 360) * (float)M_PI / 180.0f;
+        shards[i % config.threads]->bots.push_back(move(b));
+    }
+    printf("%d clients joining at %.0f/s, %.0f ACTs/s each, %d threads, %s sends\n", config.clients, config.join_rate,
+           config.act_rate, config.threads, use_io_uring ? "io_uring" : "epoll");
+    for (auto& shard : shards) {
+        Shard* s = shard.get();
+        s->worker = thread([s] { run_shard(*s); });
+    }
+
+    Stats total;
+    // Windows with no player joining, as (average players, kept up)
+    vector<pair<int, bool>> steady;
+    int denied_at = 0;  // players when the first join was denied
+    auto window_start = start;
+    while (Clock::now() - start < chrono::seconds(config.duration_s)) {
+        this_thread::sleep_until(window_start + chrono::seconds(1));
+        auto now = Clock::now();
+        double window_s = chrono::duration<double>(now - window_start).count();
+        window_start = now;
+        Stats window;
+        int playing = 0, joining = 0;
+        for (auto& shard : shards) {
+            lock_guard<mutex> lock(shard->stats_mutex);
+            stats_merge(window, shard->window);
+            shard->window = Stats{};
+            playing += shard->playing;
+            joining += shard->joining;
+        }
+        stats_merge(total, window);
+        // Per player-second, so players joining or leaving mid-window don't skew it
+        double rate = window.player_seconds > 0.0 ? window.snapshots / window.player_seconds : 0.0;
+        int average_playing = (int)lround(window.player_seconds / window_s);
+        double p99_ms = ms(histogram_percentile(window.interarrival, 0.99));
+        printf("%3.0f s: playing %d joining %d | snapshots/s per player %.1f (server %.1f) | inter-arrival ms p50 %.1f "
+               "p99 %.1f max %.1f | joins %llu denied %llu | %.0f kB/s in\n",
+               chrono::duration<double>(now - start).count(), playing, joining, rate, SERVER_TICK_RATE,
+               ms(histogram_percentile(window.interarrival, 0.5)), p99_ms, ms(window.interarrival.max),
+               (unsigned long long)window.joins, (unsigned long long)window.denied, window.bytes / window_s / 1000.0);
+        fflush(stdout);
+        if (window.denied && !denied_at) denied_at = playing;
+        // Snapshots stall while the server sends joining players the map,
+        // which says nothing about how many players it can keep up with
+        if (average_playing > 0 && window.interarrival.total > 0 && joining == 0 && window.joins == 0) {
+            steady.push_back({average_playing, rate >= HEALTHY_RATE_SHARE * SERVER_TICK_RATE && p99_ms <= HEALTHY_P99_MS});
+        }
+    }
+    stopping = true;
+    for (auto& shard : shards) {
+        shard->worker.join();
+        stats_merge(total, shard->window);
+    }
+
+    double run_s = chrono::duration<double>(Clock::now() - start).count();
+    printf("joins %llu, denied %llu, timed out %llu, left %llu; join latency ms p50 %.1f p99 %.1f max %.1f\n",
+           (unsigned long long)total.joins, (unsigned long long)total.denied, (unsigned long long)total.join_timeouts,
+           (unsigned long long)total.leaves, ms(histogram_percentile(total.join_latency, 0.5)),
+           ms(histogram_percentile(total.join_latency, 0.99)), ms(total.join_latency.max));
+    printf("snapshot inter-arrival ms p50 %.1f p99 %.1f p99.9 %.1f max %.1f over %llu snapshots\n",
+           ms(histogram_percentile(total.interarrival, 0.5)), ms(histogram_percentile(total.interarrival, 0.99)),
+           ms(histogram_percentile(total.interarrival, 0.999)), ms(total.interarrival.max),
+           (unsigned long long)total.interarrival.total);
+    printf("received %llu datagrams, %.1f MB (%.0f kB/s); sent %llu ACTs\n", (unsigned long long)total.datagrams,
+           total.bytes / 1e6, total.bytes / run_s / 1000.0, (unsigned long long)total.acts);
+    // The most players below which every window kept up
+    sort(steady.begin(), steady.end());
+    int fell_behind_at = 0;
+    for (auto& [players, kept_up] : steady) {
+        if (!kept_up) {
+            fell_behind_at = players;
+            break;
+        }
+    }
+    int kept_up_at = 0;
+    for (auto& [players, kept_up] : steady) {
+        if (kept_up && (!fell_behind_at || players < fell_behind_at)) kept_up_at = players;
+    }
+    if (steady.empty()) {
+        printf("capacity: not measured, players were joining in every window");
+    } else {
+        printf("capacity: kept up with %d players", kept_up_at);
+        if (fell_behind_at) printf(", fell behind at %d", fell_behind_at);
+    }
+    if (denied_at) printf(", denied joins at %d", denied_at);
+    printf("\n");
+    return total.joins > 0 && !steady.empty() && !fell_behind_at ? 0 : 1;
+}
@@ -0,0 +1,222 @@
+#include <cstdio>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "log.h"
+#include "spsc_ring.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+const size_t LOG_RING_RECORDS = 256;
+const int LOG_FLUSH_INTERVAL_MS = 10;
+// Per call site and thread: bursts of up to LOG_RATE_BURST records, then
+// LOG_RATE_PER_S records a second
+const double LOG_RATE_PER_S = 50.0;
+const double LOG_RATE_BURST = 500.0;
+const int LOG_RATE_SLOTS = 64;
+// Slots tried for a call site before evicting the least recently used
+const int LOG_RATE_PROBES = 4;
+
+struct LogRing {
+    SpscRing<LogRecord, LOG_RING_RECORDS> records;
+};
+
+struct RateLimit {
+    const char* format = nullptr;
+    double tokens = 0.0;
+    uint64_t last_ns = 0;
+    uint32_t suppressed = 0;
+};
+
+atomic<int> log_min_level{LOG_INFO};
+
+// Rings are never freed, so records from a thread that has exited still drain
+static mutex rings_mutex;
+static vector<LogRing*> rings;
+static thread_local LogRing* thread_ring = nullptr;
+static thread_local LogRecord pending;
+static thread_local RateLimit rate_limits[LOG_RATE_SLOTS];
+
+static atomic<bool> writer_running{false};
+static atomic<uint64_t> dropped{0};
+static uint64_t dropped_reported = 0;  // guarded by output_mutex
+static thread writer;
+static mutex writer_mutex;
+static condition_variable writer_wake;
+static bool writer_stopping = false;
+static mutex output_mutex;  // the writer, and threads writing synchronously
+static Clock::time_point log_epoch = Clock::now();
+
+bool log_parse_level(const char* name, LogLevel* level) {
+    static const char* const names[] = {"debug", "info", "warning", "error"};
+    for (int i = LOG_DEBUG; i <= LOG_ERROR; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *level = (LogLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t log_dropped_count() {
+    return dropped.load(memory_order_relaxed);
+}
+
+static LogRing* get_ring() {
+    if (!thread_ring) {
+        thread_ring = new LogRing;
+        lock_guard<mutex> lock(rings_mutex);
+        rings.push_back(thread_ring);
+    }
+    return thread_ring;
+}
+
+LogRecord* log_begin(LogLevel level, const char* format) {
+    uint64_t now = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - log_epoch).count();
+    // Open addressing, so two busy call sites that hash alike don't keep
+    // resetting each other's budget
+    size_t home = ((uintptr_t)format >> 3) % LOG_RATE_SLOTS;
+    RateLimit* found = nullptr;
+    RateLimit* oldest = &rate_limits[home];
+    for (int i = 0; i < LOG_RATE_PROBES; i++) {
+        RateLimit* slot = &rate_limits[(home + i) % LOG_RATE_SLOTS];
+        if (slot->format == format || !slot->format) {
+            found = slot;
+            break;
+        }
+        if (slot->last_ns < oldest->last_ns) oldest = slot;
+    }
+    RateLimit& limit = found ? *found : *oldest;
+    if (limit.format != format) {
+        limit = RateLimit{};
+        limit.format = format;
+        limit.tokens = LOG_RATE_BURST;
+    } else {
+        limit.tokens = min(LOG_RATE_BURST, limit.tokens + (now - limit.last_ns) / 1e9 * LOG_RATE_PER_S);
+    }
+    limit.last_ns = now;
+    if (limit.tokens < 1.0) {
+        limit.suppressed++;
+        return nullptr;
+    }
+    limit.tokens -= 1.0;
+
+    LogRecord* r = &pending;
+    r->ts_ns = now;
+    r->format = format;
+    r->suppressed = limit.suppressed;
+    r->level = (uint8_t)level;
+    r->num_args = 0;
+    r->text_len = 0;
+    limit.suppressed = 0;
+    return r;
+}
+
+static void format_record(const LogRecord& r, string& out) {
+    static const char* const prefixes[] = {"debug: ", "", "warning: ", "error: "};
+    out += prefixes[r.level];
+    int next_arg = 0;
+    char num[32];
+    for (const char* p = r.format; *p; p++) {
+        if (p[0] != '{' || p[1] != '}' || next_arg >= r.num_args) {
+            out += *p;
+            continue;
+        }
+        const LogArg& a = r.args[next_arg++];
+        switch (a.kind) {
+        case LogArg::INT: snprintf(num, sizeof(num), "%lld", (long long)a.i); out += num; break;
+        case LogArg::UINT: snprintf(num, sizeof(num), "%llu", (unsigned long long)a.u); out += num; break;
+        case LogArg::DOUBLE: snprintf(num, sizeof(num), "%g", a.d); out += num; break;
+        case LogArg::TEXT: out.append(r.text + a.text.offset, a.text.len); break;
+        }
+        p++;
+    }
+    if (r.suppressed) {
+        snprintf(num, sizeof(num), "%u", r.suppressed);
+        out += " (";
+        out += num;
+        out += " similar messages suppressed)";
+    }
+    out += '\n';
+}
+
+static void write_records(const vector<LogRecord>& records) {
+    string out, err;
+    for (const LogRecord& r : records) {
+        format_record(r, r.level >= LOG_WARNING ? err : out);
+    }
+    // Threads writing synchronously while the writer isn't running get here
+    // too, so dropped_reported is only touched under the lock
+    lock_guard<mutex> lock(output_mutex);
+    uint64_t total_dropped = dropped.load(memory_order_relaxed);
+    if (total_dropped != dropped_reported) {
+        err += "warning: " + to_string(total_dropped - dropped_reported) + " log records dropped on full buffers\n";
+        dropped_reported = total_dropped;
+    }
+    if (!out.empty()) {
+        fwrite(out.data(), 1, out.size(), stdout);
+        fflush(stdout);
+    }
+    if (!err.empty()) {
+        fwrite(err.data(), 1, err.size(), stderr);
+        fflush(stderr);
+    }
+}
+
+void log_commit(LogRecord* record) {
+    if (!writer_running.load(memory_order_acquire)) {
+        write_records({*record});
+        return;
+    }
+    if (!get_ring()->records.push(*record)) {
+        dropped.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+static void drain_rings() {
+    vector<LogRing*> snapshot;
+    {
+        lock_guard<mutex> lock(rings_mutex);
+        snapshot = rings;
+    }
+    static vector<LogRecord> records;
+    records.clear();
+    LogRecord r;
+    for (LogRing* ring : snapshot) {
+        while (ring->records.pop(r)) records.push_back(r);
+    }
+    // Each ring is in order already; this interleaves the threads
+    stable_sort(records.begin(), records.end(), [](const LogRecord& a, const LogRecord& b) {
+        return a.ts_ns < b.ts_ns;
+    });
+    write_records(records);
+}
+
+static void writer_main() {
+    unique_lock<mutex> lock(writer_mutex);
+    while (!writer_stopping) {
+        writer_wake.wait_for(lock, chrono::milliseconds(LOG_FLUSH_INTERVAL_MS));
+        drain_rings();
+    }
+}
+
+void log_start() {
+    writer_stopping = false;
+    writer = thread(writer_main);
+    writer_running.store(true, memory_order_release);
+}
+
+void log_stop() {
+    if (!writer_running.exchange(false)) return;
+    {
+        lock_guard<mutex> lock(writer_mutex);
+        writer_stopping = true;
+    }
+    writer_wake.notify_one();
+    writer.join();
+    drain_rings();
+}
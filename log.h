@@ -0,0 +1,118 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+// Asynchronous logging. A log call copies its format string pointer and
+// arguments into a fixed-size record on the calling thread's ring; a
+// background thread formats the records, in timestamp order, and writes
+// them out. Logging never blocks on the terminal: when a ring is full the
+// record is dropped and counted.
+//
+// Formats use {} for each argument. Integers print in decimal, floating
+// point like %g and strings as they are. The format must be a string literal:
+// it is kept by pointer, and each call site is rate limited separately.
+
+enum LogLevel {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARNING,
+    LOG_ERROR,
+};
+
+const int LOG_MAX_ARGS = 12;
+const size_t LOG_TEXT_BYTES = 480;  // string arguments of one record, truncated past this
+
+struct LogArg {
+    enum Kind : uint8_t { INT, UINT, DOUBLE, TEXT } kind;
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+        struct {
+            uint16_t offset;
+            uint16_t len;
+        } text;
+    };
+};
+
+struct LogRecord {
+    uint64_t ts_ns;
+    const char* format;
+    uint32_t suppressed;  // records from this call site dropped by the rate limiter just before this one
+    uint8_t level;
+    uint8_t num_args;
+    uint16_t text_len;
+    LogArg args[LOG_MAX_ARGS];
+    char text[LOG_TEXT_BYTES];
+};
+
+extern std::atomic<int> log_min_level;
+
+// Starts the writer thread. Until then, and after log_stop(), records are
+// formatted and written on the calling thread.
+void log_start();
+void log_stop();
+// Parses debug, info, warning or error; returns false for anything else
+bool log_parse_level(const char* name, LogLevel* level);
+// Records lost to full rings since the start
+uint64_t log_dropped_count();
+
+LogRecord* log_begin(LogLevel level, const char* format);
+void log_commit(LogRecord* record);
+
+inline void log_pack_text(LogRecord& r, const char* s, size_t len) {
+    LogArg& a = r.args[r.num_args++];
+    a.kind = LogArg::TEXT;
+    len = std::min(len, LOG_TEXT_BYTES - r.text_len);
+    memcpy(r.text + r.text_len, s, len);
+    a.text.offset = r.text_len;
+    a.text.len = (uint16_t)len;
+    r.text_len += (uint16_t)len;
+}
+
+inline void log_pack(LogRecord& r, const char* s) { log_pack_text(r, s, strlen(s)); }
+inline void log_pack(LogRecord& r, char* s) { log_pack_text(r, s, strlen(s)); }
+inline void log_pack(LogRecord& r, const std::string& s) { log_pack_text(r, s.data(), s.size()); }
+
+template <typename T>
+inline void log_pack(LogRecord& r, T value) {
+    static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value, "log arguments are numbers or strings");
+    LogArg& a = r.args[r.num_args++];
+    if constexpr (std::is_floating_point<T>::value) {
+        a.kind = LogArg::DOUBLE;
+        a.d = (double)value;
+    } else if constexpr (std::is_signed<T>::value || std::is_enum<T>::value) {
+        a.kind = LogArg::INT;
+        a.i = (int64_t)value;
+    } else {
+        a.kind = LogArg::UINT;
+        a.u = (uint64_t)value;
+    }
+}
+
+template <typename... Args>
+void log_write(LogLevel level, const char* format, const Args&... args) {
+    static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "too many log arguments");
+    if (level < log_min_level.load(std::memory_order_relaxed)) return;
+    LogRecord* r = log_begin(level, format);
+    if (!r) return;
+    (log_pack(*r, args), ...);
+    log_commit(r);
+}
+
+template <typename... Args>
+void log_debug(const char* format, const Args&... args) { log_write(LOG_DEBUG, format, args...); }
+template <typename... Args>
+void log_info(const char* format, const Args&... args) { log_write(LOG_INFO, format, args...); }
+template <typename... Args>
+void log_warning(const char* format, const Args&... args) { log_write(LOG_WARNING, format, args...); }
+template <typename... Args>
+void log_error(const char* format, const Args&... args) { log_write(LOG_ERROR, format, args...); }
+
+#endif
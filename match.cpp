@@ -0,0 +1,1407 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cstddef>
+#include <cfloat>
+#include <cmath>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "match.h"
+#include "net.h"
+#include "log.h"
+
+using namespace std;
+
+MatchConfig match_config;
+
+const float PLAYER_HEIGHT = 0.9f;
+const float PLAYER_SPEED = 3.5f;
+const float PROJECTILE_SPEED = 100.0f;
+const float PLAYER_RADIUS = 0.3f;
+const float PROJECTILE_RADIUS = 0.05f;
+const int FIRE_COOLDOWN_MS = 200;
+const int CLIENT_TIMEOUT_S = 15;
+const float STEP_DISTANCE = 2.0f;
+const float GRAVITY = -9.8f;
+const float JUMP_POWER = 5.0f;
+const float MAX_STEP_HEIGHT = 1.1f;
+const int RESPAWN_DELAY_S = 3;
+// Despawned projectiles are repeated in this many snapshots so a lost part
+// doesn't leave a stale projectile on the client
+const uint32_t DESPAWN_RESEND_TICKS = 10;
+// Unused budget carries over for at most this long
+const float BANDWIDTH_BURST_S = 0.2f;
+// Adaptive budget: a client losing more than this fraction of its packets, or
+// whose round trip is this far above its minimum, is sent less. The budget
+// shrinks by half its size per second, down to a quarter of the configured
+// budget, and grows back by a tenth of the configured budget per second.
+const float BANDWIDTH_LOSS_THRESHOLD = 0.02f;
+const float BANDWIDTH_QUEUE_DELAY_MS = 60.0f;
+const float BANDWIDTH_BACKOFF_PER_S = 0.5f;
+const float BANDWIDTH_RECOVER_PER_S = 0.1f;
+const float BANDWIDTH_MIN_FRACTION = 0.25f;
+// Relevance halves at this distance
+const float PRIORITY_FALLOFF_DISTANCE = 10.0f;
+const float DESPAWN_PRIORITY_BOOST = 4.0f;
+// Entities not sent for this long go out regardless of budget, well before
+// the client would expire them
+const uint32_t MAX_STALE_TICKS = 15;
+// A removal goes out in every snapshot for this long, in case parts are lost
+const uint32_t REMOVAL_REPEAT_TICKS = 3;
+const int STATS_INTERVAL_S = 5;
+// The hash log and recording are flushed this often, not every tick
+const uint32_t RECORD_FLUSH_TICKS = 30;
+// Items per job for the data-parallel tick phases; smaller matches run inline
+const size_t PLAYER_JOB_GRAIN = 16;
+const size_t PROJECTILE_JOB_GRAIN = 64;
+const size_t SNAPSHOT_JOB_GRAIN = 4;
+// Area of interest grid, in voxels on the XZ plane
+const int AOI_CELL_SIZE = 8;
+const int AOI_CELLS_X = (MAP_WIDTH + AOI_CELL_SIZE - 1) / AOI_CELL_SIZE;
+const int AOI_CELLS_Z = (MAP_LENGTH + AOI_CELL_SIZE - 1) / AOI_CELL_SIZE;
+// An entity enters a client's area of interest at aoi_radius and leaves it
+// only beyond this multiple, so it doesn't flicker at the edge
+const float AOI_EXIT_SCALE = 1.25f;
+// Cached sound propagation fields per match, MAP_VOXELS bytes each
+const size_t SOUND_FIELD_CACHE_ENTRIES = 64;
+
+string addr_string(const sockaddr_in& addr) {
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+    return string(ip) + ":" + to_string(ntohs(addr.sin_port));
+}
+
+void send_join_denied(const sockaddr_in& addr, uint16_t join_seq, JoinDeniedReason reason) {
+    JoinDeniedPacket pkt{};
+    pkt.hdr.type = JOIN_DENIED;
+    pkt.join_seq = join_seq;
+    pkt.reason = reason;
+    net_sendto(match_config.udp_socket, &pkt, sizeof(pkt), addr);
+}
+
+void send_stateless_leave_ack(const sockaddr_in& addr, uint16_t seq) {
+    AckPacket pkt{};
+    pkt.hdr.type = ACK;
+    pkt.ack.ack = seq;
+    pkt.ack.ack_bits = 1;
+    net_sendto(match_config.udp_socket, &pkt, sizeof(pkt), addr);
+}
+
+int Match::sim_rand() {
+    return (int)(sim_rng.next() >> 33);
+}
+
+// Simulation time. In deterministic mode it is derived from the tick counter
+// instead of the wall clock, so cooldowns and respawns land on the same tick
+// every run. Otherwise it is when the tick started.
+Clock::time_point Match::sim_now() {
+    if (match_config.deterministic_mode) {
+        return Clock::time_point(chrono::milliseconds((int64_t)current_tick * TICK_INTERVAL_MS));
+    }
+    return tick_time;
+}
+
+void Match::create_room_3d(int x, int y, int z, int width, int height, int length) {
+    for (int i = x; i < x + width; i++) {
+        for (int j = y; j < y + height; j++) {
+            for (int k = z; k < z + length; k++) {
+                if (i > 0 && i < MAP_WIDTH - 1 && j > 0 && j < MAP_HEIGHT - 1 && k > 0 && k < MAP_LENGTH - 1) {
+                    if (game_map[i][j][k] == SOLID) {
+                        game_map[i][j][k] = AIR;
+                        if (j == y) {
+                            spawn_points.push_back({(float)i + 0.5f, (float)j + 0.5f, (float)k + 0.5f});
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+void Match::create_ramp(Point3D start, Point3D end, int width) {
+    glm::vec3 p1 = {(float)start.x, (float)start.y, (float)start.z};
+    glm::vec3 p2 = {(float)end.x, (float)end.y, (float)end.z};
+    float dist = glm::distance(p1, p2);
+    if (dist == 0.0f) return;
+    glm::vec3 dir = glm::normalize(p2 - p1);
+
+    for (float i = 0; i < dist; i += 0.5f) {
+        glm::vec3 current_pos = p1 + dir * i;
+        int map_x = (int)current_pos.x;
+        int map_y = (int)current_pos.y;
+        int map_z = (int)current_pos.z;
+
+        for (int w = -width / 2; w <= width / 2; ++w) {
+            for (int fill_y = 0; fill_y <= map_y; ++fill_y) {
+                if (map_x >= 0 && map_x < MAP_WIDTH && fill_y >= 0 && fill_y < MAP_HEIGHT && (map_z + w) >= 0 && (map_z + w) < MAP_LENGTH) {
+                    game_map[map_x][fill_y][map_z + w] = SOLID;
+                }
+            }
+            if (map_x >= 0 && map_x < MAP_WIDTH && (map_y + 1) < MAP_HEIGHT && (map_z + w) >= 0 && (map_z + w) < MAP_LENGTH) {
+                game_map[map_x][map_y + 1][map_z + w] = AIR;
+                game_map[map_x][map_y + 2][map_z + w] = AIR;
+            }
+        }
+    }
+}
+
+void Match::create_h_tunnel_3d(int x1, int x2, int y, int z) {
+    for (int x = std::min(x1, x2); x <= std::max(x1, x2); x++) {
+        game_map[x][y][z] = AIR;
+        game_map[x][y+1][z] = AIR;
+        game_map[x][y-1][z] = SOLID;
+    }
+}
+
+void Match::create_v_tunnel_3d(int z1, int z2, int y, int x) {
+    for (int z = std::min(z1, z2); z <= std::max(z1, z2); z++) {
+        game_map[x][y][z] = AIR;
+        game_map[x][y+1][z] = AIR;
+        game_map[x][y-1][z] = SOLID;
+    }
+}
+
+std::vector<Room> Match::generate_level(int y_level, long unsigned int min_rooms, int room_height) {
+    std::vector<Room> rooms;
+    int max_attempts = 100;
+    int attempts = 0;
+
+    while (rooms.size() < min_rooms && attempts < max_attempts) {
+        attempts++;
+        int w = 6 + sim_rand() % 7;
+        int l = 6 + sim_rand() % 7;
+        int x = sim_rand() % (MAP_WIDTH - w - 1) + 1;
+        int z = sim_rand() % (MAP_LENGTH - l - 1) + 1;
+
+        Room new_room = {x, y_level, z, w, room_height, l};
+
+        bool failed = false;
+        for (const auto& other_room : rooms) {
+            if (new_room.intersects(other_room)) {
+                failed = true;
+                break;
+            }
+        }
+
+        if (!failed) {
+            create_room_3d(new_room.x, new_room.y, new_room.z, new_room.width, new_room.height, new_room.length);
+            rooms.push_back(new_room);
+        }
+    }
+    return rooms;
+}
+
+void Match::generate_map() {
+    spawn_points.clear();
+    for (int x = 0; x < MAP_WIDTH; x++) {
+        for (int y = 0; y < MAP_HEIGHT; y++) {
+            for (int z = 0; z < MAP_LENGTH; z++) {
+                game_map[x][y][z] = SOLID;
+            }
+        }
+    }
+
+    auto level1_rooms = generate_level(1, 5, 4);
+    auto level2_rooms = generate_level(6, 5, 4);
+    rooms = level1_rooms;
+    rooms.insert(rooms.end(), level2_rooms.begin(), level2_rooms.end());
+    room_links.assign(rooms.size(), 0);
+    auto link_rooms = [&](size_t a, size_t b) {
+        room_links[a] |= (1ULL << a) | (1ULL << b);
+        room_links[b] |= (1ULL << a) | (1ULL << b);
+    };
+    for (size_t i = 0; i < rooms.size(); i++) {
+        link_rooms(i, i);
+    }
+
+    for (size_t i = 0; i < level1_rooms.size() - 1; i++) {
+        Point3D center1 = level1_rooms[i].center();
+        Point3D center2 = level1_rooms[i+1].center();
+        create_h_tunnel_3d(center1.x, center2.x, 1, center2.z);
+        create_v_tunnel_3d(center1.z, center2.z, 1, center1.x);
+        link_rooms(i, i + 1);
+    }
+     for (size_t i = 0; i < level2_rooms.size() - 1; i++) {
+        Point3D center1 = level2_rooms[i].center();
+        Point3D center2 = level2_rooms[i+1].center();
+        create_h_tunnel_3d(center1.x, center2.x, 6, center2.z);
+        create_v_tunnel_3d(center1.z, center2.z, 6, center1.x);
+        link_rooms(level1_rooms.size() + i, level1_rooms.size() + i + 1);
+    }
+
+    if (level1_rooms.empty() || level2_rooms.empty()) {
+        log_warning("Match {}: map could be unconnected", id);
+        return;
+    }
+
+    for (int ramp = 0; ramp < 2; ramp++) {
+        size_t lower = sim_rand() % level1_rooms.size();
+        size_t upper = sim_rand() % level2_rooms.size();
+        create_ramp(level1_rooms[lower].center(), level2_rooms[upper].center(), 3);
+        link_rooms(lower, level1_rooms.size() + upper);
+    }
+}
+
+// Index into rooms of the room containing pos, or -1 in tunnels and on ramps
+int Match::room_at(const glm::vec3& pos) const {
+    int x = (int)floor(pos.x), y = (int)floor(pos.y), z = (int)floor(pos.z);
+    for (size_t i = 0; i < rooms.size(); i++) {
+        const Room& r = rooms[i];
+        if (x >= r.x && x < r.x + r.width && z >= r.z && z < r.z + r.length
+            && y >= r.y && y < r.y + r.height) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Sound events go to the serializer, which bundles them with the next snapshot it sends
+void Match::queue_sound(SoundType type, const glm::vec3& pos) {
+    SoundEventPacket pkt{};
+    pkt.hdr.type = SOUND_EVENT;
+    pkt.hdr.tick_id = current_tick;
+    pkt.sound_type = type;
+    pkt.pos = pos;
+    if (!sound_queue.push(pkt)) sounds_dropped++;
+}
+
+// Searches from just past the last slot handed out, so a large pool is not
+// rescanned from the start for every shot and freed slots rest a while
+// before reuse
+void Match::spawn_projectile(uint32_t owner_id, const glm::vec3& pos, const glm::vec3& dir) {
+    for (size_t n = 0; n < projectiles.size(); ++n) {
+        size_t i = (next_projectile_slot + n) % projectiles.size();
+        if (!projectiles[i].is_active) {
+            next_projectile_slot = i + 1;
+            projectiles[i].id = i;
+            projectiles[i].is_active = true;
+            projectiles[i].owner_id = owner_id;
+            projectiles[i].pos = pos;
+            projectiles[i].dir = dir;
+            return;
+        }
+    }
+}
+
+void Match::despawn_projectile(int i) {
+    projectiles[i].is_active = false;
+    projectile_despawn_tick[i] = current_tick;
+}
+
+bool check_line_sphere_collision(const glm::vec3& line_start, const glm::vec3& line_end, 
+    const glm::vec3& sphere_center, float sphere_radius) {
+
+    glm::vec3 line_dir = line_end - line_start;
+    glm::vec3 to_sphere = sphere_center - line_start;
+
+    float line_len_sq = glm::dot(line_dir, line_dir);
+    if (line_len_sq == 0.0f) {
+        return glm::length(to_sphere) < sphere_radius;
+    }
+
+    float t = glm::dot(to_sphere, line_dir) / line_len_sq;
+    t = glm::clamp(t, 0.0f, 1.0f);
+    glm::vec3 closest_point = line_start + t * line_dir;
+
+    return glm::distance(closest_point, sphere_center) < sphere_radius;
+}
+
+int Match::get_floor_height(int x, int z, int start_y) {
+    if (x < 0 || x >= MAP_WIDTH || z < 0 || z >= MAP_LENGTH) return -1;
+    for (int y = std::min(start_y, MAP_HEIGHT - 1); y >= 0; --y) {
+        if (game_map[x][y][z] == SOLID) {
+            return y;
+        }
+    }
+    return -1;
+}
+
+// Moves one player. Returns true when it took a step that should make a footstep sound.
+bool Match::update_player(ClientInfo& client, float dt) {
+    if (!client.state.is_alive) return false;
+
+    glm::vec3 initial_pos = client.state.pos;
+
+    glm::vec2 move_input(0.0f, 0.0f);
+    glm::vec2 view_dir_flat(client.state.view_dir.x, client.state.view_dir.z);
+    if (glm::length(view_dir_flat) > 0.0f) {
+        view_dir_flat = glm::normalize(view_dir_flat);
+    }
+    glm::vec2 right_dir(-view_dir_flat.y, view_dir_flat.x);
+
+    switch (client.state.movement_dir) {
+        case FORWARD:       move_input += view_dir_flat; break;
+        case BACKWARDS:     move_input -= view_dir_flat; break;
+        case LEFT:          move_input -= right_dir; break;
+        case RIGHT:         move_input += right_dir; break;
+        case FORWARD_LEFT:  move_input += view_dir_flat - right_dir; break;
+        case FORWARD_RIGHT: move_input += view_dir_flat + right_dir; break;
+        case BACKWARDS_LEFT:move_input -= view_dir_flat + right_dir; break;
+        case BACKWARDS_RIGHT:move_input -= view_dir_flat - right_dir; break;
+        default: break;
+    }
+
+    if (glm::length(move_input) > 0.0f) {
+        glm::vec2 total_move = glm::normalize(move_input) * PLAYER_SPEED * dt;
+        
+        float next_x = client.state.pos.x + total_move.x;
+        float next_z = client.state.pos.z + total_move.y;
+        int head_y = (int)(client.state.pos.y + PLAYER_HEIGHT / 2.0f * 0.9f);
+        
+        if (game_map[(int)next_x][head_y][(int)client.state.pos.z] == AIR) {
+            client.state.pos.x = next_x;
+        }
+         if (game_map[(int)client.state.pos.x][head_y][(int)next_z] == AIR) {
+            client.state.pos.z = next_z;
+        }
+    }
+    
+    client.velocityY += GRAVITY * dt;
+    client.state.pos.y += client.velocityY * dt;
+
+    int map_x = (int)client.state.pos.x;
+    int map_z = (int)client.state.pos.z;
+    
+    int head_y = (int)(client.state.pos.y + PLAYER_HEIGHT / 2.0f);
+    if (head_y < MAP_HEIGHT) {
+        if (game_map[map_x][head_y][map_z] == SOLID) {
+            client.velocityY = 0;
+            client.state.pos.y = (float)head_y - (PLAYER_HEIGHT / 2.0f) - 0.01f;
+        }
+    }
+
+    int floor_y = (int)(client.state.pos.y - PLAYER_HEIGHT / 2.0f);
+    if (floor_y >= 0) {
+        int block_under = game_map[map_x][floor_y][map_z];
+        if (block_under == SOLID) {
+            if (client.velocityY <= 0) {
+                client.state.pos.y = (float)floor_y + 1.0f + PLAYER_HEIGHT / 2.0f;
+                client.velocityY = 0;
+                client.state.on_ground = true;
+            }
+        } else {
+            client.state.on_ground = false;
+        }
+    } else {
+         client.state.on_ground = false;
+    }
+
+    if (glm::distance(initial_pos, client.state.pos) > 0.001f && client.state.on_ground) {
+        float distance_since_last_step = glm::distance(glm::vec2(client.state.pos.x, client.state.pos.z), glm::vec2(client.pos_at_last_step.x, client.pos_at_last_step.z));
+        if (distance_since_last_step >= STEP_DISTANCE) {
+            client.pos_at_last_step = client.state.pos;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Players only touch their own state, so they move in parallel. Footsteps are
+// queued afterwards in client order.
+void Match::update_players(float dt) {
+    footsteps.assign(client_list.size(), 0);
+    parallel_for(*match_config.jobs, client_list.size(), PLAYER_JOB_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; c++) {
+            footsteps[c] = update_player(*client_list[c].second, dt);
+        }
+    });
+    for (size_t c = 0; c < client_list.size(); c++) {
+        if (footsteps[c]) queue_sound(FOOTSTEP, client_list[c].second->state.pos);
+    }
+}
+
+// Moves projectiles and despawns those that left the map or hit a wall.
+// Independent of the players, so it can run alongside update_players.
+void Match::move_projectiles(float dt) {
+    parallel_for(*match_config.jobs, projectiles.size(), PROJECTILE_JOB_GRAIN, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            if (!projectiles[i].is_active) continue;
+            projectile_prev_pos[i] = projectiles[i].pos;
+
+            projectiles[i].pos += projectiles[i].dir * PROJECTILE_SPEED * dt;
+            int map_x = (int)projectiles[i].pos.x;
+            int map_y = (int)projectiles[i].pos.y;
+            int map_z = (int)projectiles[i].pos.z;
+
+            if (map_x < 0 || map_x >= MAP_WIDTH || map_y < 0 || map_y >= MAP_HEIGHT || map_z < 0 || map_z >= MAP_LENGTH || game_map[map_x][map_y][map_z] == SOLID) {
+                despawn_projectile(i);
+            }
+        }
+    });
+}
+
+// Finds every projectile/player crossing in parallel, then applies them in
+// projectile order so a player hit twice is only killed by the first
+// projectile, whatever the thread count.
+void Match::resolve_projectile_hits() {
+    for (auto& buffer : hit_buffers) buffer.clear();
+    parallel_for(*match_config.jobs, projectiles.size(), PROJECTILE_JOB_GRAIN, [&](size_t begin, size_t end) {
+        std::vector<HitCandidate>& out = hit_buffers[job_worker_index(*match_config.jobs)];
+        for (size_t i = begin; i < end; ++i) {
+            if (!projectiles[i].is_active) continue;
+            for (size_t c = 0; c < client_list.size(); c++) {
+                const ClientInfo& client = *client_list[c].second;
+                if (!client.state.is_alive || client_list[c].first == projectiles[i].owner_id) continue;
+                float total_radius = PLAYER_RADIUS + PROJECTILE_RADIUS;
+                if (check_line_sphere_collision(projectile_prev_pos[i], projectiles[i].pos, client.state.pos, total_radius)) {
+                    out.push_back({(uint32_t)i, (uint32_t)c});
+                }
+            }
+        }
+    });
+
+    hits.clear();
+    for (auto& buffer : hit_buffers) {
+        hits.insert(hits.end(), buffer.begin(), buffer.end());
+    }
+    sort(hits.begin(), hits.end(), [](const HitCandidate& a, const HitCandidate& b) {
+        return a.projectile != b.projectile ? a.projectile < b.projectile : a.client_index < b.client_index;
+    });
+    for (const HitCandidate& hit : hits) {
+        auto& [id, client] = client_list[hit.client_index];
+        if (!projectiles[hit.projectile].is_active || !client->state.is_alive) continue;
+        client->state.is_alive = 0;
+        client->respawn_time = sim_now() + std::chrono::seconds(RESPAWN_DELAY_S);
+        despawn_projectile(hit.projectile);
+        log_info("Match {}: player {} was hit!", this->id, id);
+    }
+}
+
+void Match::respawn_player(ClientInfo& client) {
+    client.state.is_alive = 1;
+    client.velocityY = 0.0f;
+    if (!spawn_points.empty()) {
+        client.state.pos = spawn_points[sim_rand() % spawn_points.size()];
+        client.state.pos.y += PLAYER_HEIGHT / 2.0f;
+    } else {
+        client.state.pos = {5.0f, 1.5f, 5.0f};
+    }
+    client.pos_at_last_step = client.state.pos;
+}
+
+uint64_t fnv1a(uint64_t hash, const void* data, size_t len) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+// Hash of everything the simulation carries from one tick to the next. Clients
+// are visited in slot order, which only depends on the order of joins and leaves.
+uint64_t Match::hash_world_state() {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    hash = fnv1a(hash, &current_tick, sizeof(current_tick));
+    for (auto const& [id, client] : clients) {
+        hash = fnv1a(hash, &client.state, sizeof(client.state));
+        hash = fnv1a(hash, &client.velocityY, sizeof(client.velocityY));
+        hash = fnv1a(hash, &client.pos_at_last_step, sizeof(client.pos_at_last_step));
+    }
+    for (int i = 0; i < (int)projectiles.size(); ++i) {
+        if (projectiles[i].is_active) {
+            hash = fnv1a(hash, &i, sizeof(i));
+            hash = fnv1a(hash, &projectiles[i], sizeof(projectiles[i]));
+        }
+    }
+    return hash;
+}
+
+// Appends one entity to the snapshot, starting a new part when the current one
+// would no longer fit in a datagram next to the bundle framing
+template <typename T>
+void Match::snapshot_append(SnapshotScratch& out, const T& entity, uint16_t SnapshotPacket::* count, uint32_t tick) {
+    size_t max_part = match_config.mtu - sizeof(ProtoHeader) - sizeof(uint16_t);
+    size_t part_start = out.snapshot_part_offsets.empty() ? 0 : out.snapshot_part_offsets.back();
+    if (out.snapshot_part_offsets.empty() || out.snapshot_buf.size() - part_start + sizeof(T) > max_part) {
+        part_start = out.snapshot_buf.size();
+        out.snapshot_part_offsets.push_back(part_start);
+        out.snapshot_buf.resize(part_start + sizeof(SnapshotPacket));
+        SnapshotPacket* part = (SnapshotPacket*)&out.snapshot_buf[part_start];
+        *part = SnapshotPacket{};
+        part->hdr.type = STATE;
+        part->hdr.tick_id = tick;
+        part->part_index = (uint16_t)(out.snapshot_part_offsets.size() - 1);
+    }
+    size_t offset = out.snapshot_buf.size();
+    out.snapshot_buf.resize(offset + sizeof(T));
+    memcpy(&out.snapshot_buf[offset], &entity, sizeof(T));
+
+    ((SnapshotPacket*)&out.snapshot_buf[part_start])->*count += 1;
+}
+
+float entity_relevance(const glm::vec3& viewer_pos, const glm::vec3& entity_pos) {
+    return 1.0f / (1.0f + glm::distance(viewer_pos, entity_pos) / PRIORITY_FALLOFF_DISTANCE);
+}
+
+static int aoi_cell(float v, int cells) {
+    return clamp((int)floor(v / AOI_CELL_SIZE), 0, cells - 1);
+}
+
+void Match::build_aoi_index(const WorldSnapshot& snap) {
+    aoi.cell_players.resize(AOI_CELLS_X * AOI_CELLS_Z);
+    aoi.cell_projectiles.resize(AOI_CELLS_X * AOI_CELLS_Z);
+    aoi.room_players.resize(rooms.size());
+    aoi.room_projectiles.resize(rooms.size());
+    for (auto& cell : aoi.cell_players) cell.clear();
+    for (auto& cell : aoi.cell_projectiles) cell.clear();
+    for (auto& room : aoi.room_players) room.clear();
+    for (auto& room : aoi.room_projectiles) room.clear();
+    aoi.player_room.resize(snap.players.size());
+    aoi.player_cluster.resize(snap.players.size());
+    aoi.projectile_room.resize(snap.projectiles.size());
+
+    for (size_t p = 0; p < snap.players.size(); p++) {
+        const glm::vec3& pos = snap.players[p].state.pos;
+        aoi.cell_players[aoi_cell(pos.z, AOI_CELLS_Z) * AOI_CELLS_X + aoi_cell(pos.x, AOI_CELLS_X)].push_back(p);
+        int room = room_at(pos);
+        aoi.player_room[p] = room;
+        aoi.player_cluster[p] = pvs_cluster(pos);
+        if (room >= 0) aoi.room_players[room].push_back(p);
+    }
+    for (uint16_t i : snap.live_projectiles) {
+        const glm::vec3& pos = snap.projectiles[i].pos;
+        aoi.cell_projectiles[aoi_cell(pos.z, AOI_CELLS_Z) * AOI_CELLS_X + aoi_cell(pos.x, AOI_CELLS_X)].push_back(i);
+        int room = room_at(pos);
+        aoi.projectile_room[i] = room;
+        if (room >= 0) aoi.room_projectiles[room].push_back(i);
+    }
+}
+
+// Builds the snapshot for one client: its own state, then the entities in its
+// area of interest with the highest accumulated priority that fit in its
+// remaining bandwidth budget. The area is everything within aoi_radius plus
+// the client's room and the rooms connected to it. Players outside the
+// client's PVS are left out even when in the area. Entities the client was
+// sent that are now out of the area or the PVS, or gone from the match, get a
+// removal so the client doesn't keep drawing them where they were last seen.
+// Parts are at most one datagram each, with a part's players before its
+// projectiles and those before its removals.
+void Match::build_client_snapshot(SnapshotScratch& out, const WorldSnapshot& snap, size_t viewer_index, ClientSendState& viewer) {
+    out.candidates.clear();
+    out.chosen_players.clear();
+    out.chosen_projectiles.clear();
+    out.removals.clear();
+
+    uint32_t tick = snap.tick;
+    float dt = snap.dt;
+    const PlayerState& viewer_state = snap.players[viewer_index].state;
+    const glm::vec3& viewer_pos = viewer_state.pos;
+
+    bool cull = match_config.aoi_radius > 0.0f;
+    float enter_radius = match_config.aoi_radius;
+    float exit_radius = enter_radius * AOI_EXIT_SCALE;
+    int viewer_room = cull ? aoi.player_room[viewer_index] : -1;
+    uint64_t linked_rooms = viewer_room >= 0 ? room_links[viewer_room] : 0;
+    bool pvs_cull = match_config.pvs_culling && pvs_row(pvs, aoi.player_cluster[viewer_index], out.pvs_row);
+    // was_in tells whether the entity was in the area for the previous snapshot
+    auto in_interest = [&](EntityPriority& prio, const glm::vec3& pos, int room, bool& was_in) {
+        was_in = !cull || (viewer.last_built_tick != 0 && prio.interest_tick == viewer.last_built_tick);
+        if (!cull) return true;
+        float distance = glm::distance(viewer_pos, pos);
+        if (distance <= enter_radius || (room >= 0 && (linked_rooms >> room) & 1)
+            || (was_in && distance <= exit_radius)) {
+            prio.interest_tick = tick;
+            return true;
+        }
+        return false;
+    };
+    auto add_player = [&](uint32_t p) {
+        if (p == viewer_index) return;
+        const PlayerState& state = snap.players[p].state;
+        // Returning before candidate_tick is set also sends a removal if the
+        // client was shown the player, so it isn't left drawn where it was last visible
+        if (pvs_cull && !pvs_row_test(out.pvs_row, aoi.player_cluster[p])) return;
+        EntityPriority& prio = viewer.player_priority[player_slot(state.player_id)];
+        bool was_in;
+        if (!in_interest(prio, state.pos, cull ? aoi.player_room[p] : -1, was_in)) return;
+        prio.candidate_tick = tick;
+        prio.accumulator += dt * entity_relevance(viewer_pos, state.pos);
+        // Only entities the client may still be showing can go stale
+        bool stale = was_in && tick - prio.last_sent_tick >= MAX_STALE_TICKS;
+        out.candidates.push_back({stale ? FLT_MAX : prio.accumulator, true, p});
+    };
+    auto add_projectile = [&](uint16_t i) {
+        const ProjectileState& projectile = snap.projectiles[i];
+        EntityPriority& prio = viewer.projectile_priority[i];
+        bool was_in;
+        if (!in_interest(prio, projectile.pos, cull ? aoi.projectile_room[i] : -1, was_in)) return;
+        prio.candidate_tick = tick;
+        bool recently_despawned = !projectile.is_active;
+        float relevance = entity_relevance(viewer_pos, projectile.pos);
+        prio.accumulator += dt * relevance * (recently_despawned ? DESPAWN_PRIORITY_BOOST : 1.0f);
+        out.candidates.push_back({prio.accumulator, false, i});
+    };
+
+    if (!cull) {
+        for (size_t p = 0; p < snap.players.size(); p++) {
+            add_player(p);
+        }
+        for (uint16_t i : snap.live_projectiles) {
+            add_projectile(i);
+        }
+    } else {
+        int x0 = aoi_cell(viewer_pos.x - exit_radius, AOI_CELLS_X), x1 = aoi_cell(viewer_pos.x + exit_radius, AOI_CELLS_X);
+        int z0 = aoi_cell(viewer_pos.z - exit_radius, AOI_CELLS_Z), z1 = aoi_cell(viewer_pos.z + exit_radius, AOI_CELLS_Z);
+        for (int z = z0; z <= z1; z++) {
+            for (int x = x0; x <= x1; x++) {
+                for (uint32_t p : aoi.cell_players[z * AOI_CELLS_X + x]) add_player(p);
+                for (uint16_t i : aoi.cell_projectiles[z * AOI_CELLS_X + x]) add_projectile(i);
+            }
+        }
+        // Connected rooms reach past the radius; skip what the cells above covered
+        auto in_cells = [&](const glm::vec3& pos) {
+            int x = aoi_cell(pos.x, AOI_CELLS_X), z = aoi_cell(pos.z, AOI_CELLS_Z);
+            return x >= x0 && x <= x1 && z >= z0 && z <= z1;
+        };
+        for (uint64_t bits = linked_rooms; bits; bits &= bits - 1) {
+            int room = __builtin_ctzll(bits);
+            for (uint32_t p : aoi.room_players[room]) {
+                if (!in_cells(snap.players[p].state.pos)) add_player(p);
+            }
+            for (uint16_t i : aoi.room_projectiles[room]) {
+                if (!in_cells(snap.projectiles[i].pos)) add_projectile(i);
+            }
+        }
+    }
+    viewer.entities_culled_window += snap.players.size() - 1 + snap.live_projectiles.size() - out.candidates.size();
+    viewer.snapshots_window++;
+    viewer.last_built_tick = tick;
+
+    sort(out.candidates.begin(), out.candidates.end(), [](const SnapshotCandidate& a, const SnapshotCandidate& b) {
+        return a.priority > b.priority;
+    });
+
+    // Own state always goes out. Overshoot is paid back from the next ticks' budget.
+    float budget = viewer.bandwidth_tokens - sizeof(SnapshotPacket) - sizeof(PlayerState);
+    for (const SnapshotCandidate& c : out.candidates) {
+        float cost = c.is_player ? sizeof(PlayerState) : sizeof(ProjectileState);
+        if (c.priority != FLT_MAX && cost > budget) {
+            viewer.entities_deferred_window++;
+            continue;
+        }
+        budget -= cost;
+        uint32_t id = c.is_player ? snap.players[c.key].state.player_id : c.key;
+        EntityPriority& prio = c.is_player ? viewer.player_priority[player_slot(id)] : viewer.projectile_priority[c.key];
+        (c.is_player ? out.chosen_players : out.chosen_projectiles).push_back(c.key);
+        prio.accumulator = 0.0f;
+        prio.last_sent_tick = tick;
+        if (!prio.shown) {
+            prio.shown = true;
+            viewer.shown.push_back({id, c.is_player, 0});
+        }
+    }
+
+    // A player's slot holds a different player once send_states says so;
+    // its priority was reset then, so shown no longer refers to this one
+    auto present = [&](const ShownEntity& e) {
+        return !e.is_player || send_states[player_slot(e.id)].player_id == e.id;
+    };
+    size_t kept = 0;
+    for (ShownEntity& e : viewer.shown) {
+        EntityPriority& prio = e.is_player ? viewer.player_priority[player_slot(e.id)] : viewer.projectile_priority[e.id];
+        bool here = present(e);
+        if (e.removed_tick == 0) {
+            if (here && prio.candidate_tick == tick) {
+                viewer.shown[kept++] = e;
+                continue;
+            }
+            e.removed_tick = tick;
+            if (here) prio.shown = false;
+        } else if ((here && prio.shown) || tick - e.removed_tick >= REMOVAL_REPEAT_TICKS) {
+            // Sent again since, which has its own entry, or repeated enough
+            continue;
+        }
+        out.removals.push_back({e.id, e.is_player});
+        viewer.shown[kept++] = e;
+    }
+    viewer.shown.resize(kept);
+
+    out.snapshot_buf.clear();
+    out.snapshot_part_offsets.clear();
+    snapshot_append(out, viewer_state, &SnapshotPacket::num_players, tick);
+    for (uint32_t p : out.chosen_players) {
+        snapshot_append(out, snap.players[p].state, &SnapshotPacket::num_players, tick);
+    }
+    for (uint32_t i : out.chosen_projectiles) {
+        snapshot_append(out, snap.projectiles[i], &SnapshotPacket::num_projectiles, tick);
+    }
+    for (const EntityRemoval& removal : out.removals) {
+        snapshot_append(out, removal, &SnapshotPacket::num_removed, tick);
+    }
+    for (size_t offset : out.snapshot_part_offsets) {
+        ((SnapshotPacket*)&out.snapshot_buf[offset])->part_count = (uint16_t)out.snapshot_part_offsets.size();
+    }
+}
+
+uint32_t Match::add_player(const sockaddr_in& addr, uint64_t client_key) {
+    uint32_t id = clients.insert();
+    addr_to_id[client_key] = id;
+    ClientInfo& client = *clients.get(id);
+    client.addr = addr;
+    client.state.player_id = id;
+    respawn_player(client);
+    client.last_fire_time = sim_now();
+    client.client_key = client_key;
+    client.pos_at_last_step = client.state.pos;
+    if (record) record_write(record, RECORD_JOIN, JoinRecord{id, client_key});
+    return id;
+}
+
+void Match::remove_client(uint32_t id) {
+    if (record) record_write(record, RECORD_LEAVE, LeaveRecord{id});
+    uint64_t client_key = clients.get(id)->client_key;
+    departed.push_back(client_key);
+    addr_to_id.erase(client_key);
+    clients.erase(id);
+}
+
+// Adds what the bundler took since types_before was copied to the client's counts
+static void add_bytes_out(NetQuality& q, const PacketBundler& b, const uint64_t* types_before) {
+    for (int t = 0; t < NUM_PACKET_TYPES; t++) q.bytes_out[t] += b.bytes_by_type[t] - types_before[t];
+}
+
+void Match::send_join_data(ClientInfo& client) {
+    static_assert(MAP_CHUNK_COUNT + 1 <= RELIABLE_WINDOW, "join data must fit in the reliable window");
+
+    JoinAckPacket pkt{};
+    pkt.hdr.type = JOIN_ACK;
+    pkt.hdr.tick_id = current_tick;
+    pkt.your_id = client.state.player_id;
+    pkt.max_players = (uint16_t)match_config.max_players;
+    pkt.max_projectiles = (uint16_t)match_config.max_projectiles;
+    reliable_send(client.channel, &pkt, sizeof(pkt));
+
+    const int* voxels = &game_map[0][0][0];
+    MapChunkPacket chunk{};
+    chunk.hdr.type = MAP_DATA;
+    chunk.hdr.tick_id = current_tick;
+    chunk.chunk_count = MAP_CHUNK_COUNT;
+    for (int c = 0; c < MAP_CHUNK_COUNT; c++) {
+        chunk.chunk_index = c;
+        for (int i = 0; i < MAP_CHUNK_SIZE; i++) {
+            int v = c * MAP_CHUNK_SIZE + i;
+            chunk.voxels[i] = v < MAP_VOXELS ? (uint8_t)voxels[v] : AIR;
+        }
+        reliable_send(client.channel, &chunk, sizeof(chunk));
+    }
+    uint64_t types_before[NUM_PACKET_TYPES];
+    memcpy(types_before, bundler.bytes_by_type, sizeof(types_before));
+    bundle_begin(bundler, match_config.udp_socket, client.addr, match_config.mtu, current_tick);
+    reliable_update(client.channel, Clock::now(), bundler);
+    bundle_flush(bundler);
+    add_bytes_out(client.quality, bundler, types_before);
+}
+
+void Match::send_ack(ClientInfo& client) {
+    AckPacket pkt{};
+    pkt.hdr.type = ACK;
+    pkt.hdr.tick_id = current_tick;
+    reliable_write_ack(client.channel, pkt.ack);
+    net_sendto(match_config.udp_socket, &pkt, sizeof(pkt), client.addr);
+    client.quality.bytes_out[ACK] += sizeof(pkt);
+}
+
+void Match::handle_action(ClientInfo& client, uint32_t id, const ActionPacket* pkt, Clock::time_point received) {
+    client.last_packet_time = Clock::now();
+    reliable_process_ack(client.channel, pkt->ack, client.last_packet_time);
+
+    quality_on_sequenced(client.quality, pkt->hdr.tick_id, pkt->send_time_us, received);
+    const TickStamp& stamp = tick_stamps[pkt->echo_tick % TICK_STAMP_HISTORY];
+    if (pkt->echo_tick != ECHO_NONE && stamp.tick == pkt->echo_tick) {
+        float rtt_ms = chrono::duration<float, milli>(received - stamp.published).count() - pkt->echo_delay_us / 1000.0f;
+        quality_on_rtt_sample(client.quality, rtt_ms);
+    }
+    apply_action(client, id, *pkt);
+}
+
+void Match::apply_action(ClientInfo& client, uint32_t id, const ActionPacket& pkt) {
+    if (record) {
+        ActionRecord rec{id, pkt.movement_dir, 0, {pkt.view_dir.x, pkt.view_dir.y, pkt.view_dir.z}};
+        if (pkt.is_jumping) rec.flags |= ACTION_JUMPING;
+        if (pkt.is_firing) rec.flags |= ACTION_FIRING;
+        record_write(record, RECORD_ACTION, rec);
+    }
+    client.state.movement_dir = pkt.movement_dir;
+    client.state.view_dir = pkt.view_dir;
+
+    if (pkt.is_jumping && client.state.on_ground) {
+        client.velocityY = JUMP_POWER;
+        client.state.on_ground = false;
+    }
+
+    auto now = sim_now();
+    if (pkt.is_firing && client.state.is_alive &&
+        chrono::duration_cast<chrono::milliseconds>(now - client.last_fire_time).count() >= FIRE_COOLDOWN_MS) {
+        client.last_fire_time = now;
+        glm::vec3 spawn_pos = client.state.pos;
+        spawn_pos.y += 0.2f; // Eye height offset
+        spawn_projectile(id, spawn_pos, pkt.view_dir);
+
+        queue_sound(GUNSHOT, spawn_pos);
+    }
+}
+
+void Match::handle_client_packet(const uint8_t* buf, size_t recv_len, const sockaddr_in& client_addr, uint64_t client_key,
+                                 Clock::time_point received) {
+    const ProtoHeader* hdr = (const ProtoHeader*)buf;
+    if (hdr->type == JOIN || hdr->type == LEAVE) {
+        if (recv_len < sizeof(ControlPacket)) return;
+        const ControlPacket* pkt = (const ControlPacket*)buf;
+        if (addr_to_id.count(client_key) == 0) {
+            if (hdr->type == LEAVE) {
+                send_stateless_leave_ack(client_addr, pkt->rel.seq);
+                return;
+            }
+            if (clients.full()) {
+                send_join_denied(client_addr, pkt->rel.seq, SERVER_FULL);
+                departed.push_back(client_key);
+                return;
+            }
+            uint32_t new_id = add_player(client_addr, client_key);
+            log_info("Match {}: player {} joined from {}", this->id, new_id, addr_string(client_addr));
+        }
+        uint32_t id = addr_to_id[client_key];
+        ClientInfo& client = *clients.get(id);
+        client.quality.bytes_in[hdr->type] += recv_len;
+        auto now = Clock::now();
+        client.last_packet_time = now;
+        reliable_process_ack(client.channel, pkt->rel.ack, now);
+        reliable_receive(client.channel, buf, recv_len);
+
+        bool left = false;
+        size_t msg_len;
+        while (const uint8_t* msg = reliable_next_message(client.channel, &msg_len)) {
+            uint8_t msg_type = ((const ProtoHeader*)msg)->type;
+            if (msg_type == JOIN) {
+                send_join_data(client);
+            } else if (msg_type == LEAVE) {
+                left = true;
+                break;
+            }
+        }
+        if (left) {
+            send_ack(client);
+            log_info("Match {}: player {} has left the game.", this->id, id);
+            remove_client(id);
+        }
+    } else if (hdr->type == ACT) {
+        auto it = addr_to_id.find(client_key);
+        if (it == addr_to_id.end() || recv_len < sizeof(ActionPacket)) return;
+        if (ClientInfo* client = clients.get(it->second)) {
+            client->quality.bytes_in[ACT] += recv_len;
+            handle_action(*client, it->second, (const ActionPacket*)buf, received);
+        }
+    } else if (hdr->type == ACK) {
+        if (addr_to_id.count(client_key) && recv_len >= sizeof(AckPacket)) {
+            ClientInfo* client = clients.get(addr_to_id[client_key]);
+            client->quality.bytes_in[ACK] += recv_len;
+            client->last_packet_time = Clock::now();
+            reliable_process_ack(client->channel, ((const AckPacket*)buf)->ack, client->last_packet_time);
+        }
+    }
+}
+
+void Match::start(uint32_t match_id, uint64_t seed, FILE* hash_log_file, FILE* record_file) {
+    id = match_id;
+    hash_log = hash_log_file;
+    record = record_file;
+    metrics_block = metrics_add_match(match_id);
+    scratch.resize(match_config.jobs->num_workers + 1);
+    for (WorldSnapshot& snap : snapshots.slots) {
+        snap.players.reserve(match_config.max_players);
+        snap.projectiles.resize(match_config.max_projectiles);
+        snap.projectile_despawn_tick.resize(match_config.max_projectiles);
+        snap.live_projectiles.reserve(match_config.max_projectiles);
+    }
+    hit_buffers.resize(match_config.jobs->num_workers + 1);
+    projectiles.assign(match_config.max_projectiles, ProjectileState{});
+    projectile_despawn_tick.assign(match_config.max_projectiles, UINT32_MAX);
+    projectile_prev_pos.resize(match_config.max_projectiles);
+    clients.init(match_config.max_players);
+    addr_to_id.reserve(match_config.max_players);
+    client_list.reserve(match_config.max_players);
+    send_states.resize(match_config.max_players);
+    sound_cache_init(sound_fields, SOUND_FIELD_CACHE_ENTRIES);
+    sim_rng.state = seed;
+    log_info("Match {} map seed {}{}", id, seed, match_config.deterministic_mode ? " (deterministic mode)" : "");
+    generate_map();
+    auto pvs_start = Clock::now();
+    pvs_build(pvs, game_map, match_config.jobs);
+    log_info("Match {}: PVS built in {} ms, {} bytes ({} uncompressed)", id,
+             chrono::duration<float, milli>(Clock::now() - pvs_start).count(), pvs.data.size(), PVS_NUM_CLUSTERS * PVS_ROW_BYTES);
+    last_tick_time = Clock::now();
+    record_epoch = last_tick_time;
+    last_stats_time = last_tick_time;
+    last_bandwidth_stats_time = last_tick_time;
+}
+
+void Match::enqueue(const sockaddr_in& addr, const uint8_t* data, size_t len, Clock::time_point received) {
+    lock_guard<mutex> lock(inbox_mutex);
+    size_t offset = inbox.size();
+    inbox.resize(offset + sizeof(InboundPacket) + len);
+    InboundPacket entry{addr, (uint32_t)len, received};
+    memcpy(&inbox[offset], &entry, sizeof(entry));
+    memcpy(&inbox[offset + sizeof(entry)], data, len);
+}
+
+Clock::time_point Match::next_tick_time() const {
+    return last_tick_time + chrono::milliseconds(TICK_INTERVAL_MS);
+}
+
+// Retransmissions and queued reliable messages. These stay with the
+// simulation, which owns the channels; after the join they are rare.
+void Match::send_reliable(Clock::time_point now) {
+    for (auto& [id, client] : client_list) {
+        client->reliable_bytes = 0;
+        if (client->channel.num_unacked == 0) continue;
+        uint64_t bytes_before = bundler.bytes_sent;
+        uint64_t types_before[NUM_PACKET_TYPES];
+        memcpy(types_before, bundler.bytes_by_type, sizeof(types_before));
+        bundle_begin(bundler, match_config.udp_socket, client->addr, match_config.mtu, current_tick);
+        reliable_update(client->channel, now, bundler);
+        bundle_flush(bundler);
+        client->reliable_bytes = (uint32_t)(bundler.bytes_sent - bytes_before);
+        add_bytes_out(client->quality, bundler, types_before);
+    }
+}
+
+// Copies what the serializer needs from the simulation
+void Match::fill_snapshot(WorldSnapshot& snap, uint32_t tick, float dt) {
+    snap.tick = tick;
+    snap.dt = dt;
+    snap.players.clear();
+    for (auto& [id, client] : client_list) {
+        SnapshotPlayer& player = snap.players.emplace_back();
+        player.state = client->state;
+        player.addr = client->addr;
+        reliable_write_ack(client->channel, player.ack);
+        player.reliable_bytes = client->reliable_bytes;
+        player.rtt_ms = client->quality.have_rtt ? client->quality.srtt_ms : 0.0f;
+        player.min_rtt_ms = client->quality.min_rtt_ms;
+        player.loss = client->quality.loss;
+    }
+    copy(projectiles.begin(), projectiles.end(), snap.projectiles.begin());
+    copy(projectile_despawn_tick.begin(), projectile_despawn_tick.end(), snap.projectile_despawn_tick.begin());
+    snap.live_projectiles.clear();
+    tick_metrics.projectiles = 0;
+    for (size_t i = 0; i < projectiles.size(); ++i) {
+        tick_metrics.projectiles += projectiles[i].is_active;
+        bool recently_despawned = !projectiles[i].is_active && projectile_despawn_tick[i] != UINT32_MAX &&
+            tick - projectile_despawn_tick[i] < DESPAWN_RESEND_TICKS;
+        if (projectiles[i].is_active || recently_despawned) snap.live_projectiles.push_back((uint16_t)i);
+    }
+}
+
+// Fills the triple buffer's write slot and makes sure a serializer job is on its way
+void Match::publish_snapshot(uint32_t tick, float dt) {
+    fill_snapshot(snapshots.write_slot(), tick, dt);
+    snapshots.publish();
+    tick_stamps[tick % TICK_STAMP_HISTORY] = {tick, Clock::now()};
+
+    if (!serializing.exchange(true, memory_order_acq_rel)) {
+        job_system_submit(*match_config.jobs, [this] { run_serializer(); });
+    }
+}
+
+// Encodes snapshots until there is no newer one. Only one serializer job per
+// match runs at a time.
+void Match::run_serializer() {
+    while (true) {
+        if (snapshots.take_latest()) {
+            auto start = Clock::now();
+            net_batch_begin();
+            {
+                TraceScope trace("serializer", "match", id);
+                ProfileScope scope(profile, PHASE_SNAPSHOT);
+                serialize_snapshot(snapshots.read_slot());
+            }
+            net_batch_end();
+            auto now = Clock::now();
+            if (metrics_block) publish_snapshot_metrics(chrono::duration_cast<chrono::nanoseconds>(now - start).count());
+            if (now - last_bandwidth_stats_time >= chrono::seconds(STATS_INTERVAL_S)) {
+                print_bandwidth_stats(now);
+            }
+        }
+        serializing.store(false, memory_order_release);
+        // A snapshot published after the check above found serializing still set
+        if (!snapshots.has_fresh() || serializing.exchange(true, memory_order_acq_rel)) return;
+    }
+}
+
+// Backs off while the client's link loses packets or its round trip grows,
+// and wins the budget back slowly once that stops
+static void adapt_bandwidth(ClientSendState& client, const SnapshotPlayer& player, float dt) {
+    float configured = (float)match_config.client_bandwidth;
+    float limit = (float)client.bandwidth_limit;
+    bool congested = player.loss > BANDWIDTH_LOSS_THRESHOLD
+        || (player.rtt_ms > 0.0f && player.rtt_ms - player.min_rtt_ms > BANDWIDTH_QUEUE_DELAY_MS);
+    if (congested) {
+        limit -= limit * BANDWIDTH_BACKOFF_PER_S * dt;
+    } else {
+        limit += configured * BANDWIDTH_RECOVER_PER_S * dt;
+    }
+    client.bandwidth_limit = (uint32_t)clamp(limit, configured * BANDWIDTH_MIN_FRACTION, configured);
+}
+
+void Match::send_client_snapshot(SnapshotScratch& out, const WorldSnapshot& snap, size_t viewer_index) {
+    const SnapshotPlayer& player = snap.players[viewer_index];
+    ClientSendState& client = send_states[player_slot(player.state.player_id)];
+    if (match_config.adaptive_bandwidth) adapt_bandwidth(client, player, snap.dt);
+    float limit = (float)client.bandwidth_limit;
+    client.bandwidth_tokens = min(client.bandwidth_tokens + limit * snap.dt, limit * BANDWIDTH_BURST_S);
+    client.bandwidth_tokens -= player.reliable_bytes;
+    client.bytes_sent_window += player.reliable_bytes;
+    build_client_snapshot(out, snap, viewer_index, client);
+
+    PacketBundler& bundler = out.bundler;
+    uint64_t bytes_before = bundler.bytes_sent;
+    bundle_begin(bundler, match_config.udp_socket, player.addr, match_config.mtu, snap.tick);
+    for (size_t p = 0; p < out.snapshot_part_offsets.size(); p++) {
+        size_t offset = out.snapshot_part_offsets[p];
+        size_t end = p + 1 < out.snapshot_part_offsets.size() ? out.snapshot_part_offsets[p + 1] : out.snapshot_buf.size();
+        SnapshotPacket* part = (SnapshotPacket*)&out.snapshot_buf[offset];
+        part->ack = player.ack;
+        bundle_add(bundler, part, end - offset);
+    }
+    client.state_bytes_window += out.snapshot_buf.size();
+    int listener = sound_voxel(player.state.pos);
+    for (size_t s = 0; s < pending_sounds.size(); s++) {
+        const uint8_t* field = pending_sound_fields[s];
+        if (field && listener >= 0 && field[listener] > SOUND_MAX_PATH_COST) {
+            client.sounds_culled_window++;
+            continue;
+        }
+        bundle_add(bundler, &pending_sounds[s], sizeof(pending_sounds[s]));
+        client.sounds_sent_window++;
+        client.sound_bytes_window += sizeof(pending_sounds[s]);
+    }
+    bundle_flush(bundler);
+    uint64_t sent = bundler.bytes_sent - bytes_before;
+    client.bandwidth_tokens -= sent;
+    client.bytes_sent_window += sent;
+}
+
+// Each client's snapshot only reads the published world and writes that
+// client's own send state, so clients are serialized and sent in parallel.
+// Follows joins and leaves. A player id that differs from the one in its
+// slot is a new player, so every client's priority for the slot restarts.
+void Match::track_snapshot_players(const WorldSnapshot& snap) {
+    for (const SnapshotPlayer& player : snap.players) {
+        uint32_t slot = player_slot(player.state.player_id);
+        ClientSendState& state = send_states[slot];
+        if (state.player_id != player.state.player_id) {
+            state = ClientSendState{};
+            state.player_id = player.state.player_id;
+            state.bandwidth_limit = match_config.client_bandwidth;
+            state.bandwidth_tokens = match_config.client_bandwidth * BANDWIDTH_BURST_S;
+            state.player_priority.resize(match_config.max_players);
+            state.projectile_priority.resize(match_config.max_projectiles);
+            for (ClientSendState& viewer : send_states) {
+                if (viewer.player_id != 0) viewer.player_priority[slot] = EntityPriority{};
+            }
+        }
+        state.last_seen_tick = snap.tick;
+    }
+    for (ClientSendState& state : send_states) {
+        if (state.player_id != 0 && state.last_seen_tick != snap.tick) state.player_id = 0;
+    }
+}
+
+void Match::serialize_snapshot(const WorldSnapshot& snap) {
+    track_snapshot_players(snap);
+
+    if (match_config.aoi_radius > 0.0f || match_config.pvs_culling) {
+        ProfileScope scope(profile, PHASE_AOI);
+        build_aoi_index(snap);
+    }
+
+    // Who can hear each sound is decided by its propagation field, shared
+    // by every sound from the same voxel
+    {
+        ProfileScope scope(profile, PHASE_SOUNDS);
+        pending_sounds.clear();
+        pending_sound_fields.clear();
+        sound_cache_begin(sound_fields);
+        SoundEventPacket sound_pkt;
+        while (sound_queue.pop(sound_pkt)) {
+            pending_sounds.push_back(sound_pkt);
+            pending_sound_fields.push_back(sound_cache_get(sound_fields, game_map, sound_voxel(sound_pkt.pos)));
+        }
+    }
+
+    ProfileScope scope(profile, PHASE_BROADCAST);
+    parallel_for(*match_config.jobs, snap.players.size(), SNAPSHOT_JOB_GRAIN, [&](size_t begin, size_t end) {
+        SnapshotScratch& out = scratch[job_worker_index(*match_config.jobs)];
+        net_batch_begin();
+        for (size_t p = begin; p < end; p++) {
+            send_client_snapshot(out, snap, p);
+        }
+        net_batch_end();
+    });
+}
+
+void Match::publish_snapshot_metrics(uint64_t snapshot_ns) {
+    uint64_t datagrams = 0, bytes = 0;
+    for (const SnapshotScratch& out : scratch) {
+        datagrams += out.bundler.datagrams_sent;
+        bytes += out.bundler.bytes_sent;
+    }
+    MetricsSnapshot& m = snapshot_metrics;
+    m.snapshots++;
+    m.snapshot_ns = snapshot_ns;
+    m.datagrams_out = datagrams - m.datagrams_out_total;
+    m.bytes_out = bytes - m.bytes_out_total;
+    m.datagrams_out_total = datagrams;
+    m.bytes_out_total = bytes;
+    metrics_publish(metrics_block->snapshot, m);
+}
+
+void Match::print_bandwidth_stats(Clock::time_point now) {
+    float window_s = chrono::duration<float>(now - last_bandwidth_stats_time).count();
+    last_bandwidth_stats_time = now;
+    uint64_t sounds_sent = 0, sounds_culled = 0;
+    for (ClientSendState& client : send_states) {
+        if (client.player_id == 0) continue;
+        float rate = client.bytes_sent_window / window_s;
+        log_info("Match {}: player {} bandwidth {}/{} B/s ({}%, STATE {} B/s, SOUND_EVENT {} B/s), {} entity updates deferred, "
+                 "{} entities culled/tick", this->id, client.player_id, (int)rate, client.bandwidth_limit,
+                 (int)(100.0f * rate / max(client.bandwidth_limit, 1u)), (int)(client.state_bytes_window / window_s),
+                 (int)(client.sound_bytes_window / window_s), client.entities_deferred_window,
+                 (float)client.entities_culled_window / max(client.snapshots_window, 1u));
+        client.bytes_sent_window = 0;
+        client.state_bytes_window = 0;
+        client.sound_bytes_window = 0;
+        client.entities_deferred_window = 0;
+        client.entities_culled_window = 0;
+        client.snapshots_window = 0;
+        sounds_sent += client.sounds_sent_window;
+        sounds_culled += client.sounds_culled_window;
+        client.sounds_sent_window = 0;
+        client.sounds_culled_window = 0;
+    }
+    log_info("Match {}: {} sound events sent, {} culled as inaudible; sound field cache {} hits, {} misses",
+             id, sounds_sent, sounds_culled, sound_fields.hits, sound_fields.misses);
+    sound_fields.hits = 0;
+    sound_fields.misses = 0;
+
+    char phases[512] = "";
+    uint64_t snapshots = profile.phases[PHASE_SNAPSHOT].total;
+    profile_summary(profile, FIRST_SERIALIZER_PHASE, NUM_PHASES, phases, sizeof(phases));
+    log_info("Match {}: {} snapshots; us p50/p99/max: {}", id, snapshots, phases);
+    if (perf_counters_on) {
+        char counters[512] = "";
+        perf_summary(profile, FIRST_SERIALIZER_PHASE, NUM_PHASES, counters, sizeof(counters));
+        log_info("Match {}: per snapshot cycles/IPC/cache misses/branch misses: {}", id, counters);
+    }
+}
+
+// Appends "TYPE bytes" for every packet type with any
+static string bytes_by_type(const uint64_t* bytes) {
+    string out;
+    for (int t = 0; t < NUM_PACKET_TYPES; t++) {
+        if (!bytes[t]) continue;
+        if (!out.empty()) out += ", ";
+        out += packet_type_name(t);
+        out += " " + to_string(bytes[t]);
+    }
+    return out.empty() ? "none" : out;
+}
+
+void Match::print_quality_stats() {
+    for (auto const& [id, client] : clients) {
+        const NetQuality& q = client.quality;
+        uint64_t expected = q.packets_received + q.packets_lost;
+        log_info("Match {}: player {} rtt {} ms (min {}, var {}), jitter {} ms, loss {}% ({} of {} lost); bytes in: {}; "
+                 "bytes out by the simulation: {}", this->id, id, q.srtt_ms, q.min_rtt_ms, q.rttvar_ms, q.jitter_ms,
+                 100.0f * q.loss, q.packets_lost, expected, bytes_by_type(q.bytes_in), bytes_by_type(q.bytes_out));
+    }
+}
+
+void Match::print_tick_stats(Clock::time_point now) {
+    last_stats_time = now;
+    char phases[512] = "";
+    uint64_t ticks = profile.phases[PHASE_TICK].total;
+    profile_summary(profile, PHASE_TICK, FIRST_SERIALIZER_PHASE, phases, sizeof(phases));
+    log_info("Match {}: {} ticks, {} overruns, {} workers, {} sounds dropped; us p50/p99/max: {}", id,
+             ticks, profile.overruns, match_config.jobs->num_workers, sounds_dropped, phases);
+    if (perf_counters_on) {
+        char counters[512] = "";
+        perf_summary(profile, PHASE_TICK, FIRST_SERIALIZER_PHASE, counters, sizeof(counters));
+        log_info("Match {}: per tick cycles/IPC/cache misses/branch misses: {}", id, counters);
+    }
+    profile.overruns = 0;
+    print_quality_stats();
+}
+
+void Match::dispatch_inbox() {
+    {
+        lock_guard<mutex> lock(inbox_mutex);
+        inbox_draining.swap(inbox);
+    }
+    for (size_t offset = 0; offset < inbox_draining.size();) {
+        InboundPacket entry;
+        memcpy(&entry, &inbox_draining[offset], sizeof(entry));
+        uint8_t* data = &inbox_draining[offset + sizeof(entry)];
+        offset += sizeof(entry) + entry.len;
+
+        tick_metrics.datagrams_in++;
+        uint64_t client_key = addr_key(entry.addr);
+        if (((ProtoHeader*)data)->type == BUNDLE) {
+            size_t msg_offset = 0;
+            const uint8_t* msg;
+            size_t msg_len;
+            while (bundle_next(data, entry.len, &msg_offset, &msg, &msg_len)) {
+                handle_client_packet(msg, msg_len, entry.addr, client_key, entry.received);
+            }
+        } else {
+            handle_client_packet(data, entry.len, entry.addr, client_key, entry.received);
+        }
+    }
+    inbox_draining.clear();
+}
+
+void Match::find_respawns(std::vector<uint32_t>& ids) {
+    auto now = sim_now();
+    for (auto const& [id, client] : clients) {
+        if (!client.state.is_alive && now >= client.respawn_time) ids.push_back(id);
+    }
+}
+
+void Match::simulate(float dt, const std::vector<uint32_t>& respawn_ids) {
+    for (uint32_t id : respawn_ids) {
+        if (ClientInfo* client = clients.get(id)) respawn_player(*client);
+    }
+
+    client_list.clear();
+    for (auto [id, client] : clients) {
+        client_list.push_back({id, &client});
+    }
+    parallel_invoke(*match_config.jobs, {
+        [&] {
+            ProfileScope scope(profile, PHASE_PLAYERS);
+            update_players(dt);
+        },
+        [&] {
+            ProfileScope scope(profile, PHASE_PROJECTILES);
+            move_projectiles(dt);
+        },
+    });
+    {
+        ProfileScope scope(profile, PHASE_HITS);
+        resolve_projectile_hits();
+    }
+}
+
+void Match::run_tick() {
+    auto tick_start = Clock::now();
+    tick_time = tick_start;
+    if (record) {
+        int64_t time_ns = chrono::duration_cast<chrono::nanoseconds>(tick_time - record_epoch).count();
+        record_write(record, RECORD_TICK, TickRecord{current_tick, time_ns});
+    }
+    TraceScope trace("tick", "match", id);
+    // Acks and reliable sends from this tick go out in one submission
+    net_batch_begin();
+    {
+        ProfileScope scope(profile, PHASE_DISPATCH);
+        tick_metrics.datagrams_in = 0;
+        dispatch_inbox();
+    }
+
+    auto current_time = Clock::now();
+    auto elapsed_ms = chrono::duration_cast<chrono::milliseconds>(current_time - last_tick_time).count();
+    float dt;
+    if (match_config.deterministic_mode) {
+        // Fixed step; a late tick is caught up on the next loop iteration
+        last_tick_time += chrono::milliseconds(TICK_INTERVAL_MS);
+        dt = FIXED_DT;
+    } else {
+        // Keep to the 33 ms grid so scheduling latency doesn't lower the tick
+        // rate, but don't burst to catch up after a long stall
+        last_tick_time += chrono::milliseconds(TICK_INTERVAL_MS);
+        if (current_time - last_tick_time > chrono::milliseconds(TICK_INTERVAL_MS)) last_tick_time = current_time;
+        dt = elapsed_ms / 1000.0f;
+    }
+    // The timeout and respawn scans only read, so they run side by side. Removal
+    // and respawning (which draws from the RNG) then happen in client order.
+    std::vector<uint32_t> timed_out_ids;
+    std::vector<uint32_t> respawn_ids;
+    parallel_invoke(*match_config.jobs, {
+        [&] {
+            ProfileScope scope(profile, PHASE_TIMEOUTS);
+            for (auto const& [id, client] : clients) {
+                if (chrono::duration_cast<chrono::seconds>(current_time - client.last_packet_time).count() > CLIENT_TIMEOUT_S) {
+                    timed_out_ids.push_back(id);
+                }
+            }
+        },
+        [&] {
+            ProfileScope scope(profile, PHASE_RESPAWN);
+            find_respawns(respawn_ids);
+        },
+    });
+
+    for (uint32_t id : timed_out_ids) {
+        log_info("Match {}: player {} timed out. Removing.", this->id, id);
+        remove_client(id);
+    }
+    simulate(dt, respawn_ids);
+    if (hash_log || record) {
+        uint64_t hash = hash_world_state();
+        if (hash_log) {
+            fprintf(hash_log, "%u %016llx\n", current_tick, (unsigned long long)hash);
+            if (current_tick % RECORD_FLUSH_TICKS == 0) fflush(hash_log);
+        }
+        if (record) {
+            record_write(record, RECORD_TICK_END, TickEndRecord{dt, hash});
+            if (current_tick % RECORD_FLUSH_TICKS == 0) fflush(record);
+        }
+    }
+    {
+        ProfileScope scope(profile, PHASE_RELIABLE);
+        send_reliable(current_time);
+    }
+    net_batch_end();
+    uint32_t tick = current_tick++;
+    publish_snapshot(tick, dt);
+
+    auto tick_duration = Clock::now() - tick_start;
+    histogram_record(profile.phases[PHASE_TICK], chrono::duration_cast<chrono::nanoseconds>(tick_duration).count());
+    bool overrun = tick_duration > chrono::milliseconds(TICK_INTERVAL_MS);
+    if (overrun) profile.overruns++;
+    if (metrics_block) {
+        MetricsTick& m = tick_metrics;
+        m.tick = tick;
+        m.ticks++;
+        m.players = clients.size();
+        m.tick_ns = chrono::duration_cast<chrono::nanoseconds>(tick_duration).count();
+        m.tick_ns_max = max(m.tick_ns_max, m.tick_ns);
+        m.overruns += overrun;
+        m.sounds_dropped = sounds_dropped;
+        m.rtt_us_avg = m.rtt_us_max = m.jitter_us_avg = m.loss_permille_avg = m.loss_permille_max = 0;
+        uint64_t measured = 0;
+        for (auto& [id, client] : client_list) {
+            const NetQuality& q = client->quality;
+            if (!q.have_rtt) continue;
+            measured++;
+            m.rtt_us_avg += (uint64_t)(q.srtt_ms * 1000.0f);
+            m.rtt_us_max = max(m.rtt_us_max, (uint64_t)(q.srtt_ms * 1000.0f));
+            m.jitter_us_avg += (uint64_t)(q.jitter_ms * 1000.0f);
+            m.loss_permille_avg += (uint64_t)(q.loss * 1000.0f);
+            m.loss_permille_max = max(m.loss_permille_max, (uint64_t)(q.loss * 1000.0f));
+        }
+        if (measured) {
+            m.rtt_us_avg /= measured;
+            m.jitter_us_avg /= measured;
+            m.loss_permille_avg /= measured;
+        }
+        metrics_publish(metrics_block->tick, m);
+    }
+    if (current_time - last_stats_time >= chrono::seconds(STATS_INTERVAL_S)) {
+        print_tick_stats(current_time);
+    }
+    running.store(false, memory_order_release);
+}
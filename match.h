@@ -0,0 +1,372 @@
+#ifndef MATCH_H
+#define MATCH_H
+
+#include <cstdint>
+#include <cstdio>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <netinet/in.h>
+#include <glm/glm.hpp>
+
+#include "protocol.h"
+#include "reliable.h"
+#include "bundle.h"
+#include "job_system.h"
+#include "triple_buffer.h"
+#include "spsc_ring.h"
+#include "pvs.h"
+#include "sound.h"
+#include "slot_table.h"
+#include "profile.h"
+#include "metrics.h"
+#include "net_quality.h"
+#include "record.h"
+
+using Clock = std::chrono::steady_clock;
+
+const int TICK_INTERVAL_MS = 33;
+const float FIXED_DT = TICK_INTERVAL_MS / 1000.0f;
+
+// Settings shared by every match in the process, set before the first match starts
+struct MatchConfig {
+    int udp_socket = -1;
+    bool deterministic_mode = false;
+    size_t mtu = DEFAULT_MTU;
+    uint32_t client_bandwidth = 64000;
+    uint32_t max_players = DEFAULT_MAX_PLAYERS;
+    uint32_t max_projectiles = DEFAULT_MAX_PROJECTILES;
+    float aoi_radius = 12.0f;  // voxels; 0 sends every entity to every client
+    bool pvs_culling = true;   // leave out players the client can't possibly see
+    bool adaptive_bandwidth = true;  // lower a client's budget while its link is lossy or queueing
+    JobSystem* jobs = nullptr;
+};
+
+extern MatchConfig match_config;
+
+// IPv4 address and port packed into the connection table key
+inline uint64_t addr_key(const sockaddr_in& addr) {
+    return ((uint64_t)addr.sin_addr.s_addr << 16) | addr.sin_port;
+}
+
+std::string addr_string(const sockaddr_in& addr);
+
+// Acks a LEAVE from a connection that has already been removed; our first
+// ack of it was lost
+void send_stateless_leave_ack(const sockaddr_in& addr, uint16_t seq);
+
+void send_join_denied(const sockaddr_in& addr, uint16_t join_seq, JoinDeniedReason reason);
+
+// Whether the segment from line_start to line_end passes within sphere_radius of sphere_center
+bool check_line_sphere_collision(const glm::vec3& line_start, const glm::vec3& line_end,
+    const glm::vec3& sphere_center, float sphere_radius);
+
+// How much a client wants an update of one entity, grown every tick by the
+// entity's relevance and reset when the entity is sent
+struct EntityPriority {
+    float accumulator = 0.0f;
+    uint32_t last_sent_tick = 0;
+    uint32_t interest_tick = 0;  // last snapshot with the entity in the client's area of interest
+    uint32_t candidate_tick = 0;  // last snapshot with the entity in the area and the PVS
+    bool shown = false;  // sent and not removed since, so the client may be showing it
+};
+
+// An entity in a client's ClientSendState::shown list
+struct ShownEntity {
+    uint32_t id;  // player_id, or projectile slot
+    bool is_player;
+    uint32_t removed_tick;  // 0 while shown; else when it was taken out of the client's view
+};
+
+struct ClientInfo {
+    sockaddr_in addr;
+    PlayerState state;
+    Clock::time_point last_fire_time;
+    Clock::time_point respawn_time;
+    Clock::time_point last_packet_time;
+    uint64_t client_key;
+    glm::vec3 pos_at_last_step;
+    float velocityY = 0.0f;
+    ReliableEndpoint channel;
+    uint32_t reliable_bytes = 0;  // sent by the simulation this tick
+    NetQuality quality;
+};
+
+// Index of a player id's slot in Match::clients
+inline uint32_t player_slot(uint32_t player_id) {
+    return SlotTable<ClientInfo>::index_of(player_id);
+}
+
+// Per-client snapshot sending state, owned by the match's serializer
+struct ClientSendState {
+    uint32_t player_id = 0;          // 0 while the slot is unused
+    uint32_t bandwidth_limit = 0;    // bytes per second
+    float bandwidth_tokens = 0.0f;   // bytes we may still send; negative when over budget
+    uint64_t bytes_sent_window = 0;  // since the last stats line
+    uint64_t state_bytes_window = 0;
+    uint64_t sound_bytes_window = 0;
+    uint64_t entities_deferred_window = 0;
+    uint64_t entities_culled_window = 0;
+    uint64_t sounds_sent_window = 0;
+    uint64_t sounds_culled_window = 0;  // too far along the map to be heard
+    uint32_t snapshots_window = 0;
+    uint32_t last_seen_tick = 0;
+    uint32_t last_built_tick = 0;  // tick of the previous snapshot built for this client
+    std::vector<EntityPriority> player_priority;      // by player slot
+    std::vector<EntityPriority> projectile_priority;  // max_projectiles entries
+    // Entities with shown set, and ones recently taken out of view while
+    // their removal is repeated
+    std::vector<ShownEntity> shown;
+};
+
+struct SnapshotPlayer {
+    PlayerState state;
+    sockaddr_in addr;
+    ReliableAck ack;
+    uint32_t reliable_bytes;
+    // Link quality for adapting the send budget; rtt_ms is 0 until measured
+    float rtt_ms;
+    float min_rtt_ms;
+    float loss;
+};
+
+// What the serializer needs from one finished tick. Published by the
+// simulation and not modified afterwards.
+struct WorldSnapshot {
+    uint32_t tick = 0;
+    float dt = 0.0f;
+    std::vector<SnapshotPlayer> players;  // in client iteration order
+    std::vector<ProjectileState> projectiles;
+    std::vector<uint32_t> projectile_despawn_tick;
+    // Slots that are active or despawned recently enough to be resent
+    std::vector<uint16_t> live_projectiles;
+};
+
+// splitmix64, so a seed fully determines the map layout and spawn choices
+struct SimRng {
+    uint64_t state = 0;
+
+    uint64_t next() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+};
+
+struct Point3D {
+    int x, y, z;
+};
+
+struct Room {
+    int x, y, z, width, height, length;
+    bool intersects(const Room& other) const {
+        return (x < other.x + other.width && x + width > other.x
+            && z < other.z + other.length && z + length > other.z);
+    }
+    Point3D center() const { return {x + width / 2, y, z + length / 2}; }
+};
+
+// Snapshot entities bucketed by XZ grid cell and by room, rebuilt by the
+// serializer for every snapshot it sends, plus each player's PVS cluster
+struct AoiIndex {
+    std::vector<std::vector<uint32_t>> cell_players;  // indices into WorldSnapshot::players
+    std::vector<std::vector<uint16_t>> cell_projectiles;
+    std::vector<std::vector<uint32_t>> room_players;
+    std::vector<std::vector<uint16_t>> room_projectiles;
+    std::vector<int> player_room;      // per WorldSnapshot::players entry, -1 outside any room
+    std::vector<int> projectile_room;  // per projectile slot
+    std::vector<int> player_cluster;
+};
+
+struct SnapshotCandidate {
+    float priority;
+    bool is_player;
+    uint32_t key;  // index into WorldSnapshot::players, or projectile slot
+};
+
+// Per-thread buffers for building and sending one client's snapshot
+struct SnapshotScratch {
+    std::vector<uint8_t> snapshot_buf;
+    std::vector<size_t> snapshot_part_offsets;
+    std::vector<SnapshotCandidate> candidates;
+    std::vector<uint32_t> chosen_players;
+    std::vector<uint32_t> chosen_projectiles;
+    std::vector<EntityRemoval> removals;
+    uint8_t pvs_row[PVS_ROW_BYTES];
+    PacketBundler bundler;
+};
+
+// A projectile that passed through a player this tick; resolved in
+// (projectile, client_list index) order
+struct HitCandidate {
+    uint32_t projectile;
+    uint32_t client_index;
+};
+
+// Inbox entry header; the datagram follows it
+struct InboundPacket {
+    sockaddr_in addr;
+    uint32_t len;
+    Clock::time_point received;
+};
+
+// When a tick's snapshot was published, for timing the echoes of it
+struct TickStamp {
+    uint32_t tick = UINT32_MAX;
+    Clock::time_point published;
+};
+
+const uint32_t TICK_STAMP_HISTORY = 64;
+
+// One game: its map, players and projectiles, ticked on its own schedule. A
+// tick runs on one worker thread at a time; the network thread only touches
+// the inbox and the routing fields while the match is not running.
+struct Match {
+    uint32_t id = 0;
+
+    // Player ids are handles into this table, so a departed player's id never
+    // matches the player who takes over its slot
+    SlotTable<ClientInfo> clients;
+    std::unordered_map<uint64_t, uint32_t> addr_to_id;
+    int game_map[MAP_WIDTH][MAP_HEIGHT][MAP_LENGTH];
+    // Sized to match_config.max_projectiles at start
+    std::vector<ProjectileState> projectiles;
+    std::vector<uint32_t> projectile_despawn_tick;
+    std::vector<glm::vec3> projectile_prev_pos;
+    size_t next_projectile_slot = 0;
+    std::vector<glm::vec3> spawn_points;
+    // Rooms of both levels and, per room, a bit for itself and each room a
+    // tunnel or ramp leads to. Fixed once the map is generated.
+    std::vector<Room> rooms;
+    std::vector<uint64_t> room_links;
+    Pvs pvs;
+
+    uint32_t current_tick = 0;
+    TickStamp tick_stamps[TICK_STAMP_HISTORY];  // by tick % TICK_STAMP_HISTORY
+    SimRng sim_rng;
+    FILE* hash_log = nullptr;
+    // Input recording, null when off. Times in it are from record_epoch.
+    FILE* record = nullptr;
+    Clock::time_point record_epoch;
+    // Start of the running tick: the simulation clock outside deterministic
+    // mode, so every input of a tick sees the same time and a replay can
+    // set it from the recording
+    Clock::time_point tick_time;
+
+    Clock::time_point last_tick_time;
+    Clock::time_point last_stats_time;
+
+    PacketBundler bundler;
+
+    // Clients in iteration order, rebuilt every tick so phases can split them into jobs
+    std::vector<std::pair<uint32_t, ClientInfo*>> client_list;
+    std::vector<uint8_t> footsteps;
+
+    std::vector<std::vector<HitCandidate>> hit_buffers;  // indexed by job_worker_index()
+    std::vector<HitCandidate> hits;
+
+    // Simulation to serializer handoff. The serializer runs as its own job so
+    // a tick never waits on encoding or the socket; when it falls behind it
+    // skips to the newest snapshot. Sounds go through a queue so none are skipped.
+    TripleBuffer<WorldSnapshot> snapshots;
+    SpscRing<SoundEventPacket, 1024> sound_queue;
+    uint64_t sounds_dropped = 0;
+    std::atomic<bool> serializing{false};
+
+    // Owned by the serializer
+    std::vector<ClientSendState> send_states;  // by player slot
+    std::vector<SnapshotScratch> scratch;  // indexed by job_worker_index()
+    std::vector<SoundEventPacket> pending_sounds;
+    std::vector<const uint8_t*> pending_sound_fields;  // per pending sound, null to send to everyone
+    SoundFieldCache sound_fields;
+    AoiIndex aoi;
+    Clock::time_point last_bandwidth_stats_time;
+
+    // Phase timings since the last stats line of each side
+    TickProfile profile;
+    // Published to the shared-memory segment at the end of each tick and each
+    // snapshot; the block is null when metrics are off
+    MetricsMatch* metrics_block = nullptr;
+    MetricsTick tick_metrics{};
+    MetricsSnapshot snapshot_metrics{};
+
+    // Datagrams routed here by the network thread, handled at the start of the next tick
+    std::mutex inbox_mutex;
+    std::vector<uint8_t> inbox;
+    std::vector<uint8_t> inbox_draining;
+
+    // Set by the network thread when it schedules a tick, cleared by the tick
+    std::atomic<bool> running{false};
+    // Connections routed to this match; owned by the network thread
+    uint32_t num_routed = 0;
+    // Connections dropped during the last tick, for the network thread to unroute
+    std::vector<uint64_t> departed;
+
+    void start(uint32_t match_id, uint64_t seed, FILE* hash_log_file, FILE* record_file);
+    void enqueue(const sockaddr_in& addr, const uint8_t* data, size_t len, Clock::time_point received);
+    Clock::time_point next_tick_time() const;
+    // Handles the inbox, steps the simulation and sends every client its
+    // snapshot. Clears running when done.
+    void run_tick();
+    void dispatch_inbox();
+
+    int sim_rand();
+    Clock::time_point sim_now();
+
+    void create_room_3d(int x, int y, int z, int width, int height, int length);
+    void create_ramp(Point3D start, Point3D end, int width);
+    void create_h_tunnel_3d(int x1, int x2, int y, int z);
+    void create_v_tunnel_3d(int z1, int z2, int y, int x);
+    std::vector<Room> generate_level(int y_level, long unsigned int min_rooms, int room_height);
+    void generate_map();
+    int room_at(const glm::vec3& pos) const;
+
+    void queue_sound(SoundType type, const glm::vec3& pos);
+    void spawn_projectile(uint32_t owner_id, const glm::vec3& pos, const glm::vec3& dir);
+    void despawn_projectile(int i);
+    int get_floor_height(int x, int z, int start_y);
+    bool update_player(ClientInfo& client, float dt);
+    void update_players(float dt);
+    void move_projectiles(float dt);
+    void resolve_projectile_hits();
+    void respawn_player(ClientInfo& client);
+    uint64_t hash_world_state();
+    // The simulation's part of a tick, shared with replay: respawns the
+    // given players, moves everything and resolves hits
+    void find_respawns(std::vector<uint32_t>& ids);
+    void simulate(float dt, const std::vector<uint32_t>& respawn_ids);
+
+    void send_reliable(Clock::time_point now);
+    void fill_snapshot(WorldSnapshot& snap, uint32_t tick, float dt);
+    void publish_snapshot(uint32_t tick, float dt);
+    void print_tick_stats(Clock::time_point now);
+
+    // Serializer side
+    void run_serializer();
+    template <typename T>
+    void snapshot_append(SnapshotScratch& out, const T& entity, uint16_t SnapshotPacket::* count, uint32_t tick);
+    void track_snapshot_players(const WorldSnapshot& snap);
+    void build_aoi_index(const WorldSnapshot& snap);
+    void build_client_snapshot(SnapshotScratch& out, const WorldSnapshot& snap, size_t viewer_index, ClientSendState& viewer);
+    void send_client_snapshot(SnapshotScratch& out, const WorldSnapshot& snap, size_t viewer_index);
+    void serialize_snapshot(const WorldSnapshot& snap);
+    void publish_snapshot_metrics(uint64_t snapshot_ns);
+    void print_bandwidth_stats(Clock::time_point now);
+
+    uint32_t add_player(const sockaddr_in& addr, uint64_t client_key);
+    void remove_client(uint32_t id);
+    void send_join_data(ClientInfo& client);
+    void send_ack(ClientInfo& client);
+    void handle_action(ClientInfo& client, uint32_t id, const ActionPacket* pkt, Clock::time_point received);
+    // The input an ACT carries: movement, view, jump and fire
+    void apply_action(ClientInfo& client, uint32_t id, const ActionPacket& pkt);
+    void print_quality_stats();
+    void handle_client_packet(const uint8_t* buf, size_t recv_len, const sockaddr_in& client_addr, uint64_t client_key,
+                              Clock::time_point received);
+};
+
+#endif
@@ -0,0 +1,88 @@
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "metrics.h"
+
+using namespace std;
+
+MetricsSegment* metrics = nullptr;
+static size_t metrics_len = 0;
+static char metrics_path[64];
+
+void metrics_name(int port, char* buf, size_t len) {
+    snprintf(buf, len, "/fps-server.%d", port);
+}
+
+bool metrics_create(const char* name, uint32_t max_matches) {
+    // A segment left by a crashed server may be mapped by a reader; unlinking
+    // gives us a fresh one and leaves the reader with the stale copy
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) return false;
+    size_t len = sizeof(MetricsSegment) + (size_t)max_matches * sizeof(MetricsMatch);
+    void* p = MAP_FAILED;
+    if (ftruncate(fd, len) == 0) p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int err = errno;
+    close(fd);
+    if (p == MAP_FAILED) {
+        shm_unlink(name);
+        errno = err;
+        return false;
+    }
+    // ftruncate zero-fills, so every block starts out consistent
+    metrics = (MetricsSegment*)p;
+    metrics_len = len;
+    snprintf(metrics_path, sizeof(metrics_path), "%s", name);
+    metrics->match_size = sizeof(MetricsMatch);
+    metrics->max_matches = max_matches;
+    metrics->pid = getpid();
+    metrics->version = METRICS_VERSION;
+    // Last, so a reader that sees the magic sees the rest of the header
+    atomic_thread_fence(memory_order_release);
+    metrics->magic = METRICS_MAGIC;
+    return true;
+}
+
+void metrics_destroy() {
+    if (!metrics) return;
+    munmap(metrics, metrics_len);
+    metrics = nullptr;
+    shm_unlink(metrics_path);
+}
+
+MetricsMatch* metrics_add_match(uint32_t match_id) {
+    if (!metrics || match_id >= metrics->max_matches) return nullptr;
+    metrics->num_matches.store(match_id + 1, memory_order_release);
+    return (MetricsMatch*)metrics_match_at(metrics, match_id);
+}
+
+const MetricsSegment* metrics_attach(const char* name) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(MetricsSegment)) {
+        p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    } else {
+        errno = EPROTO;
+    }
+    int err = errno;
+    close(fd);
+    if (p == MAP_FAILED) {
+        errno = err;
+        return nullptr;
+    }
+    const MetricsSegment* segment = (const MetricsSegment*)p;
+    if (segment->magic != METRICS_MAGIC || segment->version != METRICS_VERSION
+        || segment->match_size != sizeof(MetricsMatch)
+        || sizeof(MetricsSegment) + (size_t)segment->max_matches * segment->match_size > (size_t)st.st_size) {
+        munmap(p, st.st_size);
+        errno = EPROTO;
+        return nullptr;
+    }
+    return segment;
+}
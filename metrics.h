@@ -0,0 +1,134 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+// Live server metrics in a POSIX shared-memory segment, for server_stats and
+// other readers to map. Publishing is a copy into the mapping, so it costs
+// the server no syscalls.
+//
+// Each block has one writer thread and is guarded by a sequence number that
+// is odd while the writer is copying in. A reader copies the block out and
+// retries if the number was odd or changed meanwhile. Readers check magic and
+// version; any change to the layout below bumps METRICS_VERSION.
+
+const uint32_t METRICS_MAGIC = 0x4d535046;  // "FPSM"
+const uint32_t METRICS_VERSION = 2;
+// Packet types counted separately; see PacketType in protocol.h
+const int METRICS_PACKET_TYPES = 16;
+
+// Written by the network thread
+struct MetricsServer {
+    uint64_t uptime_ms;
+    uint64_t matches;
+    uint64_t connections;
+    uint64_t datagrams_in;
+    uint64_t bytes_in;
+    uint64_t datagrams_in_by_type[METRICS_PACKET_TYPES];  // by the type byte each datagram starts with
+    uint64_t datagrams_out;
+    uint64_t bytes_out;
+    uint64_t datagrams_out_by_type[METRICS_PACKET_TYPES];
+    uint64_t joins_denied;
+    uint64_t net_syscalls;
+    uint64_t log_records_dropped;
+};
+
+// Written by the match's tick
+struct MetricsTick {
+    uint64_t tick;
+    uint64_t ticks;
+    uint64_t players;
+    uint64_t projectiles;
+    uint64_t tick_ns;  // the last tick
+    uint64_t tick_ns_max;
+    uint64_t overruns;
+    uint64_t datagrams_in;  // handled by the last tick
+    uint64_t sounds_dropped;
+    // Over the players with a round-trip measurement
+    uint64_t rtt_us_avg;
+    uint64_t rtt_us_max;
+    uint64_t jitter_us_avg;
+    uint64_t loss_permille_avg;
+    uint64_t loss_permille_max;
+};
+
+// Written by the match's serializer
+struct MetricsSnapshot {
+    uint64_t snapshots;
+    uint64_t snapshot_ns;  // the last snapshot
+    uint64_t datagrams_out;  // sent for the last snapshot
+    uint64_t bytes_out;
+    uint64_t datagrams_out_total;
+    uint64_t bytes_out_total;
+};
+
+template <typename T>
+struct alignas(64) MetricsBlock {
+    std::atomic<uint32_t> seq;
+    T values;
+};
+
+struct MetricsMatch {
+    MetricsBlock<MetricsTick> tick;
+    MetricsBlock<MetricsSnapshot> snapshot;
+};
+
+struct MetricsSegment {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t match_size;  // sizeof(MetricsMatch) of the writer
+    uint32_t max_matches;
+    std::atomic<uint32_t> num_matches;
+    uint32_t pid;
+    MetricsBlock<MetricsServer> server;
+    // max_matches entries follow, match_size bytes apart
+};
+
+template <typename T>
+void metrics_publish(MetricsBlock<T>& block, const T& values) {
+    uint32_t seq = block.seq.load(std::memory_order_relaxed);
+    block.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(&block.values, &values, sizeof(T));
+    block.seq.store(seq + 2, std::memory_order_release);
+}
+
+// Copies the block out once no write overlapped the copy; false if the
+// writer kept it busy through every attempt
+template <typename T>
+bool metrics_read(const MetricsBlock<T>& block, T& out) {
+    for (int attempt = 0; attempt < 1000; attempt++) {
+        uint32_t before = block.seq.load(std::memory_order_acquire);
+        if (before & 1) continue;
+        memcpy(&out, &block.values, sizeof(T));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (block.seq.load(std::memory_order_relaxed) == before) return true;
+    }
+    return false;
+}
+
+inline const MetricsMatch* metrics_match_at(const MetricsSegment* segment, uint32_t match_id) {
+    return (const MetricsMatch*)((const uint8_t*)(segment + 1) + (size_t)match_id * segment->match_size);
+}
+
+// Segment name for the server on port
+void metrics_name(int port, char* buf, size_t len);
+
+// Server side. Creates the segment, replacing one left by a server that
+// didn't exit cleanly; returns false with errno set if shared memory can't
+// be set up.
+bool metrics_create(const char* name, uint32_t max_matches);
+void metrics_destroy();
+// The server's segment, or null when metrics are off
+extern MetricsSegment* metrics;
+// Block for a new match, counted in num_matches; null when metrics are off
+MetricsMatch* metrics_add_match(uint32_t match_id);
+
+// Reader side. Maps an existing segment read-only; null with errno set if
+// there is none, or with errno EPROTO if its layout isn't one we know.
+const MetricsSegment* metrics_attach(const char* name);
+
+#endif
@@ -0,0 +1,569 @@
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <netinet/udp.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#include "net.h"
+
+using namespace std;
+
+atomic<uint64_t> net_syscalls{0};
+
+const unsigned RECV_RING_ENTRIES = 64;
+const unsigned RECV_BUFFERS = 256;  // power of two, at most 32768
+const size_t RECV_BUFFER_SIZE = sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in) + MAX_MTU;
+const uint16_t RECV_BUFFER_GROUP = 0;
+const uint64_t RECV_TAG = UINT64_MAX;
+const int SEND_BATCH_MAX = 64;
+const size_t SEND_ARENA_BYTES = SEND_BATCH_MAX * MAX_MTU;
+const int MAX_EVENTS = 64;
+const int GSO_MAX_SEGMENTS = 64;     // UDP_MAX_SEGMENTS in the kernel
+const size_t GSO_MAX_BYTES = 65000;  // a UDP payload is at most 65507 bytes
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+static bool batching_enabled = false;
+static atomic<bool> gso_enabled{false};
+
+const char* net_backend_name(NetBackendKind kind) {
+    return kind == NET_IO_URING ? "io_uring" : "epoll";
+}
+
+static int sys_io_uring_setup(unsigned entries, io_uring_params* params) {
+    net_syscalls.fetch_add(1, memory_order_relaxed);
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, const void* arg, size_t arg_size) {
+    net_syscalls.fetch_add(1, memory_order_relaxed);
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args) {
+    net_syscalls.fetch_add(1, memory_order_relaxed);
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_close(IoUring& r) {
+    if (r.sqes) munmap(r.sqes, r.sqes_len);
+    if (r.cq_ring && r.cq_ring != r.sq_ring) munmap(r.cq_ring, r.cq_ring_len);
+    if (r.sq_ring) munmap(r.sq_ring, r.sq_ring_len);
+    if (r.fd >= 0) close(r.fd);
+    r = IoUring{};
+}
+
+static bool uring_init(IoUring& r, unsigned entries) {
+    io_uring_params params{};
+    r.fd = sys_io_uring_setup(entries, &params);
+    if (r.fd < 0) return false;
+    // Waiting with a timeout needs EXT_ARG (5.11)
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        uring_close(r);
+        return false;
+    }
+    r.entries = params.sq_entries;
+    r.sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r.cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        r.sq_ring_len = r.cq_ring_len = max(r.sq_ring_len, r.cq_ring_len);
+    }
+    r.sq_ring = mmap(nullptr, r.sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQ_RING);
+    if (r.sq_ring == MAP_FAILED) {
+        r.sq_ring = nullptr;
+        uring_close(r);
+        return false;
+    }
+    r.cq_ring = single_mmap ? r.sq_ring
+        : mmap(nullptr, r.cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_CQ_RING);
+    if (r.cq_ring == MAP_FAILED) {
+        r.cq_ring = nullptr;
+        uring_close(r);
+        return false;
+    }
+    r.sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, r.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        uring_close(r);
+        return false;
+    }
+    r.sqes = (io_uring_sqe*)sqes;
+
+    uint8_t* sq = (uint8_t*)r.sq_ring;
+    uint8_t* cq = (uint8_t*)r.cq_ring;
+    r.sq_head = (unsigned*)(sq + params.sq_off.head);
+    r.sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    r.sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    r.cq_head = (unsigned*)(cq + params.cq_off.head);
+    r.cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    r.cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    r.cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    // Sqes are always filled in ring order, so the index array is the identity
+    unsigned* sq_array = (unsigned*)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        sq_array[i] = i;
+    }
+    r.sqe_tail = *r.sq_tail;
+    return true;
+}
+
+// Null when the submission queue is full
+static io_uring_sqe* uring_get_sqe(IoUring& r) {
+    if (r.sqe_tail - __atomic_load_n(r.sq_head, __ATOMIC_ACQUIRE) >= r.entries) return nullptr;
+    io_uring_sqe* sqe = &r.sqes[r.sqe_tail & *r.sq_mask];
+    r.sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Submits the filled sqes and waits for min_complete completions, or until
+// timeout_ms passes when it isn't negative. Returns a negative errno on failure.
+static int uring_submit(IoUring& r, unsigned min_complete, int timeout_ms) {
+    unsigned to_submit = r.sqe_tail - *r.sq_tail;
+    __atomic_store_n(r.sq_tail, r.sqe_tail, __ATOMIC_RELEASE);
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+    if (min_complete && timeout_ms >= 0) {
+        __kernel_timespec ts{timeout_ms / 1000, (long long)(timeout_ms % 1000) * 1000000};
+        io_uring_getevents_arg arg{};
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = (uint64_t)&ts;
+        ret = sys_io_uring_enter(r.fd, to_submit, min_complete, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    } else {
+        ret = sys_io_uring_enter(r.fd, to_submit, min_complete, flags, nullptr, _NSIG / 8);
+    }
+    return ret < 0 ? -errno : ret;
+}
+
+// Calls fn for each completion that is ready and returns how many there were
+template <typename F>
+static unsigned uring_reap(IoUring& r, F fn) {
+    unsigned head = *r.cq_head;
+    unsigned tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+    unsigned count = tail - head;
+    for (; head != tail; head++) {
+        fn(r.cqes[head & *r.cq_mask]);
+    }
+    __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+// Hands a receive buffer back to the kernel. The entries are indexed from
+// the start of the ring: in C++ the header's flexible bufs member sits after
+// an empty struct and is misplaced.
+static void recycle_buffer(NetBackend& net, uint16_t bid) {
+    io_uring_buf* buf = (io_uring_buf*)net.buf_ring + (net.buf_ring_tail & (RECV_BUFFERS - 1));
+    buf->addr = (uint64_t)(net.buffers + bid * RECV_BUFFER_SIZE);
+    buf->len = RECV_BUFFER_SIZE;
+    buf->bid = bid;
+    net.buf_ring_tail++;
+    __atomic_store_n(&net.buf_ring->tail, net.buf_ring_tail, __ATOMIC_RELEASE);
+}
+
+// Queues the multishot receive; it stays armed until it runs out of buffers
+// or fails
+static void arm_recv(NetBackend& net) {
+    io_uring_sqe* sqe = uring_get_sqe(net.ring);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = net.sock;
+    sqe->addr = (uint64_t)&net.recv_msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_BUFFER_GROUP;
+    sqe->user_data = RECV_TAG;
+    net.recv_armed = true;
+}
+
+// Whether the kernel turned down the receive just submitted, looking at the
+// queued completions without taking them
+static bool recv_rejected(const NetBackend& net) {
+    const IoUring& r = net.ring;
+    unsigned tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+    for (unsigned head = *r.cq_head; head != tail; head++) {
+        const io_uring_cqe& cqe = r.cqes[head & *r.cq_mask];
+        if (cqe.user_data == RECV_TAG && cqe.res < 0 && !(cqe.flags & IORING_CQE_F_MORE)) return true;
+    }
+    return false;
+}
+
+static bool open_io_uring(NetBackend& net) {
+    if (!uring_init(net.ring, RECV_RING_ENTRIES)) return false;
+    size_t ring_len = RECV_BUFFERS * sizeof(io_uring_buf);
+    void* ring_mem = mmap(nullptr, ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring_mem == MAP_FAILED) {
+        uring_close(net.ring);
+        return false;
+    }
+    net.buf_ring = (io_uring_buf_ring*)ring_mem;
+    io_uring_buf_reg reg{};
+    reg.ring_addr = (uint64_t)ring_mem;
+    reg.ring_entries = RECV_BUFFERS;
+    reg.bgid = RECV_BUFFER_GROUP;
+    if (sys_io_uring_register(net.ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(ring_mem, ring_len);
+        net.buf_ring = nullptr;
+        uring_close(net.ring);
+        return false;
+    }
+    net.buffers = new uint8_t[RECV_BUFFERS * RECV_BUFFER_SIZE];
+    for (unsigned bid = 0; bid < RECV_BUFFERS; bid++) {
+        recycle_buffer(net, bid);
+    }
+    // Only the sizes matter: where the sender's address and control data go
+    // in each buffer
+    net.recv_msg.msg_namelen = sizeof(sockaddr_in);
+    net.recv_msg.msg_controllen = 0;
+    // Multishot recvmsg needs 6.0, newer than the buffer rings above (5.19).
+    // Older kernels fail it during submission, so arm it here and check,
+    // rather than re-arming a receive that never works on every poll.
+    arm_recv(net);
+    if (!net.recv_armed || uring_submit(net.ring, 0, 0) < 0 || recv_rejected(net)) {
+        net.recv_armed = false;
+        net_close(net);
+        return false;
+    }
+    return true;
+}
+
+bool net_open(NetBackend& net, int sock, NetBackendKind kind) {
+    net.kind = kind;
+    net.sock = sock;
+    if (kind == NET_IO_URING) return open_io_uring(net);
+    net.epfd = epoll_create1(0);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = sock;
+    return net.epfd >= 0 && epoll_ctl(net.epfd, EPOLL_CTL_ADD, sock, &ev) == 0;
+}
+
+void net_close(NetBackend& net) {
+    if (net.kind == NET_IO_URING) {
+        uring_close(net.ring);
+        if (net.buf_ring) munmap(net.buf_ring, RECV_BUFFERS * sizeof(io_uring_buf));
+        delete[] net.buffers;
+        net.buf_ring = nullptr;
+        net.buffers = nullptr;
+    } else if (net.epfd >= 0) {
+        close(net.epfd);
+    }
+    net.epfd = -1;
+}
+
+static void poll_epoll(NetBackend& net, int timeout_ms, const DatagramHandler& on_datagram) {
+    static uint8_t buf[MAX_MTU];
+    epoll_event events[MAX_EVENTS];
+    net_syscalls.fetch_add(1, memory_order_relaxed);
+    int nfds = epoll_wait(net.epfd, events, MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < nfds; i++) {
+        if (events[i].data.fd != net.sock) continue;
+        while (true) {
+            sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            net_syscalls.fetch_add(1, memory_order_relaxed);
+            ssize_t len = recvfrom(net.sock, buf, sizeof(buf), MSG_DONTWAIT, (sockaddr*)&from, &from_len);
+            if (len < 0) break;
+            on_datagram(buf, len, from);
+        }
+    }
+}
+
+static void poll_io_uring(NetBackend& net, int timeout_ms, const DatagramHandler& on_datagram) {
+    if (!net.recv_armed) arm_recv(net);
+    // Skip the wait when completions are already queued
+    bool ready = *net.ring.cq_head != __atomic_load_n(net.ring.cq_tail, __ATOMIC_ACQUIRE);
+    uring_submit(net.ring, ready ? 0 : 1, timeout_ms);
+    uring_reap(net.ring, [&](const io_uring_cqe& cqe) {
+        if (cqe.user_data != RECV_TAG) return;
+        // Out of buffers or an error ends the multishot; it is re-armed on the next poll
+        if (!(cqe.flags & IORING_CQE_F_MORE)) net.recv_armed = false;
+        if (cqe.res < 0 || !(cqe.flags & IORING_CQE_F_BUFFER)) return;
+        uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        uint8_t* buf = net.buffers + bid * RECV_BUFFER_SIZE;
+        const io_uring_recvmsg_out* out = (const io_uring_recvmsg_out*)buf;
+        const uint8_t* name = buf + sizeof(io_uring_recvmsg_out);
+        const uint8_t* payload = name + net.recv_msg.msg_namelen + net.recv_msg.msg_controllen;
+        if (out->namelen >= sizeof(sockaddr_in) && !(out->flags & MSG_TRUNC)) {
+            sockaddr_in from;
+            memcpy(&from, name, sizeof(from));
+            on_datagram(payload, out->payloadlen, from);
+        }
+        recycle_buffer(net, bid);
+    });
+}
+
+void net_poll(NetBackend& net, int timeout_ms, const DatagramHandler& on_datagram) {
+    if (net.kind == NET_IO_URING) {
+        poll_io_uring(net, timeout_ms, on_datagram);
+    } else {
+        poll_epoll(net, timeout_ms, on_datagram);
+    }
+}
+
+// One queued send: a datagram, or a run of same-sized datagrams to one
+// destination that the kernel segments (only the last may be shorter)
+struct SendEntry {
+    int sock;
+    sockaddr_in addr;
+    iovec iov;
+    msghdr msg;
+    uint16_t segment_size;  // 0 for a single datagram
+    alignas(cmsghdr) uint8_t control[CMSG_SPACE(sizeof(uint16_t))];
+};
+
+// Datagrams queued by one thread, with a ring of its own to submit them.
+// Payloads are copied into the arena; a GSO run grows at its end.
+struct SendBatch {
+    IoUring ring;
+    bool ring_ok = false;
+    int depth = 0;
+    int count = 0;
+    SendEntry entries[SEND_BATCH_MAX];
+    size_t arena_len = 0;
+    uint8_t arena[SEND_ARENA_BYTES];
+
+    int run_sock = -1;
+    sockaddr_in run_addr{};
+    size_t run_start = 0;
+    size_t run_segment_size = 0;
+    int run_count = 0;
+    bool run_closed = false;  // a short segment was added, so nothing can follow it
+
+    ~SendBatch() { uring_close(ring); }
+};
+
+static thread_local unique_ptr<SendBatch> send_batch;
+
+void net_enable_batching(bool enabled) {
+    batching_enabled = enabled;
+}
+
+bool net_enable_gso(int sock, bool enabled) {
+    // Kernels without UDP_SEGMENT (before 4.18) reject the option
+    int segment_size = 0;
+    socklen_t len = sizeof(segment_size);
+    gso_enabled = enabled && getsockopt(sock, SOL_UDP, UDP_SEGMENT, &segment_size, &len) == 0;
+    return gso_enabled;
+}
+
+static void fill_msg(SendEntry& e, const uint8_t* data, size_t len) {
+    e.iov = {(void*)data, len};
+    e.msg = msghdr{};
+    e.msg.msg_name = &e.addr;
+    e.msg.msg_namelen = sizeof(sockaddr_in);
+    e.msg.msg_iov = &e.iov;
+    e.msg.msg_iovlen = 1;
+    if (e.segment_size > 0) {
+        e.msg.msg_control = e.control;
+        e.msg.msg_controllen = sizeof(e.control);
+        cmsghdr* cm = CMSG_FIRSTHDR(&e.msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        memcpy(CMSG_DATA(cm), &e.segment_size, sizeof(e.segment_size));
+    }
+}
+
+// A segmented send the kernel refused: the device or route can't segment
+// (no checksum offload, or a segment larger than its MTU). Sends these
+// datagrams and all later ones singly.
+static void gso_failed(const SendEntry& e) {
+    gso_enabled = false;
+    const uint8_t* data = (const uint8_t*)e.iov.iov_base;
+    for (size_t offset = 0; offset < e.iov.iov_len; offset += e.segment_size) {
+        net_syscalls.fetch_add(1, memory_order_relaxed);
+        sendto(e.sock, data + offset, min((size_t)e.segment_size, e.iov.iov_len - offset), 0,
+               (const sockaddr*)&e.addr, sizeof(e.addr));
+    }
+}
+
+static bool retry_singly(int err, const SendEntry& e) {
+    return e.segment_size > 0 && err != EAGAIN && err != ENOBUFS && err != EINTR;
+}
+
+// Sends a queued entry with its own syscall
+static void send_now(const SendEntry& e) {
+    net_syscalls.fetch_add(1, memory_order_relaxed);
+    if (sendmsg(e.sock, &e.msg, 0) < 0 && retry_singly(errno, e)) gso_failed(e);
+}
+
+static void flush_batch(SendBatch& batch) {
+    int queued = 0;
+    for (; queued < batch.count; queued++) {
+        io_uring_sqe* sqe = uring_get_sqe(batch.ring);
+        if (!sqe) break;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = batch.entries[queued].sock;
+        sqe->addr = (uint64_t)&batch.entries[queued].msg;
+        sqe->len = 1;
+        sqe->user_data = queued;
+    }
+    // UDP sends complete during submission, so this normally returns at once
+    unsigned head = __atomic_load_n(batch.ring.sq_head, __ATOMIC_ACQUIRE);
+    uring_submit(batch.ring, queued, -1);
+    unsigned submitted = __atomic_load_n(batch.ring.sq_head, __ATOMIC_ACQUIRE) - head;
+    if (submitted < (unsigned)queued) {
+        // The kernel took only some (out of memory, or interrupted): take the
+        // rest back off the queue, which it reads only inside io_uring_enter
+        batch.ring.sqe_tail = head + submitted;
+        __atomic_store_n(batch.ring.sq_tail, batch.ring.sqe_tail, __ATOMIC_RELEASE);
+    }
+    for (int i = submitted; i < batch.count; i++) send_now(batch.entries[i]);
+
+    // The entries and arena are reused as soon as every send has completed,
+    // so none is left in flight to complete into the next batch
+    unsigned pending = submitted;
+    while (pending > 0) {
+        pending -= uring_reap(batch.ring, [&](const io_uring_cqe& cqe) {
+            const SendEntry& e = batch.entries[cqe.user_data];
+            if (cqe.res < 0 && retry_singly(-cqe.res, e)) gso_failed(e);
+        });
+        if (pending == 0) break;
+        // The kernel posts the completions whether or not we wait in it, so
+        // if waiting fails they are polled for instead
+        int ret = uring_submit(batch.ring, pending, -1);
+        if (ret < 0 && ret != -EINTR) this_thread::sleep_for(chrono::microseconds(50));
+    }
+    batch.count = 0;
+    batch.arena_len = 0;
+}
+
+// Queues a send whose bytes are already in the arena, or sends it at once
+// without a ring
+static void send_entry(SendBatch* batch, SendEntry& e, const uint8_t* data, size_t len) {
+    fill_msg(e, data, len);
+    if (batch && batch->ring_ok && batch->depth > 0) {
+        batch->count++;
+        if (batch->count == SEND_BATCH_MAX) flush_batch(*batch);
+        return;
+    }
+    send_now(e);
+}
+
+// Sends one datagram now, or queues it on the thread's ring inside a batch
+static void send_datagram(SendBatch* batch, int sock, const void* data, size_t len, const sockaddr_in& addr) {
+    if (!batching_enabled || !batch || batch->depth == 0 || !batch->ring_ok || len > MAX_MTU) {
+        net_syscalls.fetch_add(1, memory_order_relaxed);
+        sendto(sock, data, len, 0, (const sockaddr*)&addr, sizeof(addr));
+        return;
+    }
+    if (batch->arena_len + len > SEND_ARENA_BYTES) flush_batch(*batch);
+    uint8_t* copy = batch->arena + batch->arena_len;
+    memcpy(copy, data, len);
+    batch->arena_len += len;
+    SendEntry& e = batch->entries[batch->count];
+    e.sock = sock;
+    e.addr = addr;
+    e.segment_size = 0;
+    send_entry(batch, e, copy, len);
+}
+
+static void flush_gso(SendBatch& batch) {
+    if (batch.run_count == 0) return;
+    // Without a ring the run is sent now, so its bytes can be reused
+    bool queued = batch.ring_ok;
+    SendEntry single;
+    SendEntry& e = queued ? batch.entries[batch.count] : single;
+    e.sock = batch.run_sock;
+    e.addr = batch.run_addr;
+    e.segment_size = batch.run_count > 1 ? (uint16_t)batch.run_segment_size : 0;
+    size_t run_start = batch.run_start;
+    batch.run_count = 0;
+    batch.run_closed = false;
+    send_entry(&batch, e, batch.arena + run_start, batch.arena_len - run_start);
+    if (!queued) batch.arena_len = run_start;
+}
+
+// Written only by their own thread, so counting a send needs no locked
+// instruction. Never freed, so the totals keep what exited threads sent.
+struct SendCounters {
+    atomic<uint64_t> datagrams[NET_COUNTED_TYPES];
+    atomic<uint64_t> bytes;
+};
+
+static mutex counters_mutex;
+static vector<SendCounters*> all_counters;
+static thread_local SendCounters* send_counters = nullptr;
+
+static void count_send(const void* data, size_t len) {
+    SendCounters* c = send_counters;
+    if (!c) {
+        c = send_counters = new SendCounters();
+        lock_guard<mutex> lock(counters_mutex);
+        all_counters.push_back(c);
+    }
+    int type = len > 0 ? min((int)*(const uint8_t*)data, NET_COUNTED_TYPES - 1) : 0;
+    c->datagrams[type].store(c->datagrams[type].load(memory_order_relaxed) + 1, memory_order_relaxed);
+    c->bytes.store(c->bytes.load(memory_order_relaxed) + len, memory_order_relaxed);
+}
+
+void net_send_totals(NetSendTotals& totals) {
+    totals = NetSendTotals{};
+    lock_guard<mutex> lock(counters_mutex);
+    for (SendCounters* c : all_counters) {
+        for (int t = 0; t < NET_COUNTED_TYPES; t++) totals.datagrams[t] += c->datagrams[t].load(memory_order_relaxed);
+        totals.bytes += c->bytes.load(memory_order_relaxed);
+    }
+}
+
+void net_sendto(int sock, const void* data, size_t len, const sockaddr_in& addr) {
+    count_send(data, len);
+    SendBatch* batch = send_batch.get();
+    if (!gso_enabled || !batch || batch->depth == 0) {
+        send_datagram(batch, sock, data, len, addr);
+        return;
+    }
+    if (batch->run_count > 0
+        && (sock != batch->run_sock || addr.sin_addr.s_addr != batch->run_addr.sin_addr.s_addr
+            || addr.sin_port != batch->run_addr.sin_port || len > batch->run_segment_size || batch->run_closed
+            || batch->run_count == GSO_MAX_SEGMENTS
+            || batch->arena_len - batch->run_start + len > GSO_MAX_BYTES
+            || batch->arena_len + len > SEND_ARENA_BYTES)) {
+        flush_gso(*batch);
+    }
+    if (batch->run_count == 0) {
+        if (batch->count > 0 && batch->arena_len + len > SEND_ARENA_BYTES) flush_batch(*batch);
+        batch->run_sock = sock;
+        batch->run_addr = addr;
+        batch->run_start = batch->arena_len;
+        batch->run_segment_size = len;
+    } else if (len < batch->run_segment_size) {
+        batch->run_closed = true;
+    }
+    memcpy(batch->arena + batch->arena_len, data, len);
+    batch->arena_len += len;
+    batch->run_count++;
+}
+
+void net_batch_begin() {
+    if (!send_batch) {
+        if (!batching_enabled && !gso_enabled) return;
+        send_batch.reset(new SendBatch);
+        send_batch->ring_ok = batching_enabled && uring_init(send_batch->ring, SEND_BATCH_MAX);
+    }
+    send_batch->depth++;
+}
+
+void net_batch_end() {
+    if (!send_batch || send_batch->depth == 0) return;
+    if (send_batch->depth == 1) {
+        flush_gso(*send_batch);
+        if (send_batch->count > 0) flush_batch(*send_batch);
+    }
+    send_batch->depth--;
+}
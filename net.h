@@ -0,0 +1,94 @@
+#ifndef NET_H
+#define NET_H
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <functional>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "protocol.h"
+
+// How the server waits for and reads datagrams
+enum NetBackendKind {
+    NET_EPOLL,
+    NET_IO_URING,
+};
+
+// The parts of io_uring we use, set up with raw syscalls
+struct IoUring {
+    int fd = -1;
+    unsigned entries = 0;
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    struct io_uring_sqe* sqes = nullptr;
+    struct io_uring_cqe* cqes = nullptr;
+    unsigned sqe_tail = 0;  // next sqe to fill; published to *sq_tail on submit
+    void* sq_ring = nullptr;
+    void* cq_ring = nullptr;
+    size_t sq_ring_len = 0;
+    size_t cq_ring_len = 0;
+    size_t sqes_len = 0;
+};
+
+struct NetBackend {
+    NetBackendKind kind = NET_EPOLL;
+    int sock = -1;
+    int epfd = -1;
+
+    // io_uring: one multishot recvmsg keeps receiving into buffers the
+    // kernel picks from a registered ring, so a busy socket needs no
+    // syscall per datagram
+    IoUring ring;
+    struct io_uring_buf_ring* buf_ring = nullptr;
+    uint16_t buf_ring_tail = 0;
+    uint8_t* buffers = nullptr;
+    msghdr recv_msg{};
+    bool recv_armed = false;
+};
+
+using DatagramHandler = std::function<void(const uint8_t* data, size_t len, const sockaddr_in& from)>;
+
+const char* net_backend_name(NetBackendKind kind);
+// Returns false if this kind can't be used here; the caller falls back to epoll
+bool net_open(NetBackend& net, int sock, NetBackendKind kind);
+void net_close(NetBackend& net);
+// Waits up to timeout_ms for datagrams and hands every one that arrived to on_datagram
+void net_poll(NetBackend& net, int timeout_ms, const DatagramHandler& on_datagram);
+
+// Send batching. Once enabled, datagrams passed to net_sendto() between
+// net_batch_begin() and the matching net_batch_end() on one thread are
+// queued and submitted to that thread's io_uring together. Outside a batch,
+// or with batching off, net_sendto() is a plain sendto().
+//
+// With GSO on, consecutive same-sized datagrams to one destination inside a
+// batch are also joined into one buffer that the kernel splits into
+// datagrams (UDP_SEGMENT), so a split snapshot or the map chunks for a
+// joining client cost one send.
+void net_enable_batching(bool enabled);
+// Returns whether the kernel supports UDP_SEGMENT on sock. If a later send
+// fails anyway, GSO is switched off and the datagrams go out one at a time.
+bool net_enable_gso(int sock, bool enabled);
+void net_batch_begin();
+void net_batch_end();
+void net_sendto(int sock, const void* data, size_t len, const sockaddr_in& addr);
+
+// Datagrams handed to net_sendto() since the start, summed over threads, by
+// their first byte (the packet type). Types from NET_COUNTED_TYPES - 1 up
+// share the last counter.
+const int NET_COUNTED_TYPES = 16;
+struct NetSendTotals {
+    uint64_t datagrams[NET_COUNTED_TYPES];
+    uint64_t bytes;
+};
+void net_send_totals(NetSendTotals& totals);
+
+// Syscalls made by this module, for comparing backends
+extern std::atomic<uint64_t> net_syscalls;
+
+#endif
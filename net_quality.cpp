@@ -0,0 +1,54 @@
+#include <cmath>
+#include <algorithm>
+
+#include "net_quality.h"
+
+using namespace std;
+
+void quality_on_sequenced(NetQuality& q, uint32_t seq, uint32_t send_time_us, QualityClock::time_point received) {
+    int64_t arrival_us = chrono::duration_cast<chrono::microseconds>(received.time_since_epoch()).count();
+    // Both clocks' offsets cancel out in the difference of two transits;
+    // the client's clock wraps every 71 minutes
+    int64_t transit = arrival_us - send_time_us;
+    if (q.have_transit) {
+        int64_t d = transit - q.last_transit_us;
+        d = (int64_t)(int32_t)(uint32_t)d;
+        q.jitter_ms += (fabsf(d / 1000.0f) - q.jitter_ms) / 16.0f;
+    }
+    q.last_transit_us = transit;
+    q.have_transit = true;
+
+    if (!q.have_seq) {
+        q.have_seq = true;
+        q.window_start = seq;
+        q.window_received = 0;
+    }
+    int32_t offset = (int32_t)(seq - q.window_start);
+    if (offset < 0) return;  // its window has closed; counted as lost
+    if (offset >= QUALITY_LOSS_WINDOW) {
+        // Close the open window, then skip the ones the gap covers whole in
+        // one step: a client can put any number in its sequence
+        uint32_t lost = QUALITY_LOSS_WINDOW - min<uint32_t>(q.window_received, QUALITY_LOSS_WINDOW);
+        uint32_t skipped = (uint32_t)offset / QUALITY_LOSS_WINDOW - 1;
+        q.loss = skipped ? 1.0f : (float)lost / QUALITY_LOSS_WINDOW;
+        q.packets_lost += lost + (uint64_t)skipped * QUALITY_LOSS_WINDOW;
+        q.window_start += (skipped + 1) * QUALITY_LOSS_WINDOW;
+        q.window_received = 0;
+    }
+    q.window_received++;
+    q.packets_received++;
+}
+
+void quality_on_rtt_sample(NetQuality& q, float rtt_ms) {
+    rtt_ms = max(rtt_ms, 0.0f);
+    if (!q.have_rtt) {
+        q.have_rtt = true;
+        q.srtt_ms = rtt_ms;
+        q.rttvar_ms = rtt_ms / 2.0f;
+        q.min_rtt_ms = rtt_ms;
+        return;
+    }
+    q.rttvar_ms = 0.75f * q.rttvar_ms + 0.25f * fabsf(q.srtt_ms - rtt_ms);
+    q.srtt_ms = 0.875f * q.srtt_ms + 0.125f * rtt_ms;
+    q.min_rtt_ms = min(q.min_rtt_ms, rtt_ms);
+}
@@ -0,0 +1,51 @@
+#ifndef NET_QUALITY_H
+#define NET_QUALITY_H
+
+#include <cstdint>
+#include <chrono>
+
+#include "protocol.h"
+
+// How a client's connection is doing, from the server's side. Fed by the
+// client's ACT packets, which carry a sequence number in hdr.tick_id, the
+// client's send time and the newest snapshot tick it has received.
+
+#define QUALITY_LOSS_WINDOW 64  // packets per loss measurement
+
+using QualityClock = std::chrono::steady_clock;
+
+struct NetQuality {
+    // Round trip from snapshot publish to the ACT echoing its tick, less
+    // the time the client held the echo; smoothed as in RFC 6298
+    bool have_rtt = false;
+    float srtt_ms = 0.0f;
+    float rttvar_ms = 0.0f;
+    float min_rtt_ms = 0.0f;
+
+    // RFC 3550 inter-arrival jitter, from the client's send timestamps
+    bool have_transit = false;
+    int64_t last_transit_us = 0;
+    float jitter_ms = 0.0f;
+
+    // Loss from gaps in the ACT sequence, measured over windows of
+    // QUALITY_LOSS_WINDOW sequence numbers. Late packets count toward their
+    // window if it is still open.
+    bool have_seq = false;
+    uint32_t window_start = 0;
+    uint32_t window_received = 0;
+    float loss = 0.0f;  // fraction lost in the last complete window
+    uint64_t packets_received = 0;
+    uint64_t packets_lost = 0;
+
+    // Message bytes by packet type, without bundle framing. Outbound only
+    // counts what the simulation sends; snapshots are the serializer's.
+    uint64_t bytes_in[NUM_PACKET_TYPES] = {};
+    uint64_t bytes_out[NUM_PACKET_TYPES] = {};
+};
+
+// An ACT with sequence number seq arrived at received; send_time_us is the
+// client's clock when it sent it
+void quality_on_sequenced(NetQuality& q, uint32_t seq, uint32_t send_time_us, QualityClock::time_point received);
+void quality_on_rtt_sample(NetQuality& q, float rtt_ms);
+
+#endif
@@ -0,0 +1,187 @@
+// Network backend benchmark: simulated clients send datagrams at a fixed rate
+// to one backend thread that echoes each one back, the way the server answers
+// input with snapshots. Reports syscalls per second, backend CPU per packet
+// and round-trip latency percentiles for each backend.
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+#include "net.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+#define MAX_EVENTS 256
+#define PAYLOAD_SIZE 200
+
+struct BenchResult {
+    uint64_t packets = 0;
+    double seconds = 0.0;
+    uint64_t syscalls = 0;
+    double cpu_s = 0.0;
+    vector<uint32_t> rtt_us;
+};
+
+static double thread_cpu_seconds() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+static bool run_backend(NetBackendKind kind, int clients, int rate, int duration_s, BenchResult& result) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(sock, (sockaddr*)&addr, sizeof(addr));
+    socklen_t addr_len = sizeof(addr);
+    getsockname(sock, (sockaddr*)&addr, &addr_len);
+
+    NetBackend net;
+    if (!net_open(net, sock, kind)) {
+        close(sock);
+        return false;
+    }
+    net_enable_batching(kind == NET_IO_URING);
+
+    atomic<bool> stop{false};
+    atomic<bool> ready{false};
+    uint64_t echoed = 0;
+    uint64_t syscalls = 0;
+    double cpu_s = 0.0;
+    thread backend([&] {
+        net_syscalls = 0;
+        double cpu_start = thread_cpu_seconds();
+        ready = true;
+        while (!stop) {
+            net_batch_begin();
+            net_poll(net, 10, [&](const uint8_t* data, size_t len, const sockaddr_in& from) {
+                net_sendto(sock, data, len, from);
+                echoed++;
+            });
+            net_batch_end();
+        }
+        cpu_s = thread_cpu_seconds() - cpu_start;
+        syscalls = net_syscalls;
+    });
+    while (!ready) this_thread::yield();
+
+    int epfd = epoll_create1(0);
+    vector<int> socks(clients);
+    for (int i = 0; i < clients; i++) {
+        socks[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        connect(socks[i], (sockaddr*)&addr, sizeof(addr));
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = socks[i];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, socks[i], &ev);
+    }
+
+    uint8_t payload[PAYLOAD_SIZE] = {};
+    uint8_t buf[MAX_MTU];
+    epoll_event events[MAX_EVENTS];
+    result.rtt_us.clear();
+    result.rtt_us.reserve((size_t)clients * rate * duration_s);
+    auto start = Clock::now();
+    auto end = start + chrono::seconds(duration_s);
+    uint64_t sent = 0;
+    int next_client = 0;
+    while (Clock::now() < end) {
+        // Keep the total send rate at clients * rate, spread over the clients
+        double elapsed = chrono::duration<double>(Clock::now() - start).count();
+        uint64_t due = (uint64_t)(elapsed * clients * rate);
+        for (; sent < due; sent++) {
+            uint64_t stamp = now_ns();
+            memcpy(payload, &stamp, sizeof(stamp));
+            send(socks[next_client], payload, sizeof(payload), 0);
+            next_client = (next_client + 1) % clients;
+        }
+        int nfds = epoll_wait(epfd, events, MAX_EVENTS, 1);
+        for (int i = 0; i < nfds; i++) {
+            ssize_t len;
+            while ((len = recv(events[i].data.fd, buf, sizeof(buf), MSG_DONTWAIT)) >= (ssize_t)sizeof(uint64_t)) {
+                uint64_t stamp;
+                memcpy(&stamp, buf, sizeof(stamp));
+                result.rtt_us.push_back((uint32_t)((now_ns() - stamp) / 1000));
+            }
+        }
+    }
+    result.seconds = chrono::duration<double>(Clock::now() - start).count();
+    stop = true;
+    backend.join();
+    for (int s : socks) close(s);
+    close(epfd);
+    net_close(net);
+    close(sock);
+    net_enable_batching(false);
+
+    result.packets = echoed;
+    result.syscalls = syscalls;
+    result.cpu_s = cpu_s;
+    return true;
+}
+
+static uint32_t percentile(const vector<uint32_t>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    return sorted[min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+}
+
+static void print_result(NetBackendKind kind, BenchResult& r) {
+    sort(r.rtt_us.begin(), r.rtt_us.end());
+    printf("%-8s  %8.0f packets/s  %8.0f syscalls/s  %6.3f syscalls/packet  %6.2f us CPU/packet  "
+           "RTT p50 %u us  p99 %u us  p99.9 %u us  max %u us\n",
+           net_backend_name(kind), r.packets / r.seconds, r.syscalls / r.seconds,
+           r.packets ? (double)r.syscalls / r.packets : 0.0, r.packets ? r.cpu_s * 1e6 / r.packets : 0.0,
+           percentile(r.rtt_us, 0.5), percentile(r.rtt_us, 0.99), percentile(r.rtt_us, 0.999),
+           r.rtt_us.empty() ? 0 : r.rtt_us.back());
+}
+
+int main(int argc, char *argv[]) {
+    int clients = 256;
+    int rate = 30;
+    int duration_s = 5;
+    vector<NetBackendKind> kinds = {NET_EPOLL, NET_IO_URING};
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+            clients = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            rate = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            duration_s = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "epoll") == 0) kinds = {NET_EPOLL};
+            else if (strcmp(argv[i], "io_uring") == 0) kinds = {NET_IO_URING};
+            else if (strcmp(argv[i], "both") != 0) { cerr << "Unknown backend " << argv[i] << "\n"; return 1; }
+        } else {
+            cerr << "Usage: " << argv[0] << " [--clients <n>] [--rate <packets/s per client>] [--duration <s>] [--backend epoll|io_uring|both]\n";
+            return 1;
+        }
+    }
+    printf("%d clients x %d packets/s of %d bytes for %d s per backend\n", clients, rate, PAYLOAD_SIZE, duration_s);
+    for (NetBackendKind kind : kinds) {
+        BenchResult result;
+        if (!run_backend(kind, clients, rate, duration_s, result)) {
+            printf("%-8s  not available\n", net_backend_name(kind));
+            continue;
+        }
+        print_result(kind, result);
+    }
+    return 0;
+}
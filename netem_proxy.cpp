@@ -0,0 +1,459 @@
+// UDP proxy that impairs traffic between clients and a server: latency,
+// jitter, loss, duplication, reordering and a bandwidth cap, set apart for
+// each direction. Every client gets its own socket toward the server, so
+// the server still sees one address per client. Decisions come from a
+// random stream per client and direction seeded from --seed, so the same
+// traffic is impaired the same way on every run.
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <csignal>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <vector>
+#include <memory>
+#include <queue>
+#include <unordered_map>
+#include <chrono>
+#include <algorithm>
+
+#include "protocol.h"
+#include "net.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+#define MAX_EVENTS 256
+#define RECV_BATCH 64
+#define SOCKET_BUFFER_BYTES (8 * 1024 * 1024)
+
+const int SESSION_IDLE_TIMEOUT_S = 30;
+
+enum Direction {
+    UP,    // client to server
+    DOWN,  // server to client
+};
+
+const char* direction_names[2] = {"up", "down"};
+
+struct Impairment {
+    double delay_ms = 0.0;
+    double jitter_ms = 0.0;    // uniform in +-jitter around delay; order is kept
+    double loss = 0.0;         // fractions of packets
+    double duplicate = 0.0;
+    double reorder = 0.0;      // sent at once, ahead of delayed packets
+    double rate_kbps = 0.0;    // 0 is unlimited
+    double queue_ms = 1000.0;  // packets that would wait longer at the cap are dropped
+};
+
+struct ProxyConfig {
+    Impairment impair[2];
+    uint64_t seed = 1;
+    int queue_limit = 65536;  // packets held at once, over all clients
+    int stats_interval_s = 5;
+};
+
+ProxyConfig config;
+
+struct DirectionState {
+    uint64_t rng = 0;
+    Clock::time_point last_release;  // keeps jittered packets in order
+    Clock::time_point link_free_at;  // when the capped link finishes what it has
+};
+
+struct Session {
+    sockaddr_in client{};
+    int sock = -1;  // connected to the server
+    uint32_t index = 0;
+    DirectionState dirs[2];
+    Clock::time_point last_active;
+    int pending = 0;  // held packets; a session with some isn't expired
+};
+
+struct DirectionStats {
+    uint64_t received = 0;
+    uint64_t sent = 0;
+    uint64_t lost = 0;
+    uint64_t duplicated = 0;
+    uint64_t reordered = 0;
+    uint64_t queue_drops = 0;  // over --queue-ms at the bandwidth cap
+    uint64_t overflows = 0;    // over --queue-limit
+    uint64_t bytes = 0;
+};
+
+// A packet held until its release time
+struct HeldPacket {
+    Session* session;
+    Direction dir;
+    uint16_t len;
+    uint8_t data[MAX_MTU];
+};
+
+struct Release {
+    Clock::time_point at;
+    uint64_t order;  // ties go out in arrival order
+    uint32_t slot;
+    bool operator>(const Release& o) const { return at != o.at ? at > o.at : order > o.order; }
+};
+
+int listen_sock = -1;
+int epfd = -1;
+int timer_fd = -1;
+sockaddr_in server_addr{};
+unordered_map<uint64_t, unique_ptr<Session>> sessions;
+uint32_t next_session_index = 0;
+unique_ptr<HeldPacket[]> held;  // left uninitialized, so untouched slots cost no memory
+vector<uint32_t> free_slots;
+priority_queue<Release, vector<Release>, greater<Release>> releases;
+uint64_t next_order = 0;
+DirectionStats stats[2];
+volatile sig_atomic_t stop_requested = 0;
+
+static uint64_t splitmix(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+static double random_unit(DirectionState& d) {
+    d.rng ^= d.rng << 13;
+    d.rng ^= d.rng >> 7;
+    d.rng ^= d.rng << 17;
+    return (d.rng >> 11) / 9007199254740992.0;
+}
+
+static uint64_t address_key(const sockaddr_in& addr) {
+    return ((uint64_t)addr.sin_addr.s_addr << 16) | addr.sin_port;
+}
+
+static void set_buffers(int sock) {
+    int size = SOCKET_BUFFER_BYTES;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+}
+
+static Session* find_session(const sockaddr_in& client, Clock::time_point now) {
+    auto it = sessions.find(address_key(client));
+    if (it != sessions.end()) return it->second.get();
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) return nullptr;
+    if (connect(sock, (sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        close(sock);
+        return nullptr;
+    }
+    set_buffers(sock);
+    auto s = make_unique<Session>();
+    s->client = client;
+    s->sock = sock;
+    // Streams depend on the seed and the order clients appeared in, not on timing
+    s->index = next_session_index++;
+    for (int dir = 0; dir < 2; dir++) {
+        s->dirs[dir].rng = splitmix(config.seed ^ splitmix(s->index * 2 + dir)) | 1;
+        s->dirs[dir].last_release = now;
+        s->dirs[dir].link_free_at = now;
+    }
+    s->last_active = now;
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = s.get();
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev);
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client.sin_addr, ip, sizeof(ip));
+    printf("client %u: %s:%d\n", s->index, ip, ntohs(client.sin_port));
+    Session* raw = s.get();
+    sessions[address_key(client)] = move(s);
+    return raw;
+}
+
+static void expire_sessions(Clock::time_point now) {
+    for (auto it = sessions.begin(); it != sessions.end();) {
+        Session& s = *it->second;
+        if (s.pending == 0 && now - s.last_active > chrono::seconds(SESSION_IDLE_TIMEOUT_S)) {
+            close(s.sock);
+            it = sessions.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+static void send_packet(Session& s, Direction dir, const uint8_t* data, size_t len) {
+    if (dir == UP) net_sendto(s.sock, data, len, server_addr);
+    else net_sendto(listen_sock, data, len, s.client);
+    stats[dir].sent++;
+    stats[dir].bytes += len;
+}
+
+// When a copy of a packet arriving now should go out, or false to drop it
+static bool schedule(DirectionState& d, const Impairment& imp, DirectionStats& st, size_t len, Clock::time_point now,
+                     Clock::time_point& at) {
+    if (imp.reorder > 0.0 && random_unit(d) < imp.reorder) {
+        st.reordered++;
+        at = now;
+    } else {
+        double delay_ms = imp.delay_ms;
+        if (imp.jitter_ms > 0.0) delay_ms += imp.jitter_ms * (2.0 * random_unit(d) - 1.0);
+        at = now + chrono::microseconds((int64_t)(max(delay_ms, 0.0) * 1000.0));
+        at = max(at, d.last_release);
+        d.last_release = at;
+    }
+    if (imp.rate_kbps > 0.0) {
+        auto start = max(at, d.link_free_at);
+        if (start - at > chrono::microseconds((int64_t)(imp.queue_ms * 1000.0))) {
+            st.queue_drops++;
+            return false;
+        }
+        d.link_free_at = start + chrono::nanoseconds((int64_t)(len * 8 * 1e6 / imp.rate_kbps));
+        at = d.link_free_at;
+    }
+    return true;
+}
+
+static void handle_packet(Session& s, Direction dir, const uint8_t* data, size_t len, Clock::time_point now) {
+    DirectionState& d = s.dirs[dir];
+    const Impairment& imp = config.impair[dir];
+    DirectionStats& st = stats[dir];
+    st.received++;
+    s.last_active = now;
+    if (imp.loss > 0.0 && random_unit(d) < imp.loss) {
+        st.lost++;
+        return;
+    }
+    int copies = 1;
+    if (imp.duplicate > 0.0 && random_unit(d) < imp.duplicate) {
+        st.duplicated++;
+        copies = 2;
+    }
+    for (int c = 0; c < copies; c++) {
+        Clock::time_point at;
+        if (!schedule(d, imp, st, len, now, at)) continue;
+        if (at <= now && releases.empty()) {
+            send_packet(s, dir, data, len);
+            continue;
+        }
+        if (free_slots.empty()) {
+            st.overflows++;
+            continue;
+        }
+        uint32_t slot = free_slots.back();
+        free_slots.pop_back();
+        HeldPacket& p = held[slot];
+        p.session = &s;
+        p.dir = dir;
+        p.len = (uint16_t)len;
+        memcpy(p.data, data, len);
+        s.pending++;
+        releases.push({at, next_order++, slot});
+    }
+}
+
+static void release_due(Clock::time_point now) {
+    while (!releases.empty() && releases.top().at <= now) {
+        uint32_t slot = releases.top().slot;
+        releases.pop();
+        HeldPacket& p = held[slot];
+        send_packet(*p.session, p.dir, p.data, p.len);
+        p.session->pending--;
+        free_slots.push_back(slot);
+    }
+}
+
+static void arm_timer() {
+    itimerspec spec{};
+    if (!releases.empty()) {
+        // steady_clock is CLOCK_MONOTONIC
+        auto ns = chrono::duration_cast<chrono::nanoseconds>(releases.top().at.time_since_epoch()).count();
+        spec.it_value.tv_sec = ns / 1000000000;
+        spec.it_value.tv_nsec = ns % 1000000000;
+        if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) spec.it_value.tv_nsec = 1;
+    }
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+// Reads everything waiting on a socket, RECV_BATCH datagrams per syscall
+static void drain(int sock, Session* session, Clock::time_point now) {
+    static uint8_t bufs[RECV_BATCH][MAX_MTU];
+    static iovec iovs[RECV_BATCH];
+    static sockaddr_in addrs[RECV_BATCH];
+    static mmsghdr msgs[RECV_BATCH];
+    while (true) {
+        for (int i = 0; i < RECV_BATCH; i++) {
+            iovs[i] = {bufs[i], MAX_MTU};
+            msgs[i].msg_hdr = {};
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+        int n = recvmmsg(sock, msgs, RECV_BATCH, MSG_DONTWAIT, nullptr);
+        if (n <= 0) return;
+        for (int i = 0; i < n; i++) {
+            if (session) {
+                handle_packet(*session, DOWN, bufs[i], msgs[i].msg_len, now);
+            } else if (Session* s = find_session(addrs[i], now)) {
+                handle_packet(*s, UP, bufs[i], msgs[i].msg_len, now);
+            }
+        }
+        if (n < RECV_BATCH) return;
+    }
+}
+
+static void print_stats() {
+    for (int dir = 0; dir < 2; dir++) {
+        const DirectionStats& st = stats[dir];
+        printf("%-4s %llu in, %llu out (%llu bytes), %llu lost, %llu duplicated, %llu reordered, %llu dropped at the cap, "
+               "%llu over the queue limit\n", direction_names[dir], (unsigned long long)st.received,
+               (unsigned long long)st.sent, (unsigned long long)st.bytes, (unsigned long long)st.lost,
+               (unsigned long long)st.duplicated, (unsigned long long)st.reordered, (unsigned long long)st.queue_drops,
+               (unsigned long long)st.overflows);
+    }
+    printf("     %zu clients, %zu packets held\n", sessions.size(), releases.size());
+    fflush(stdout);
+}
+
+struct ImpairmentOption {
+    const char* name;
+    double Impairment::*field;
+    double scale;  // from the command line's unit
+};
+
+const ImpairmentOption impairment_options[] = {
+    {"delay", &Impairment::delay_ms, 1.0},
+    {"jitter", &Impairment::jitter_ms, 1.0},
+    {"loss", &Impairment::loss, 0.01},
+    {"duplicate", &Impairment::duplicate, 0.01},
+    {"reorder", &Impairment::reorder, 0.01},
+    {"rate", &Impairment::rate_kbps, 1.0},
+    {"queue", &Impairment::queue_ms, 1.0},
+};
+
+// --<name> sets both directions, --up-<name> and --down-<name> one
+static bool parse_impairment(const char* arg, const char* value) {
+    if (strncmp(arg, "--", 2) != 0) return false;
+    arg += 2;
+    int first = UP, last = DOWN;
+    if (strncmp(arg, "up-", 3) == 0) { arg += 3; last = UP; }
+    else if (strncmp(arg, "down-", 5) == 0) { arg += 5; first = DOWN; }
+    for (const ImpairmentOption& opt : impairment_options) {
+        if (strcmp(arg, opt.name) != 0) continue;
+        double v = max(0.0, atof(value)) * opt.scale;
+        for (int dir = first; dir <= last; dir++) config.impair[dir].*opt.field = v;
+        return true;
+    }
+    return false;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        cerr << "Usage: " << argv[0] << " <listen_port> <server_ip> <server_port> [--seed <n>] [--queue-limit <packets>] "
+                "[--stats <s>] [--net epoll|io_uring] [--[up-|down-]<impairment> <value>]...\n"
+                "impairments: delay <ms>, jitter <ms>, loss <%>, duplicate <%>, reorder <%>, rate <kbit/s>, queue <ms>\n";
+        return 1;
+    }
+    bool use_io_uring = false;
+    for (int i = 4; i < argc; i++) {
+        if (i + 1 >= argc) {
+            cerr << "Missing value for " << argv[i] << "\n";
+            return 1;
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            config.seed = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--queue-limit") == 0) {
+            config.queue_limit = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            config.stats_interval_s = max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--net") == 0) {
+            i++;
+            if (strcmp(argv[i], "io_uring") == 0) use_io_uring = true;
+            else if (strcmp(argv[i], "epoll") != 0) { cerr << "Unknown network backend " << argv[i] << "\n"; return 1; }
+        } else if (parse_impairment(argv[i], argv[i + 1])) {
+            i++;
+        } else {
+            cerr << "Unknown option " << argv[i] << "\n";
+            return 1;
+        }
+    }
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(atoi(argv[3]));
+    if (inet_aton(argv[2], &server_addr.sin_addr) == 0) { cerr << "Bad server address " << argv[2] << "\n"; return 1; }
+    net_enable_batching(use_io_uring);
+
+    listen_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(atoi(argv[1]));
+    if (bind(listen_sock, (sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); return 1; }
+    set_buffers(listen_sock);
+
+    held.reset(new HeldPacket[config.queue_limit]);
+    for (int i = config.queue_limit - 1; i >= 0; i--) free_slots.push_back(i);
+
+    epfd = epoll_create1(0);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listen_sock, &ev);
+    ev.data.ptr = &timer_fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, timer_fd, &ev);
+
+    signal(SIGINT, [](int) { stop_requested = 1; });
+    signal(SIGTERM, [](int) { stop_requested = 1; });
+    for (int dir = 0; dir < 2; dir++) {
+        const Impairment& imp = config.impair[dir];
+        printf("%-4s delay %.1f ms, jitter %.1f ms, loss %.2f%%, duplicate %.2f%%, reorder %.2f%%, rate %s", direction_names[dir],
+               imp.delay_ms, imp.jitter_ms, imp.loss * 100.0, imp.duplicate * 100.0, imp.reorder * 100.0,
+               imp.rate_kbps > 0.0 ? "" : "unlimited");
+        if (imp.rate_kbps > 0.0) printf("%.0f kbit/s, queue %.0f ms", imp.rate_kbps, imp.queue_ms);
+        printf("\n");
+    }
+    printf("Proxying port %s to %s:%s, seed %llu\n", argv[1], argv[2], argv[3], (unsigned long long)config.seed);
+    fflush(stdout);
+
+    epoll_event events[MAX_EVENTS];
+    auto last_expiry = Clock::now();
+    auto last_stats = last_expiry;
+    while (!stop_requested) {
+        int nfds = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+        auto now = Clock::now();
+        // With --net io_uring everything sent in one pass is one submission
+        net_batch_begin();
+        for (int i = 0; i < nfds; i++) {
+            void* tag = events[i].data.ptr;
+            if (tag == &timer_fd) {
+                uint64_t expirations;
+                ssize_t r = read(timer_fd, &expirations, sizeof(expirations));
+                (void)r;
+            } else if (tag == nullptr) {
+                drain(listen_sock, nullptr, now);
+            } else {
+                Session* s = (Session*)tag;
+                drain(s->sock, s, now);
+            }
+        }
+        release_due(Clock::now());
+        net_batch_end();
+        arm_timer();
+
+        if (now - last_expiry > chrono::seconds(1)) {
+            expire_sessions(now);
+            last_expiry = now;
+        }
+        if (config.stats_interval_s > 0 && now - last_stats > chrono::seconds(config.stats_interval_s)) {
+            print_stats();
+            last_stats = now;
+        }
+    }
+    print_stats();
+    for (auto& entry : sessions) close(entry.second->sock);
+    close(timer_fd);
+    close(epfd);
+    close(listen_sock);
+    return 0;
+}
@@ -0,0 +1,111 @@
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perf_counters.h"
+
+using namespace std;
+
+bool perf_counters_on = false;
+
+static const uint64_t counter_configs[NUM_PERF_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+// The layout read() gives for a group with PERF_FORMAT_GROUP and both times
+struct GroupRead {
+    uint64_t nr;
+    uint64_t time_enabled;
+    uint64_t time_running;
+    uint64_t values[NUM_PERF_COUNTERS];
+};
+
+// One group per thread, led by the cycle counter, so every read is one
+// syscall and all the counters cover the same stretch
+struct ThreadCounters {
+    int fds[NUM_PERF_COUNTERS];
+    bool opened = false;
+    bool failed = false;
+
+    ThreadCounters() { for (int& fd : fds) fd = -1; }
+    ~ThreadCounters() { close_all(); }
+
+    void close_all() {
+        for (int& fd : fds) {
+            if (fd >= 0) close(fd);
+            fd = -1;
+        }
+    }
+
+    // Leaves errno set on failure
+    bool open_all() {
+        for (int c = 0; c < NUM_PERF_COUNTERS; c++) {
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = counter_configs[c];
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            // User space only: allowed at the default perf_event_paranoid of 2
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fds[c] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, c == 0 ? -1 : fds[0], PERF_FLAG_FD_CLOEXEC);
+            if (fds[c] < 0) {
+                int err = errno;
+                close_all();
+                errno = err;
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+static thread_local ThreadCounters thread_counters;
+
+bool perf_counters_enable() {
+    ThreadCounters& t = thread_counters;
+    if (!t.opened && !t.open_all()) return false;
+    t.opened = true;
+    perf_counters_on = true;
+    return true;
+}
+
+const char* perf_counters_error(int err) {
+    switch (err) {
+        case EACCES:
+        case EPERM:
+            return "not permitted; needs kernel.perf_event_paranoid at 2 or lower, or CAP_PERFMON";
+        case ENOENT:
+        case EOPNOTSUPP:
+        case ENODEV:
+            return "no hardware counters here (a virtual machine without a virtual PMU?)";
+        default:
+            return strerror(err);
+    }
+}
+
+const char* perf_counter_name(PerfCounter counter) {
+    static const char* const names[NUM_PERF_COUNTERS] = {"cycles", "instructions", "cache misses", "branch misses"};
+    return names[counter];
+}
+
+bool perf_read(PerfSample& out) {
+    if (!perf_counters_on) return false;
+    ThreadCounters& t = thread_counters;
+    if (!t.opened) {
+        // A thread that can't open its counters (out of fds, say) doesn't
+        // try again on every read
+        if (t.failed || !t.open_all()) {
+            t.failed = true;
+            return false;
+        }
+        t.opened = true;
+    }
+    GroupRead r;
+    if (read(t.fds[0], &r, sizeof(r)) != (ssize_t)sizeof(r) || r.nr != NUM_PERF_COUNTERS) return false;
+    double scale = r.time_running && r.time_running < r.time_enabled ? (double)r.time_enabled / r.time_running : 1.0;
+    for (int c = 0; c < NUM_PERF_COUNTERS; c++) out.values[c] = (uint64_t)(r.values[c] * scale);
+    return true;
+}
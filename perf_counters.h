@@ -0,0 +1,40 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <cstdint>
+
+// Hardware performance counters through perf_event_open. Each thread counts
+// only itself, in user space, from the first time it reads; a read gives the
+// running totals, so a count over some code is the difference of two reads.
+// Counts that the kernel multiplexed onto the PMU part of the time are scaled
+// up to the whole time.
+
+enum PerfCounter {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,  // last level cache
+    PERF_BRANCH_MISSES,
+    NUM_PERF_COUNTERS,
+};
+
+struct PerfSample {
+    uint64_t values[NUM_PERF_COUNTERS];
+};
+
+// Set by perf_counters_enable; read without synchronization, so enable
+// before starting the threads that count
+extern bool perf_counters_on;
+
+// Turns counting on if the counters open on the calling thread. Returns
+// false with errno set if the kernel won't allow them or there is no PMU.
+bool perf_counters_enable();
+// Why perf_counters_enable failed, for an errno it left
+const char* perf_counters_error(int err);
+
+const char* perf_counter_name(PerfCounter counter);
+
+// The calling thread's totals so far, opening its counters on the first
+// call. False if counting is off or the counters can't be opened here.
+bool perf_read(PerfSample& out);
+
+#endif
@@ -0,0 +1,106 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include "profile.h"
+
+using namespace std;
+
+typedef LatencyHistogram H;
+
+static int bucket_index(uint64_t ns) {
+    if (ns < (1u << H::SUB_BITS)) return (int)ns;
+    int exp = 63 - __builtin_clzll(ns);
+    int shift = exp - H::SUB_BITS;
+    int index = ((shift + 1) << H::SUB_BITS) + (int)((ns >> shift) & ((1u << H::SUB_BITS) - 1));
+    return min(index, H::NUM_BUCKETS - 1);
+}
+
+// Largest value that lands in the bucket
+static uint64_t bucket_high(int index) {
+    if (index < (1 << H::SUB_BITS)) return index;
+    int shift = (index >> H::SUB_BITS) - 1;
+    uint64_t mantissa = index & ((1u << H::SUB_BITS) - 1);
+    return (((1ull << H::SUB_BITS) + mantissa + 1) << shift) - 1;
+}
+
+void histogram_record(LatencyHistogram& h, uint64_t ns) {
+    h.counts[bucket_index(ns)]++;
+    h.total++;
+    h.max = max(h.max, ns);
+}
+
+uint64_t histogram_percentile(const LatencyHistogram& h, double p) {
+    if (h.total == 0) return 0;
+    uint64_t target = max<uint64_t>(1, (uint64_t)(p * h.total + 0.5));
+    uint64_t seen = 0;
+    for (int i = 0; i < H::NUM_BUCKETS; i++) {
+        seen += h.counts[i];
+        if (seen >= target) return min(bucket_high(i), h.max);
+    }
+    return h.max;
+}
+
+void histogram_merge(LatencyHistogram& into, const LatencyHistogram& from) {
+    for (int i = 0; i < H::NUM_BUCKETS; i++) into.counts[i] += from.counts[i];
+    into.total += from.total;
+    into.max = max(into.max, from.max);
+}
+
+void histogram_reset(LatencyHistogram& h) {
+    memset(h.counts, 0, sizeof(h.counts));
+    h.total = 0;
+    h.max = 0;
+}
+
+const char* profile_phase_name(ProfilePhase phase) {
+    static const char* const names[NUM_PHASES] = {
+        "tick", "dispatch", "timeouts", "respawn", "players", "projectiles", "hits", "reliable",
+        "snapshot", "aoi", "sounds", "broadcast",
+    };
+    return names[phase];
+}
+
+void profile_summary(TickProfile& profile, ProfilePhase first, ProfilePhase last, char* buf, size_t buf_len) {
+    size_t len = strlen(buf);
+    for (int p = first; p < last && len < buf_len; p++) {
+        LatencyHistogram& h = profile.phases[p];
+        len += snprintf(buf + len, buf_len - len, "%s%s %.0f/%.0f/%.0f", len ? ", " : "", profile_phase_name((ProfilePhase)p),
+                        histogram_percentile(h, 0.5) / 1e3, histogram_percentile(h, 0.99) / 1e3, h.max / 1e3);
+        histogram_reset(h);
+    }
+}
+
+void profile_count(TickProfile& profile, ProfilePhase phase, const PerfSample& start) {
+    PerfSample end;
+    if (!perf_read(end)) return;
+    for (int c = 0; c < NUM_PERF_COUNTERS; c++) profile.perf[phase][c] += end.values[c] - start.values[c];
+    profile.perf_scopes[phase]++;
+}
+
+// Three significant figures with a k/M/G suffix
+static void format_count(double v, char* buf, size_t len) {
+    const char* suffix = "";
+    if (v >= 1e9) { v /= 1e9; suffix = "G"; }
+    else if (v >= 1e6) { v /= 1e6; suffix = "M"; }
+    else if (v >= 1e3) { v /= 1e3; suffix = "k"; }
+    snprintf(buf, len, v >= 100 || !*suffix ? "%.0f%s" : "%.3g%s", v, suffix);
+}
+
+void perf_summary(TickProfile& profile, ProfilePhase first, ProfilePhase last, char* buf, size_t buf_len) {
+    size_t len = strlen(buf);
+    for (int p = first; p < last && len < buf_len; p++) {
+        uint64_t runs = profile.perf_scopes[p];
+        if (!runs) continue;
+        const uint64_t* totals = profile.perf[p];
+        char cycles[16], cache[16], branch[16];
+        format_count((double)totals[PERF_CYCLES] / runs, cycles, sizeof(cycles));
+        format_count((double)totals[PERF_CACHE_MISSES] / runs, cache, sizeof(cache));
+        format_count((double)totals[PERF_BRANCH_MISSES] / runs, branch, sizeof(branch));
+        double ipc = totals[PERF_CYCLES] ? (double)totals[PERF_INSTRUCTIONS] / totals[PERF_CYCLES] : 0.0;
+        len += snprintf(buf + len, buf_len - len, "%s%s %s/%.2f/%s/%s", len ? ", " : "", profile_phase_name((ProfilePhase)p),
+                        cycles, ipc, cache, branch);
+        memset(profile.perf[p], 0, sizeof(profile.perf[p]));
+        profile.perf_scopes[p] = 0;
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+#include "trace.h"
+#include "perf_counters.h"
+
+// Log-linear latency histogram in nanoseconds, in the style of HdrHistogram:
+// each power of two is split into 2^SUB_BITS buckets, so a reported
+// percentile is within 1/2^SUB_BITS of the true value. Values from
+// 2^(MAX_EXP + 1) ns (about 8.6 s) up share the last bucket; max stays exact.
+struct LatencyHistogram {
+    static const int SUB_BITS = 4;
+    static const int MAX_EXP = 32;
+    static const int NUM_BUCKETS = (MAX_EXP - SUB_BITS + 2) << SUB_BITS;
+
+    uint32_t counts[NUM_BUCKETS] = {};
+    uint64_t total = 0;
+    uint64_t max = 0;
+};
+
+void histogram_record(LatencyHistogram& h, uint64_t ns);
+// Smallest recorded value that at least fraction p of the values are not above
+uint64_t histogram_percentile(const LatencyHistogram& h, double p);
+void histogram_merge(LatencyHistogram& into, const LatencyHistogram& from);
+void histogram_reset(LatencyHistogram& h);
+
+// The timed parts of a match. The simulation's phases run on the tick, the
+// serializer's on the serializer job; each side only records and prints its own.
+enum ProfilePhase {
+    PHASE_TICK,         // the whole tick, dispatch to snapshot publish
+    PHASE_DISPATCH,     // draining the inbox
+    PHASE_TIMEOUTS,
+    PHASE_RESPAWN,
+    PHASE_PLAYERS,
+    PHASE_PROJECTILES,
+    PHASE_HITS,
+    PHASE_RELIABLE,
+    PHASE_SNAPSHOT,     // the serializer's whole run for one snapshot
+    PHASE_AOI,
+    PHASE_SOUNDS,
+    PHASE_BROADCAST,    // building and sending every client's snapshot
+    NUM_PHASES,
+};
+
+const ProfilePhase FIRST_SERIALIZER_PHASE = PHASE_SNAPSHOT;
+
+const char* profile_phase_name(ProfilePhase phase);
+
+struct TickProfile {
+    LatencyHistogram phases[NUM_PHASES];
+    uint64_t overruns = 0;  // ticks that took longer than the tick interval
+    // Hardware counter totals per phase while perf_counters_on, over
+    // perf_scopes[phase] runs of it
+    uint64_t perf[NUM_PHASES][NUM_PERF_COUNTERS] = {};
+    uint64_t perf_scopes[NUM_PHASES] = {};
+};
+
+// Appends "name p50/p99/max" in microseconds for phases [first, last) to buf
+// and resets their histograms
+void profile_summary(TickProfile& profile, ProfilePhase first, ProfilePhase last, char* buf, size_t buf_len);
+// Appends "name cycles/IPC/cache misses/branch misses", averaged per run, for
+// phases in [first, last) that have counts, and resets them
+void perf_summary(TickProfile& profile, ProfilePhase first, ProfilePhase last, char* buf, size_t buf_len);
+// Adds the counts since start to the phase
+void profile_count(TickProfile& profile, ProfilePhase phase, const PerfSample& start);
+
+// Records the time until the end of the enclosing scope, and traces it as an
+// event named after the phase when tracing is on. With hardware counters on,
+// also counts the scope's thread over it; work the phase hands to other job
+// workers isn't counted, so run with one thread to count whole phases.
+struct ProfileScope {
+    TickProfile& profile;
+    ProfilePhase phase;
+    PerfSample perf_start;
+    bool counting;
+    std::chrono::steady_clock::time_point start;
+    TraceScope trace;
+
+    ProfileScope(TickProfile& profile, ProfilePhase phase)
+        : profile(profile), phase(phase), counting(perf_counters_on && perf_read(perf_start)),
+          start(std::chrono::steady_clock::now()), trace(profile_phase_name(phase)) {}
+    ~ProfileScope() {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        histogram_record(profile.phases[phase], std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        if (counting) profile_count(profile, phase, perf_start);
+    }
+};
+
+#endif
@@ -4,17 +4,32 @@
 #include <cstdint>
 #include <glm/glm.hpp>
 
-#define MAX_PLAYERS 10
-#define MAX_PROJECTILES 100
+// Match capacity is set on the server command line and announced in JOIN_ACK
+#define DEFAULT_MAX_PLAYERS 10
+#define DEFAULT_MAX_PROJECTILES 100
+#define MAX_PLAYERS_LIMIT 1024
+#define MAX_PROJECTILES_LIMIT 65535  // ProjectileState::id is 16 bits
 #define MAP_WIDTH 40
 #define MAP_HEIGHT 10
 #define MAP_LENGTH 40
+#define MAP_VOXELS (MAP_WIDTH * MAP_HEIGHT * MAP_LENGTH)
+#define MAP_CHUNK_SIZE 1000
+#define MAP_CHUNK_COUNT ((MAP_VOXELS + MAP_CHUNK_SIZE - 1) / MAP_CHUNK_SIZE)
 
 enum VoxelType {
     AIR = 0,
     SOLID = 1
 };
 
+typedef int VoxelMap[MAP_WIDTH][MAP_HEIGHT][MAP_LENGTH];
+
+// Cost for sound to cross one voxel; walls muffle it rather than block it
+#define SOUND_AIR_COST 1
+#define SOUND_SOLID_COST 10
+// Played gain is exp(-0.1 * cost), under 1% past this. Such sounds are
+// neither sent by the server nor played by the client.
+#define SOUND_MAX_PATH_COST 46
+
 enum PacketType {
     JOIN,
     JOIN_ACK,
@@ -22,9 +37,20 @@ enum PacketType {
     STATE,
     MAP_DATA,
     SOUND_EVENT,
-    LEAVE
+    LEAVE,
+    ACK,
+    BUNDLE,
+    JOIN_DENIED,
+    NUM_PACKET_TYPES
 };
 
+inline const char* packet_type_name(int type) {
+    static const char* const names[NUM_PACKET_TYPES] = {
+        "JOIN", "JOIN_ACK", "ACT", "STATE", "MAP_DATA", "SOUND_EVENT", "LEAVE", "ACK", "BUNDLE", "JOIN_DENIED",
+    };
+    return type >= 0 && type < NUM_PACKET_TYPES ? names[type] : "unknown";
+}
+
 enum MovementDirection : uint8_t {
     FORWARD = 0,
     FORWARD_LEFT = 1,
@@ -43,6 +69,11 @@ enum SoundType {
     FOOTSTEP
 };
 
+// A BUNDLE datagram is a ProtoHeader followed by messages, each a uint16_t
+// length and then a complete packet of one of the other types.
+#define DEFAULT_MTU 1200
+#define MAX_MTU 4096
+
 #pragma pack(push, 1)
 struct Point { 
     int x, y;
@@ -53,13 +84,56 @@ struct ProtoHeader {
     uint32_t tick_id;
 };
 
+// Bit i of ack_bits set means reliable message (ack - i) was received
+struct ReliableAck {
+    uint16_t ack;
+    uint32_t ack_bits;
+};
+
+struct ReliableHeader {
+    uint16_t seq;
+    ReliableAck ack;
+};
+
+// JOIN and LEAVE
+struct ControlPacket {
+    ProtoHeader hdr;
+    ReliableHeader rel;
+};
+
 struct JoinAckPacket {
     ProtoHeader hdr;
+    ReliableHeader rel;
     uint32_t your_id;
+    uint16_t max_players;
+    uint16_t max_projectiles;
 };
 
+enum JoinDeniedReason : uint8_t {
+    SERVER_FULL = 0
+};
+
+// Unreliable answer to every JOIN the server can't take
+struct JoinDeniedPacket {
+    ProtoHeader hdr;
+    uint16_t join_seq;
+    JoinDeniedReason reason;
+};
+
+struct AckPacket {
+    ProtoHeader hdr;
+    ReliableAck ack;
+};
+
+#define ECHO_NONE UINT32_MAX
+
+// The client numbers its packets in hdr.tick_id; a gap between two ACTs is a lost packet
 struct ActionPacket {
     ProtoHeader hdr;
+    ReliableAck ack;
+    uint32_t send_time_us;   // client clock, for jitter
+    uint32_t echo_tick;      // newest snapshot tick received, ECHO_NONE before the first
+    uint32_t echo_delay_us;  // since that snapshot arrived
     glm::vec3 pos;
     glm::vec3 view_dir;
     MovementDirection movement_dir;
@@ -77,23 +151,42 @@ struct PlayerState {
 };
 
 struct ProjectileState {
+    uint16_t id;
     bool is_active;
     uint32_t owner_id;
     glm::vec3 pos;
     glm::vec3 dir;
 };
 
-struct StatePacket {
+// Tells the client to stop showing an entity: it left the client's area of
+// interest or PVS, or its player left the match. Carries no position, so
+// the client isn't told where the entity went.
+struct EntityRemoval {
+    uint32_t id;  // player_id, or projectile slot
+    uint8_t is_player;
+};
+
+// One part of a tick's snapshot, small enough for a single datagram. It is
+// followed by num_players PlayerStates, num_projectiles ProjectileStates and
+// num_removed EntityRemovals, and can be applied without the other parts of
+// the tick. A projectile sent with is_active = 0 has despawned.
+struct SnapshotPacket {
     ProtoHeader hdr;
-    uint8_t num_players;
-    PlayerState players[MAX_PLAYERS];
-    int num_projectiles;
-    ProjectileState projectiles[MAX_PROJECTILES];
+    ReliableAck ack;
+    uint16_t part_index;
+    uint16_t part_count;
+    uint16_t num_players;
+    uint16_t num_projectiles;
+    uint16_t num_removed;
 };
 
-struct MapPacket {
+// One voxel per byte, in [x][y][z] order
+struct MapChunkPacket {
     ProtoHeader hdr;
-    int map[MAP_WIDTH][MAP_HEIGHT][MAP_LENGTH];
+    ReliableHeader rel;
+    uint16_t chunk_index;
+    uint16_t chunk_count;
+    uint8_t voxels[MAP_CHUNK_SIZE];
 };
 
 struct SoundEventPacket {
@@ -0,0 +1,164 @@
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <array>
+
+#include "pvs.h"
+
+using namespace std;
+
+// Open voxels per cluster used as ray endpoints
+const int PVS_SAMPLES = 8;
+
+static int cluster_index(int cx, int cy, int cz) {
+    return (cx * PVS_CLUSTERS_Y + cy) * PVS_CLUSTERS_Z + cz;
+}
+
+int pvs_cluster(const glm::vec3& pos) {
+    int x = (int)floor(pos.x), y = (int)floor(pos.y), z = (int)floor(pos.z);
+    if (x < 0 || x >= MAP_WIDTH || y < 0 || y >= MAP_HEIGHT || z < 0 || z >= MAP_LENGTH) return -1;
+    return cluster_index(x / PVS_CLUSTER_X, y / PVS_CLUSTER_Y, z / PVS_CLUSTER_Z);
+}
+
+// Walks the voxels between two voxel centers (Amanatides-Woo) and fails on
+// the first solid one
+static bool line_of_sight(const VoxelMap& map, const int a[3], const int b[3]) {
+    int cell[3] = {a[0], a[1], a[2]};
+    int step[3];
+    float t_max[3], t_delta[3];
+    int steps = 0;
+    for (int k = 0; k < 3; k++) {
+        int d = b[k] - a[k];
+        step[k] = d > 0 ? 1 : (d < 0 ? -1 : 0);
+        t_delta[k] = d ? 1.0f / abs(d) : INFINITY;
+        t_max[k] = d ? 0.5f / abs(d) : INFINITY;
+        steps += abs(d);
+    }
+    for (; steps > 0; steps--) {
+        int k = t_max[0] < t_max[1] ? (t_max[0] < t_max[2] ? 0 : 2) : (t_max[1] < t_max[2] ? 1 : 2);
+        cell[k] += step[k];
+        t_max[k] += t_delta[k];
+        if (map[cell[0]][cell[1]][cell[2]] == SOLID) return false;
+    }
+    return true;
+}
+
+void pvs_build(Pvs& pvs, const VoxelMap& map, JobSystem* jobs) {
+    // Sample voxels, spread evenly over each cluster's open voxels
+    vector<vector<array<int, 3>>> samples(PVS_NUM_CLUSTERS);
+    for (int cx = 0; cx < PVS_CLUSTERS_X; cx++) {
+        for (int cy = 0; cy < PVS_CLUSTERS_Y; cy++) {
+            for (int cz = 0; cz < PVS_CLUSTERS_Z; cz++) {
+                vector<array<int, 3>> open;
+                for (int x = cx * PVS_CLUSTER_X; x < min((cx + 1) * PVS_CLUSTER_X, MAP_WIDTH); x++) {
+                    for (int y = cy * PVS_CLUSTER_Y; y < min((cy + 1) * PVS_CLUSTER_Y, MAP_HEIGHT); y++) {
+                        for (int z = cz * PVS_CLUSTER_Z; z < min((cz + 1) * PVS_CLUSTER_Z, MAP_LENGTH); z++) {
+                            if (map[x][y][z] != SOLID) open.push_back({x, y, z});
+                        }
+                    }
+                }
+                vector<array<int, 3>>& chosen = samples[cluster_index(cx, cy, cz)];
+                int n = min<int>(open.size(), PVS_SAMPLES);
+                for (int s = 0; s < n; s++) {
+                    chosen.push_back(open[s * open.size() / n]);
+                }
+            }
+        }
+    }
+
+    // Each row fills in the clusters after its own; mirrored below
+    vector<uint8_t> visible((size_t)PVS_NUM_CLUSTERS * PVS_ROW_BYTES, 0);
+    auto set_bit = [&](vector<uint8_t>& bits, int row, int cluster) {
+        bits[(size_t)row * PVS_ROW_BYTES + (cluster >> 3)] |= 1 << (cluster & 7);
+    };
+    auto get_bit = [&](const vector<uint8_t>& bits, int row, int cluster) {
+        return (bits[(size_t)row * PVS_ROW_BYTES + (cluster >> 3)] >> (cluster & 7)) & 1;
+    };
+    auto trace_rows = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            if (samples[i].empty()) continue;
+            set_bit(visible, i, i);
+            for (int j = i + 1; j < PVS_NUM_CLUSTERS; j++) {
+                bool seen = false;
+                for (size_t s = 0; s < samples[i].size() && !seen; s++) {
+                    for (size_t t = 0; t < samples[j].size() && !seen; t++) {
+                        seen = line_of_sight(map, samples[i][s].data(), samples[j][t].data());
+                    }
+                }
+                if (seen) set_bit(visible, i, j);
+            }
+        }
+    };
+    if (jobs) {
+        parallel_for(*jobs, PVS_NUM_CLUSTERS, 1, trace_rows);
+    } else {
+        trace_rows(0, PVS_NUM_CLUSTERS);
+    }
+    for (int i = 0; i < PVS_NUM_CLUSTERS; i++) {
+        for (int j = i + 1; j < PVS_NUM_CLUSTERS; j++) {
+            if (get_bit(visible, i, j)) set_bit(visible, j, i);
+        }
+    }
+
+    // Sampling can miss a view through a gap, and a player moves between
+    // snapshots, so every neighbour of a visible cluster counts as visible.
+    // This also covers the walls around what can be seen.
+    vector<uint8_t> grown(visible.size(), 0);
+    auto grow_rows = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            if (samples[i].empty()) continue;
+            for (int cx = 0; cx < PVS_CLUSTERS_X; cx++) {
+                for (int cy = 0; cy < PVS_CLUSTERS_Y; cy++) {
+                    for (int cz = 0; cz < PVS_CLUSTERS_Z; cz++) {
+                        if (!get_bit(visible, i, cluster_index(cx, cy, cz))) continue;
+                        for (int x = max(cx - 1, 0); x <= min(cx + 1, PVS_CLUSTERS_X - 1); x++) {
+                            for (int y = max(cy - 1, 0); y <= min(cy + 1, PVS_CLUSTERS_Y - 1); y++) {
+                                for (int z = max(cz - 1, 0); z <= min(cz + 1, PVS_CLUSTERS_Z - 1); z++) {
+                                    set_bit(grown, i, cluster_index(x, y, z));
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    };
+    if (jobs) {
+        parallel_for(*jobs, PVS_NUM_CLUSTERS, 8, grow_rows);
+    } else {
+        grow_rows(0, PVS_NUM_CLUSTERS);
+    }
+
+    pvs.row_offsets.assign(PVS_NUM_CLUSTERS, PVS_NO_ROW);
+    pvs.data.clear();
+    for (int i = 0; i < PVS_NUM_CLUSTERS; i++) {
+        if (samples[i].empty()) continue;
+        pvs.row_offsets[i] = pvs.data.size();
+        const uint8_t* row = &grown[(size_t)i * PVS_ROW_BYTES];
+        for (int b = 0; b < PVS_ROW_BYTES; b++) {
+            pvs.data.push_back(row[b]);
+            if (row[b] != 0) continue;
+            int run = 1;
+            while (b + 1 < PVS_ROW_BYTES && row[b + 1] == 0 && run < 255) {
+                b++;
+                run++;
+            }
+            pvs.data.push_back(run);
+        }
+    }
+}
+
+bool pvs_row(const Pvs& pvs, int cluster, uint8_t* out) {
+    if (cluster < 0 || pvs.row_offsets.empty() || pvs.row_offsets[cluster] == PVS_NO_ROW) return false;
+    const uint8_t* in = &pvs.data[pvs.row_offsets[cluster]];
+    for (int b = 0; b < PVS_ROW_BYTES;) {
+        if (*in != 0) {
+            out[b++] = *in++;
+        } else {
+            int run = in[1];
+            in += 2;
+            for (; run > 0; run--) out[b++] = 0;
+        }
+    }
+    return true;
+}
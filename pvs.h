@@ -0,0 +1,46 @@
+#ifndef PVS_H
+#define PVS_H
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "protocol.h"
+#include "job_system.h"
+
+// Visibility is stored between clusters of voxels rather than single voxels
+const int PVS_CLUSTER_X = 4;
+const int PVS_CLUSTER_Y = 2;
+const int PVS_CLUSTER_Z = 4;
+const int PVS_CLUSTERS_X = (MAP_WIDTH + PVS_CLUSTER_X - 1) / PVS_CLUSTER_X;
+const int PVS_CLUSTERS_Y = (MAP_HEIGHT + PVS_CLUSTER_Y - 1) / PVS_CLUSTER_Y;
+const int PVS_CLUSTERS_Z = (MAP_LENGTH + PVS_CLUSTER_Z - 1) / PVS_CLUSTER_Z;
+const int PVS_NUM_CLUSTERS = PVS_CLUSTERS_X * PVS_CLUSTERS_Y * PVS_CLUSTERS_Z;
+const int PVS_ROW_BYTES = (PVS_NUM_CLUSTERS + 7) / 8;
+const uint32_t PVS_NO_ROW = UINT32_MAX;
+
+// Potentially visible set: for every cluster with open space, a bit per
+// cluster that might be seen from somewhere in it. Rows are compressed by
+// replacing each run of zero bytes with a zero and the run length.
+struct Pvs {
+    std::vector<uint32_t> row_offsets;  // per cluster, into data; PVS_NO_ROW for solid clusters
+    std::vector<uint8_t> data;
+};
+
+// Cluster containing pos, or -1 outside the map
+int pvs_cluster(const glm::vec3& pos);
+
+// Casts rays between sampled open voxels of every pair of clusters. Rows are
+// computed in parallel when jobs is given. Deterministic for a given map, so
+// the client builds the same set from the map it receives.
+void pvs_build(Pvs& pvs, const VoxelMap& map, JobSystem* jobs);
+
+// Expands cluster's row into out (PVS_ROW_BYTES bytes). Returns false when
+// there is no row to cull with, e.g. from inside a wall or off the map.
+bool pvs_row(const Pvs& pvs, int cluster, uint8_t* out);
+
+inline bool pvs_row_test(const uint8_t* row, int cluster) {
+    return cluster < 0 || (row[cluster >> 3] >> (cluster & 7)) & 1;
+}
+
+#endif
@@ -0,0 +1,53 @@
+#include <cerrno>
+
+#include "record.h"
+
+using namespace std;
+
+// Records go out in blocks rather than a write per tick; the match flushes
+// once a second so a crash loses at most that much
+#define RECORD_BUFFER_BYTES (1 << 20)
+
+size_t record_size(uint8_t type) {
+    switch (type) {
+        case RECORD_TICK: return sizeof(TickRecord);
+        case RECORD_JOIN: return sizeof(JoinRecord);
+        case RECORD_LEAVE: return sizeof(LeaveRecord);
+        case RECORD_ACTION: return sizeof(ActionRecord);
+        case RECORD_TICK_END: return sizeof(TickEndRecord);
+        default: return 0;
+    }
+}
+
+FILE* record_open(const char* path, const RecordHeader& header) {
+    FILE* f = fopen(path, "wb");
+    if (!f) return nullptr;
+    setvbuf(f, nullptr, _IOFBF, RECORD_BUFFER_BYTES);
+    if (fwrite(&header, sizeof(header), 1, f) != 1) {
+        int err = errno;
+        fclose(f);
+        errno = err;
+        return nullptr;
+    }
+    return f;
+}
+
+FILE* record_open_read(const char* path, RecordHeader& header) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return nullptr;
+    setvbuf(f, nullptr, _IOFBF, RECORD_BUFFER_BYTES);
+    if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != RECORD_MAGIC || header.version != RECORD_VERSION) {
+        fclose(f);
+        errno = EPROTO;
+        return nullptr;
+    }
+    return f;
+}
+
+bool record_read(FILE* f, uint8_t* type, void* buf) {
+    int c = fgetc(f);
+    if (c == EOF) return false;
+    *type = (uint8_t)c;
+    size_t size = record_size(*type);
+    return size > 0 && fread(buf, size, 1, f) == 1;
+}
@@ -0,0 +1,87 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <cstdint>
+#include <cstdio>
+
+// Input recording: everything a match's simulation takes from outside, so
+// replay can run it again without clients. A file is a RecordHeader and
+// then records, each a RecordType byte followed by that type's struct.
+// A tick's records are, in order: its RECORD_TICK, the joins, leaves
+// (including timeouts) and actions applied during it, and its
+// RECORD_TICK_END with the world hash the simulation reached.
+
+#define RECORD_MAGIC 0x52535046  // "FPSR"
+#define RECORD_VERSION 1
+
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t seed;  // map seed; also the simulation RNG's starting state
+    uint32_t match_id;
+    uint32_t max_players;
+    uint32_t max_projectiles;
+    uint32_t tick_interval_ms;
+    uint8_t deterministic;
+    uint8_t reserved[7];
+};
+
+enum RecordType : uint8_t {
+    RECORD_TICK = 1,
+    RECORD_JOIN,
+    RECORD_LEAVE,
+    RECORD_ACTION,
+    RECORD_TICK_END,
+};
+
+#define ACTION_JUMPING 0x01
+#define ACTION_FIRING 0x02
+
+#pragma pack(push, 1)
+struct TickRecord {
+    uint32_t tick;
+    int64_t time_ns;  // the simulation clock, from when recording started
+};
+
+struct JoinRecord {
+    uint32_t player_id;  // checked on replay: slots must be given out the same way
+    uint64_t client_key;
+};
+
+struct LeaveRecord {
+    uint32_t player_id;
+};
+
+struct ActionRecord {
+    uint32_t player_id;
+    uint8_t movement_dir;
+    uint8_t flags;  // ACTION_*
+    float view_dir[3];
+};
+
+struct TickEndRecord {
+    float dt;
+    uint64_t hash;  // Match::hash_world_state() after the tick
+};
+#pragma pack(pop)
+
+// Size of the struct that follows a type byte, or 0 for an unknown type
+size_t record_size(uint8_t type);
+
+// Creates the file and writes the header; null with errno set on failure
+FILE* record_open(const char* path, const RecordHeader& header);
+
+template <typename T>
+void record_write(FILE* f, RecordType type, const T& record) {
+    fputc(type, f);
+    fwrite(&record, sizeof(record), 1, f);
+}
+
+// Opens a recording for reading and checks its header. Null with errno set
+// on failure; EPROTO for a file that isn't a recording of this version.
+FILE* record_open_read(const char* path, RecordHeader& header);
+// Reads the next record into buf, which must hold the largest record.
+// Returns false at the end of the file or on a truncated or unknown record.
+bool record_read(FILE* f, uint8_t* type, void* buf);
+
+#endif
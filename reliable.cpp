@@ -0,0 +1,124 @@
+#include <cmath>
+#include <algorithm>
+
+#include "reliable.h"
+
+using namespace std;
+
+static ReliableHeader* reliable_header(uint8_t* pkt) {
+    return (ReliableHeader*)(pkt + sizeof(ProtoHeader));
+}
+
+bool reliable_send(ReliableEndpoint& ep, const void* pkt, size_t len) {
+    if (len < sizeof(ProtoHeader) + sizeof(ReliableHeader) || len > RELIABLE_MAX_PACKET) return false;
+
+    ReliableSlot& slot = ep.send_slots[ep.next_send_seq % RELIABLE_WINDOW];
+    if (slot.in_use) return false;
+
+    slot.in_use = true;
+    slot.seq = ep.next_send_seq++;
+    slot.retries = 0;
+    slot.last_sent = ReliableClock::time_point::min();
+    slot.data.assign((const uint8_t*)pkt, (const uint8_t*)pkt + len);
+    reliable_header(slot.data.data())->seq = slot.seq;
+    ep.num_unacked++;
+    return true;
+}
+
+void reliable_update(ReliableEndpoint& ep, ReliableClock::time_point now, PacketBundler& out) {
+    if (ep.num_unacked == 0) return;
+
+    for (uint16_t i = 0; i < RELIABLE_WINDOW; i++) {
+        ReliableSlot& slot = ep.send_slots[(uint16_t)(ep.next_send_seq + i) % RELIABLE_WINDOW];
+        if (!slot.in_use) continue;
+
+        bool first_send = slot.last_sent == ReliableClock::time_point::min();
+        if (!first_send) {
+            // Exponential backoff per message on top of the smoothed RTO
+            float timeout_ms = min(ep.rto_ms * (float)(1 << min<int>(slot.retries, 4)), RELIABLE_MAX_RTO_MS);
+            float since_ms = chrono::duration<float, milli>(now - slot.last_sent).count();
+            if (since_ms < timeout_ms) continue;
+            if (slot.retries < 255) slot.retries++;
+        }
+
+        reliable_write_ack(ep, reliable_header(slot.data.data())->ack);
+        slot.last_sent = now;
+        bundle_add(out, slot.data.data(), slot.data.size());
+    }
+}
+
+static void update_rtt(ReliableEndpoint& ep, float sample_ms) {
+    if (!ep.have_rtt) {
+        ep.srtt_ms = sample_ms;
+        ep.rttvar_ms = sample_ms / 2.0f;
+        ep.have_rtt = true;
+    } else {
+        ep.rttvar_ms = 0.75f * ep.rttvar_ms + 0.25f * fabs(ep.srtt_ms - sample_ms);
+        ep.srtt_ms = 0.875f * ep.srtt_ms + 0.125f * sample_ms;
+    }
+    ep.rto_ms = clamp(ep.srtt_ms + 4.0f * ep.rttvar_ms, RELIABLE_MIN_RTO_MS, RELIABLE_MAX_RTO_MS);
+}
+
+void reliable_process_ack(ReliableEndpoint& ep, const ReliableAck& ack, ReliableClock::time_point now) {
+    if (ep.num_unacked == 0 || ack.ack_bits == 0) return;
+
+    for (int i = 0; i < 32; i++) {
+        if (!(ack.ack_bits & (1u << i))) continue;
+        uint16_t seq = ack.ack - i;
+        ReliableSlot& slot = ep.send_slots[seq % RELIABLE_WINDOW];
+        if (!slot.in_use || slot.seq != seq) continue;
+
+        // Karn's rule: a retransmitted message gives an ambiguous sample
+        if (slot.retries == 0 && slot.last_sent != ReliableClock::time_point::min()) {
+            update_rtt(ep, chrono::duration<float, milli>(now - slot.last_sent).count());
+        }
+        slot.in_use = false;
+        slot.data = vector<uint8_t>();
+        ep.num_unacked--;
+    }
+}
+
+void reliable_write_ack(ReliableEndpoint& ep, ReliableAck& ack) {
+    ack.ack = ep.recv_ack;
+    ack.ack_bits = ep.recv_any ? ep.recv_ack_bits : 0;
+    ep.ack_pending = false;
+}
+
+bool reliable_receive(ReliableEndpoint& ep, const void* pkt, size_t len) {
+    if (len < sizeof(ProtoHeader) + sizeof(ReliableHeader) || len > RELIABLE_MAX_PACKET) return false;
+    uint16_t seq = reliable_header((uint8_t*)pkt)->seq;
+
+    ep.ack_pending = true;
+    if (!ep.recv_any) {
+        ep.recv_any = true;
+        ep.recv_ack = seq;
+        ep.recv_ack_bits = 1;
+    } else if (seq_newer(seq, ep.recv_ack)) {
+        uint16_t shift = seq - ep.recv_ack;
+        ep.recv_ack_bits = shift < 32 ? (ep.recv_ack_bits << shift) | 1 : 1;
+        ep.recv_ack = seq;
+    } else {
+        uint16_t diff = ep.recv_ack - seq;
+        if (diff < 32) ep.recv_ack_bits |= 1u << diff;
+    }
+
+    uint16_t ahead = seq - ep.next_deliver_seq;
+    if (ahead >= RELIABLE_WINDOW) return false;
+
+    ReliableSlot& slot = ep.recv_slots[seq % RELIABLE_WINDOW];
+    if (slot.in_use) return false;
+    slot.in_use = true;
+    slot.seq = seq;
+    slot.data.assign((const uint8_t*)pkt, (const uint8_t*)pkt + len);
+    return true;
+}
+
+const uint8_t* reliable_next_message(ReliableEndpoint& ep, size_t* len) {
+    ReliableSlot& slot = ep.recv_slots[ep.next_deliver_seq % RELIABLE_WINDOW];
+    if (!slot.in_use || slot.seq != ep.next_deliver_seq) return nullptr;
+
+    slot.in_use = false;
+    ep.next_deliver_seq++;
+    *len = slot.data.size();
+    return slot.data.data();
+}
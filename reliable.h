@@ -0,0 +1,85 @@
+#ifndef RELIABLE_H
+#define RELIABLE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <vector>
+#include <netinet/in.h>
+
+#include "protocol.h"
+#include "bundle.h"
+
+// Reliable, ordered delivery for control messages (JOIN, JOIN_ACK, MAP_DATA,
+// LEAVE) on top of the game's UDP socket. Each reliable packet starts with a
+// ProtoHeader followed by a ReliableHeader. Acks ride on every reliable packet
+// and on the regular ACT/STATE traffic; unreliable packets are untouched.
+//
+// A slot's bytes are sized to its message and a sent message's are freed
+// once acked, so an endpoint holds memory only for what is in flight.
+
+#define RELIABLE_WINDOW 32
+#define RELIABLE_MAX_PACKET 1100
+#define RELIABLE_INITIAL_RTO_MS 250.0f
+#define RELIABLE_MIN_RTO_MS 50.0f
+#define RELIABLE_MAX_RTO_MS 2000.0f
+
+using ReliableClock = std::chrono::steady_clock;
+
+struct ReliableSlot {
+    bool in_use = false;
+    uint16_t seq = 0;
+    uint8_t retries = 0;
+    ReliableClock::time_point last_sent;
+    std::vector<uint8_t> data;
+};
+
+struct ReliableEndpoint {
+    // Outgoing messages waiting for an ack, indexed by seq % RELIABLE_WINDOW
+    ReliableSlot send_slots[RELIABLE_WINDOW];
+    uint16_t next_send_seq = 0;
+    uint16_t num_unacked = 0;
+
+    // Incoming messages that arrived ahead of next_deliver_seq
+    ReliableSlot recv_slots[RELIABLE_WINDOW];
+    uint16_t next_deliver_seq = 0;
+
+    // What we tell the peer we've received
+    bool recv_any = false;
+    bool ack_pending = false;
+    uint16_t recv_ack = 0;
+    uint32_t recv_ack_bits = 0;
+
+    // RFC 6298 retransmission timer
+    bool have_rtt = false;
+    float srtt_ms = 0.0f;
+    float rttvar_ms = 0.0f;
+    float rto_ms = RELIABLE_INITIAL_RTO_MS;
+};
+
+inline bool seq_newer(uint16_t a, uint16_t b) {
+    return (int16_t)(a - b) > 0;
+}
+
+// Queues a packet (ProtoHeader + ReliableHeader + body) for reliable delivery.
+// Returns false if the send window is full or the packet is too large.
+bool reliable_send(ReliableEndpoint& ep, const void* pkt, size_t len);
+
+// Adds queued messages and those whose retransmission timer ran out to the bundle.
+void reliable_update(ReliableEndpoint& ep, ReliableClock::time_point now, PacketBundler& out);
+
+// Frees every message the peer acknowledged and feeds the RTT estimate.
+void reliable_process_ack(ReliableEndpoint& ep, const ReliableAck& ack, ReliableClock::time_point now);
+
+// Fills in our receive state for piggybacking on an outgoing packet.
+void reliable_write_ack(ReliableEndpoint& ep, ReliableAck& ack);
+
+// Records an incoming reliable packet. Returns false for duplicates and
+// packets outside the receive window; they are still acknowledged.
+bool reliable_receive(ReliableEndpoint& ep, const void* pkt, size_t len);
+
+// Next in-order message, or nullptr. The data stays valid until the next call
+// to reliable_receive.
+const uint8_t* reliable_next_message(ReliableEndpoint& ep, size_t* len);
+
+#endif
@@ -0,0 +1,186 @@
+// Re-runs a match from an input recording (server --record) with no clients
+// or sockets, as fast as it goes, and checks every tick's world hash against
+// the one recorded. Doubles as a benchmark with a fixed workload: prints the
+// tick rate reached and the simulation phases' timings, and with
+// --perf-counters their hardware counts.
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+#include "protocol.h"
+#include "match.h"
+#include "job_system.h"
+#include "log.h"
+#include "record.h"
+#include "perf_counters.h"
+
+using namespace std;
+
+JobSystem jobs;
+
+union AnyRecord {
+    TickRecord tick;
+    JoinRecord join;
+    LeaveRecord leave;
+    ActionRecord action;
+    TickEndRecord tick_end;
+};
+
+// The address a connection table key was made from
+static sockaddr_in key_addr(uint64_t key) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = (uint32_t)(key >> 16);
+    addr.sin_port = (uint16_t)key;
+    return addr;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) { cerr << "Usage: " << argv[0] << " <recording> [--threads <n>] [--continue] [--perf-counters] [--log-level debug|info|warning|error]\n"; return 1; }
+    int num_threads = max(1u, thread::hardware_concurrency());
+    bool keep_going = false;
+    bool use_perf_counters = false;
+    log_min_level = LOG_WARNING;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            num_threads = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--continue") == 0) {
+            keep_going = true;
+        } else if (strcmp(argv[i], "--perf-counters") == 0) {
+            use_perf_counters = true;
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            LogLevel level;
+            if (!log_parse_level(argv[++i], &level)) { cerr << "Unknown log level " << argv[i] << "\n"; return 1; }
+            log_min_level = level;
+        } else {
+            cerr << "Unknown option " << argv[i] << "\n";
+            return 1;
+        }
+    }
+    RecordHeader header;
+    FILE* f = record_open_read(argv[1], header);
+    if (!f) {
+        if (errno == EPROTO) cerr << argv[1] << ": not an input recording of this version\n";
+        else cerr << argv[1] << ": " << strerror(errno) << "\n";
+        return 1;
+    }
+    if (header.tick_interval_ms != TICK_INTERVAL_MS) {
+        cerr << argv[1] << ": recorded at a " << header.tick_interval_ms << " ms tick, this build ticks every " << TICK_INTERVAL_MS << " ms\n";
+        return 1;
+    }
+    match_config.max_players = header.max_players;
+    match_config.max_projectiles = header.max_projectiles;
+    match_config.deterministic_mode = header.deterministic;
+    log_start();
+    if (use_perf_counters && !perf_counters_enable()) {
+        cerr << "hardware counters: " << perf_counters_error(errno) << "; timing phases only\n";
+    }
+    job_system_start(jobs, num_threads);
+    match_config.jobs = &jobs;
+    auto match = make_unique<Match>();
+    Match& m = *match;
+    m.start(header.match_id, header.seed, nullptr, nullptr);
+    printf("Replaying match %u, map seed %llu, %u players, %u projectiles%s, %d threads\n", header.match_id,
+           (unsigned long long)header.seed, header.max_players, header.max_projectiles,
+           header.deterministic ? ", deterministic mode" : "", num_threads);
+    fflush(stdout);
+
+    uint64_t ticks = 0, joins = 0, leaves = 0, actions = 0, mismatches = 0;
+    vector<uint32_t> respawn_ids;
+    Clock::time_point tick_start;
+    bool in_tick = false;
+    AnyRecord rec;
+    uint8_t type;
+    // Stops at the first record the simulation can't take, as the runs have
+    // diverged from there on
+    const char* error = nullptr;
+    auto start = Clock::now();
+    while (!error && record_read(f, &type, &rec)) {
+        if (type == RECORD_TICK) {
+            if (rec.tick.tick != m.current_tick) {
+                error = "tick out of sequence";
+                break;
+            }
+            tick_start = Clock::now();
+            in_tick = true;
+            m.tick_time = m.record_epoch + chrono::nanoseconds(rec.tick.time_ns);
+        } else if (type == RECORD_JOIN) {
+            if (m.clients.full() || m.add_player(key_addr(rec.join.client_key), rec.join.client_key) != rec.join.player_id) {
+                error = "join got a different player id";
+                break;
+            }
+            joins++;
+        } else if (type == RECORD_LEAVE) {
+            if (!m.clients.get(rec.leave.player_id)) {
+                error = "leave of a player who isn't there";
+                break;
+            }
+            m.remove_client(rec.leave.player_id);
+            m.departed.clear();
+            leaves++;
+        } else if (type == RECORD_ACTION) {
+            ClientInfo* client = m.clients.get(rec.action.player_id);
+            if (!client) {
+                error = "action of a player who isn't there";
+                break;
+            }
+            ActionPacket pkt{};
+            pkt.movement_dir = (MovementDirection)rec.action.movement_dir;
+            pkt.view_dir = glm::vec3(rec.action.view_dir[0], rec.action.view_dir[1], rec.action.view_dir[2]);
+            pkt.is_jumping = (rec.action.flags & ACTION_JUMPING) != 0;
+            pkt.is_firing = (rec.action.flags & ACTION_FIRING) != 0;
+            m.apply_action(*client, rec.action.player_id, pkt);
+            actions++;
+        } else if (type == RECORD_TICK_END) {
+            respawn_ids.clear();
+            m.find_respawns(respawn_ids);
+            m.simulate(rec.tick_end.dt, respawn_ids);
+            uint64_t hash = m.hash_world_state();
+            if (hash != rec.tick_end.hash) {
+                if (!mismatches) {
+                    printf("tick %u: world hash %016llx, recorded %016llx\n", m.current_tick, (unsigned long long)hash,
+                           (unsigned long long)rec.tick_end.hash);
+                }
+                mismatches++;
+                if (!keep_going) {
+                    error = "world state diverged";
+                    break;
+                }
+            }
+            m.current_tick++;
+            ticks++;
+            in_tick = false;
+            histogram_record(m.profile.phases[PHASE_TICK], chrono::duration_cast<chrono::nanoseconds>(Clock::now() - tick_start).count());
+        }
+    }
+    double seconds = chrono::duration<double>(Clock::now() - start).count();
+    bool unreadable = !error && !feof(f);
+    fclose(f);
+
+    char phases[512] = "";
+    profile_summary(m.profile, PHASE_TICK, PHASE_DISPATCH, phases, sizeof(phases));
+    profile_summary(m.profile, PHASE_RESPAWN, PHASE_RELIABLE, phases, sizeof(phases));
+    char counters[512] = "";
+    perf_summary(m.profile, PHASE_RESPAWN, PHASE_RELIABLE, counters, sizeof(counters));
+    printf("%llu ticks, %llu joins, %llu leaves, %llu actions in %.2f s: %.0f ticks/s, %.1fx real time\n",
+           (unsigned long long)ticks, (unsigned long long)joins, (unsigned long long)leaves, (unsigned long long)actions,
+           seconds, ticks / seconds, ticks * TICK_INTERVAL_MS / 1000.0 / seconds);
+    printf("us p50/p99/max: %s\n", phases);
+    if (counters[0]) printf("per tick cycles/IPC/cache misses/branch misses: %s\n", counters);
+    if (error) printf("stopped at tick %u: %s\n", m.current_tick, error);
+    if (unreadable) printf("stopped at tick %u: unknown record type %u\n", m.current_tick, type);
+    else if (in_tick && !error) printf("the recording ends partway through tick %u, which was not replayed\n", m.current_tick);
+    if (mismatches) printf("%llu ticks did not match the recording\n", (unsigned long long)mismatches);
+    else if (!error && !unreadable) printf("every tick matched the recording\n");
+
+    job_system_stop(jobs);
+    log_stop();
+    return error || unreadable || mismatches ? 1 : 0;
+}
@@ -2,516 +2,322 @@
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
+#include <cstddef>
+#include <cerrno>
+#include <csignal>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/epoll.h>
 #include <unordered_map>
 #include <vector>
 #include <string>
-#include <sstream>
+#include <memory>
+#include <thread>
 #include <chrono>
-#include <cmath>
-#include <glm/glm.hpp>
+#include <algorithm>
 
 #include "protocol.h"
+#include "bundle.h"
+#include "match.h"
+#include "job_system.h"
+#include "net.h"
+#include "trace.h"
+#include "log.h"
+#include "metrics.h"
+#include "record.h"
+#include "perf_counters.h"
 
 using namespace std;
-using Clock = chrono::steady_clock;
 
-#define MAX_EVENTS 100
-#define BUFLEN 1024
+#define MAX_WAIT_MS 5
 
-struct ClientInfo {
-    sockaddr_in addr;
-    PlayerState state;
-    Clock::time_point last_fire_time;
-    Clock::time_point respawn_time;
-    Clock::time_point last_packet_time;
-    string client_key;
-    glm::vec3 pos_at_last_step;
-    float velocityY = 0.0f;
-};
+uint64_t base_seed = 0;
+const char* hash_log_path = nullptr;
+const char* record_path = nullptr;
+size_t max_matches = 256;
 
-unordered_map<uint32_t, ClientInfo> clients;
-unordered_map<string, uint32_t> addr_to_id;
-int game_map[MAP_WIDTH][MAP_HEIGHT][MAP_LENGTH];
-ProjectileState projectiles[MAX_PROJECTILES];
+volatile sig_atomic_t stop_requested = 0;
 
-uint32_t next_player_id = 1;
-uint32_t current_tick = 0;
+// The network thread's part of the metrics segment
+MetricsServer server_metrics{};
+Clock::time_point server_start;
 
-const float PLAYER_HEIGHT = 0.9f;
-const float PLAYER_SPEED = 3.5f;
-const float PROJECTILE_SPEED = 100.0f;
-const float PLAYER_RADIUS = 0.3f;
-const float PROJECTILE_RADIUS = 0.05f;
-const int FIRE_COOLDOWN_MS = 200;
-const int CLIENT_TIMEOUT_S = 15;
-const float STEP_DISTANCE = 2.0f;
-const float GRAVITY = -9.8f;
-const float JUMP_POWER = 5.0f;
-const float MAX_STEP_HEIGHT = 1.1f;
+vector<unique_ptr<Match>> matches;
+// Which match each client address belongs to
+unordered_map<uint64_t, Match*> connections;
+JobSystem jobs;
 
-struct Point3D { 
-    int x, y, z; 
-};
-
-struct Room {
-    int x, y, z, width, height, length;
-    bool intersects(const Room& other) const { 
-        return (x < other.x + other.width && x + width > other.x 
-            && z < other.z + other.length && z + length > other.z); 
-    }
-    Point3D center() const { return {x + width / 2, y, z + length / 2}; }
-};
-
-std::vector<glm::vec3> spawn_points;
-
-void create_room_3d(int x, int y, int z, int width, int height, int length) {
-    for (int i = x; i < x + width; i++) {
-        for (int j = y; j < y + height; j++) {
-            for (int k = z; k < z + length; k++) {
-                if (i > 0 && i < MAP_WIDTH - 1 && j > 0 && j < MAP_HEIGHT - 1 && k > 0 && k < MAP_LENGTH - 1) {
-                    if (game_map[i][j][k] == SOLID) {
-                        game_map[i][j][k] = AIR;
-                        if (j == y) {
-                            spawn_points.push_back({(float)i + 0.5f, (float)j + 0.5f, (float)k + 0.5f});
-                        }
-                    }
-                }
-            }
-        }
-    }
+FILE* open_hash_log(uint32_t match_id) {
+    if (!hash_log_path) return nullptr;
+    string path = hash_log_path;
+    if (match_id > 0) path += "." + to_string(match_id);
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) log_error("hash log {}: {}", path, strerror(errno));
+    return f;
 }
 
-void create_ramp(Point3D start, Point3D end, int width) {
-    glm::vec3 p1 = {(float)start.x, (float)start.y, (float)start.z};
-    glm::vec3 p2 = {(float)end.x, (float)end.y, (float)end.z};
-    float dist = glm::distance(p1, p2);
-    if (dist == 0.0f) return;
-    glm::vec3 dir = glm::normalize(p2 - p1);
-
-    for (float i = 0; i < dist; i += 0.5f) {
-        glm::vec3 current_pos = p1 + dir * i;
-        int map_x = (int)current_pos.x;
-        int map_y = (int)current_pos.y;
-        int map_z = (int)current_pos.z;
-
-        for (int w = -width / 2; w <= width / 2; ++w) {
-            for (int fill_y = 0; fill_y <= map_y; ++fill_y) {
-                if (map_x >= 0 && map_x < MAP_WIDTH && fill_y >= 0 && fill_y < MAP_HEIGHT && (map_z + w) >= 0 && (map_z + w) < MAP_LENGTH) {
-                    game_map[map_x][fill_y][map_z + w] = SOLID;
-                }
-            }
-            if (map_x >= 0 && map_x < MAP_WIDTH && (map_y + 1) < MAP_HEIGHT && (map_z + w) >= 0 && (map_z + w) < MAP_LENGTH) {
-                game_map[map_x][map_y + 1][map_z + w] = AIR;
-                game_map[map_x][map_y + 2][map_z + w] = AIR;
-            }
-        }
-    }
+FILE* open_record(uint32_t match_id, uint64_t seed) {
+    if (!record_path) return nullptr;
+    string path = record_path;
+    if (match_id > 0) path += "." + to_string(match_id);
+    RecordHeader header{};
+    header.magic = RECORD_MAGIC;
+    header.version = RECORD_VERSION;
+    header.seed = seed;
+    header.match_id = match_id;
+    header.max_players = match_config.max_players;
+    header.max_projectiles = match_config.max_projectiles;
+    header.tick_interval_ms = TICK_INTERVAL_MS;
+    header.deterministic = match_config.deterministic_mode;
+    FILE* f = record_open(path.c_str(), header);
+    if (!f) log_error("input recording {}: {}", path, strerror(errno));
+    return f;
 }
 
-void create_h_tunnel_3d(int x1, int x2, int y, int z) {
-    for (int x = std::min(x1, x2); x <= std::max(x1, x2); x++) {
-        game_map[x][y][z] = AIR;
-        game_map[x][y+1][z] = AIR;
-        game_map[x][y-1][z] = SOLID;
+// First match with a free player slot, or a new one when all are full
+Match* matchmake() {
+    for (auto& m : matches) {
+        if (m->num_routed < match_config.max_players) return m.get();
     }
+    if (matches.size() >= max_matches) return nullptr;
+    uint32_t match_id = (uint32_t)matches.size();
+    matches.push_back(make_unique<Match>());
+    uint64_t seed = base_seed + match_id;
+    matches.back()->start(match_id, seed, open_hash_log(match_id), open_record(match_id, seed));
+    return matches.back().get();
 }
 
-void create_v_tunnel_3d(int z1, int z2, int y, int x) {
-    for (int z = std::min(z1, z2); z <= std::max(z1, z2); z++) {
-        game_map[x][y][z] = AIR;
-        game_map[x][y+1][z] = AIR;
-        game_map[x][y-1][z] = SOLID;
+// Finds the first message of the given type in a datagram, bundled or not
+const uint8_t* find_message(const uint8_t* buf, size_t len, uint8_t type, size_t* msg_len) {
+    if (((const ProtoHeader*)buf)->type != BUNDLE) {
+        *msg_len = len;
+        return ((const ProtoHeader*)buf)->type == type ? buf : nullptr;
     }
-}
-
-std::vector<Room> generate_level(int y_level, long unsigned int min_rooms, int room_height) {
-    std::vector<Room> rooms;
-    int max_attempts = 100;
-    int attempts = 0;
-
-    while (rooms.size() < min_rooms && attempts < max_attempts) {
-        attempts++;
-        int w = 6 + rand() % 7;
-        int l = 6 + rand() % 7;
-        int x = rand() % (MAP_WIDTH - w - 1) + 1;
-        int z = rand() % (MAP_LENGTH - l - 1) + 1;
-
-        Room new_room = {x, y_level, z, w, room_height, l};
-
-        bool failed = false;
-        for (const auto& other_room : rooms) {
-            if (new_room.intersects(other_room)) {
-                failed = true;
-                break;
-            }
-        }
-
-        if (!failed) {
-            create_room_3d(new_room.x, new_room.y, new_room.z, new_room.width, new_room.height, new_room.length);
-            rooms.push_back(new_room);
-        }
+    size_t offset = 0;
+    const uint8_t* msg;
+    while (bundle_next(buf, len, &offset, &msg, msg_len)) {
+        if (((const ProtoHeader*)msg)->type == type) return msg;
     }
-    return rooms;
+    return nullptr;
 }
 
-void generate_map() {
-    spawn_points.clear();
-    for (int x = 0; x < MAP_WIDTH; x++) {
-        for (int y = 0; y < MAP_HEIGHT; y++) {
-            for (int z = 0; z < MAP_LENGTH; z++) {
-                game_map[x][y][z] = SOLID;
-            }
-        }
-    }
-
-    auto level1_rooms = generate_level(1, 5, 4);
-    auto level2_rooms = generate_level(6, 5, 4);
-
-    for (size_t i = 0; i < level1_rooms.size() - 1; i++) {
-        Point3D center1 = level1_rooms[i].center();
-        Point3D center2 = level1_rooms[i+1].center();
-        create_h_tunnel_3d(center1.x, center2.x, 1, center2.z);
-        create_v_tunnel_3d(center1.z, center2.z, 1, center1.x);
-    }
-     for (size_t i = 0; i < level2_rooms.size() - 1; i++) {
-        Point3D center1 = level2_rooms[i].center();
-        Point3D center2 = level2_rooms[i+1].center();
-        create_h_tunnel_3d(center1.x, center2.x, 6, center2.z);
-        create_v_tunnel_3d(center1.z, center2.z, 6, center1.x);
-    }
-
-    if (level1_rooms.empty() || level2_rooms.empty()) {
-        cout << "Map could be unconnected" << endl;
+// Routes a datagram to its connection's match. Unknown addresses only get
+// somewhere by sending a JOIN.
+void route_datagram(const uint8_t* buf, size_t len, const sockaddr_in& client_addr, Clock::time_point received) {
+    uint64_t key = addr_key(client_addr);
+    auto it = connections.find(key);
+    if (it != connections.end()) {
+        it->second->enqueue(client_addr, buf, len, received);
         return;
     }
-
-    Point3D ramp1_start = level1_rooms[rand() % level1_rooms.size()].center();
-    Point3D ramp1_end = level2_rooms[rand() % level2_rooms.size()].center();
-    create_ramp(ramp1_start, ramp1_end, 3);
-
-    Point3D ramp2_start = level1_rooms[rand() % level1_rooms.size()].center();
-    Point3D ramp2_end = level2_rooms[rand() % level2_rooms.size()].center();
-    create_ramp(ramp2_start, ramp2_end, 3);
-}
-
-void spawn_projectile(uint32_t owner_id, const glm::vec3& pos, const glm::vec3& dir) {
-    for (int i = 0; i < MAX_PROJECTILES; ++i) {
-        if (!projectiles[i].is_active) {
-            projectiles[i].is_active = true;
-            projectiles[i].owner_id = owner_id;
-            projectiles[i].pos = pos;
-            projectiles[i].dir = dir;
-            return;
+    size_t msg_len;
+    if (const uint8_t* msg = find_message(buf, len, LEAVE, &msg_len)) {
+        if (msg_len >= sizeof(ControlPacket)) {
+            send_stateless_leave_ack(client_addr, ((const ControlPacket*)msg)->rel.seq);
         }
+        return;
     }
-}
-
-bool check_line_sphere_collision(const glm::vec3& line_start, const glm::vec3& line_end, 
-    const glm::vec3& sphere_center, float sphere_radius) {
-
-    glm::vec3 line_dir = line_end - line_start;
-    glm::vec3 to_sphere = sphere_center - line_start;
-
-    float line_len_sq = glm::dot(line_dir, line_dir);
-    if (line_len_sq == 0.0f) {
-        return glm::length(to_sphere) < sphere_radius;
-    }
-
-    float t = glm::dot(to_sphere, line_dir) / line_len_sq;
-    t = glm::clamp(t, 0.0f, 1.0f);
-    glm::vec3 closest_point = line_start + t * line_dir;
-
-    return glm::distance(closest_point, sphere_center) < sphere_radius;
-}
-
-int get_floor_height(int x, int z, int start_y) {
-    if (x < 0 || x >= MAP_WIDTH || z < 0 || z >= MAP_LENGTH) return -1;
-    for (int y = std::min(start_y, MAP_HEIGHT - 1); y >= 0; --y) {
-        if (game_map[x][y][z] == SOLID) {
-            return y;
-        }
+    const uint8_t* join = find_message(buf, len, JOIN, &msg_len);
+    if (!join || msg_len < sizeof(ControlPacket)) return;
+    Match* m = matchmake();
+    if (!m) {
+        server_metrics.joins_denied++;
+        send_join_denied(client_addr, ((const ControlPacket*)join)->rel.seq, SERVER_FULL);
+        return;
     }
-    return -1;
+    connections[key] = m;
+    m->num_routed++;
+    m->enqueue(client_addr, buf, len, received);
 }
 
-void update_players(float dt, int udp_socket) {
-    for (auto& [id, client] : clients) {
-        if (!client.state.is_alive) continue;
-
-        glm::vec3 initial_pos = client.state.pos;
-
-        glm::vec2 move_input(0.0f, 0.0f);
-        glm::vec2 view_dir_flat(client.state.view_dir.x, client.state.view_dir.z);
-        if (glm::length(view_dir_flat) > 0.0f) {
-            view_dir_flat = glm::normalize(view_dir_flat);
-        }
-        glm::vec2 right_dir(-view_dir_flat.y, view_dir_flat.x);
-
-        switch (client.state.movement_dir) {
-            case FORWARD:       move_input += view_dir_flat; break;
-            case BACKWARDS:     move_input -= view_dir_flat; break;
-            case LEFT:          move_input -= right_dir; break;
-            case RIGHT:         move_input += right_dir; break;
-            case FORWARD_LEFT:  move_input += view_dir_flat - right_dir; break;
-            case FORWARD_RIGHT: move_input += view_dir_flat + right_dir; break;
-            case BACKWARDS_LEFT:move_input -= view_dir_flat + right_dir; break;
-            case BACKWARDS_RIGHT:move_input -= view_dir_flat - right_dir; break;
-            default: break;
+// Starts a tick for every match that is due and not already running. A
+// match's departed list is only read here, after its last tick finished.
+// Returns how long the network thread may wait before calling again.
+int schedule_ticks(Clock::time_point now) {
+    auto wake = now + chrono::milliseconds(MAX_WAIT_MS);
+    for (auto& match : matches) {
+        Match* m = match.get();
+        if (m->running.load(memory_order_acquire)) {
+            // Its next tick time isn't ours to read yet
+            wake = min(wake, now + chrono::milliseconds(1));
+            continue;
         }
-
-        if (glm::length(move_input) > 0.0f) {
-            glm::vec2 total_move = glm::normalize(move_input) * PLAYER_SPEED * dt;
-            
-            float next_x = client.state.pos.x + total_move.x;
-            float next_z = client.state.pos.z + total_move.y;
-            int head_y = (int)(client.state.pos.y + PLAYER_HEIGHT / 2.0f * 0.9f);
-            
-            if (game_map[(int)next_x][head_y][(int)client.state.pos.z] == AIR) {
-                client.state.pos.x = next_x;
-            }
-             if (game_map[(int)client.state.pos.x][head_y][(int)next_z] == AIR) {
-                client.state.pos.z = next_z;
-            }
+        for (uint64_t key : m->departed) {
+            if (connections.erase(key)) m->num_routed--;
         }
-        
-        client.velocityY += GRAVITY * dt;
-        client.state.pos.y += client.velocityY * dt;
-
-        int map_x = (int)client.state.pos.x;
-        int map_z = (int)client.state.pos.z;
-        
-        int head_y = (int)(client.state.pos.y + PLAYER_HEIGHT / 2.0f);
-        if (head_y < MAP_HEIGHT) {
-            if (game_map[map_x][head_y][map_z] == SOLID) {
-                client.velocityY = 0;
-                client.state.pos.y = (float)head_y - (PLAYER_HEIGHT / 2.0f) - 0.01f;
-            }
-        }
-
-        int floor_y = (int)(client.state.pos.y - PLAYER_HEIGHT / 2.0f);
-        if (floor_y >= 0) {
-            int block_under = game_map[map_x][floor_y][map_z];
-            if (block_under == SOLID) {
-                if (client.velocityY <= 0) {
-                    client.state.pos.y = (float)floor_y + 1.0f + PLAYER_HEIGHT / 2.0f;
-                    client.velocityY = 0;
-                    client.state.on_ground = true;
-                }
-            } else {
-                client.state.on_ground = false;
-            }
-        } else {
-             client.state.on_ground = false;
-        }
-
-        if (glm::distance(initial_pos, client.state.pos) > 0.001f && client.state.on_ground) {
-            float distance_since_last_step = glm::distance(glm::vec2(client.state.pos.x, client.state.pos.z), glm::vec2(client.pos_at_last_step.x, client.pos_at_last_step.z));
-            if (distance_since_last_step >= STEP_DISTANCE) {
-                SoundEventPacket sound_pkt;
-                sound_pkt.hdr.type = SOUND_EVENT;
-                sound_pkt.sound_type = FOOTSTEP;
-                sound_pkt.pos = client.state.pos;
-                for (auto const& [pid, p_client] : clients) {
-                    sendto(udp_socket, &sound_pkt, sizeof(sound_pkt), 0, (sockaddr*)&p_client.addr, sizeof(p_client.addr));
-                }
-                client.pos_at_last_step = client.state.pos;
-            }
+        m->departed.clear();
+        if (m->num_routed == 0) {
+            // Idle matches don't tick; resume from now rather than catching up
+            m->last_tick_time = now;
+            continue;
         }
-    }
-}
-
-void update_projectiles(float dt) {
-    for (int i = 0; i < MAX_PROJECTILES; ++i) {
-        if (projectiles[i].is_active) {
-            glm::vec3 previous_pos = projectiles[i].pos;
-
-            projectiles[i].pos += projectiles[i].dir * PROJECTILE_SPEED * dt;
-            int map_x = (int)projectiles[i].pos.x;
-            int map_y = (int)projectiles[i].pos.y;
-            int map_z = (int)projectiles[i].pos.z;
-
-            if (map_x < 0 || map_x >= MAP_WIDTH || map_y < 0 || map_y >= MAP_HEIGHT || map_z < 0 || map_z >= MAP_LENGTH || game_map[map_x][map_y][map_z] == SOLID) {
-                projectiles[i].is_active = false;
-                continue;
-            }
-            for (auto& [id, client] : clients) {
-                if (!client.state.is_alive || id == projectiles[i].owner_id) continue;
-                float total_radius = PLAYER_RADIUS + PROJECTILE_RADIUS;
-
-                if (check_line_sphere_collision(previous_pos, projectiles[i].pos, client.state.pos, total_radius)) {
-                    client.state.is_alive = 0;
-                    client.respawn_time = Clock::now() + std::chrono::seconds(3);
-                    projectiles[i].is_active = false;
-                    cout << "Player " << id << " was hit!" << endl;
-                    break;
-                }
-            }
+        if (now < m->next_tick_time()) {
+            wake = min(wake, m->next_tick_time());
+            continue;
         }
+        m->running.store(true, memory_order_relaxed);
+        job_system_submit(jobs, [m] { m->run_tick(); });
+        wake = min(wake, now + chrono::milliseconds(1));
     }
+    auto wait = chrono::duration_cast<chrono::milliseconds>(wake - now + chrono::microseconds(999));
+    return max(0, (int)wait.count());
 }
 
-void respawn_player(ClientInfo& client) {
-    client.state.is_alive = 1;
-    client.velocityY = 0.0f;
-    if (!spawn_points.empty()) {
-        client.state.pos = spawn_points[rand() % spawn_points.size()];
-        client.state.pos.y += PLAYER_HEIGHT / 2.0f;
-    } else {
-        client.state.pos = {5.0f, 1.5f, 5.0f};
+void publish_server_metrics(Clock::time_point now) {
+    MetricsServer& m = server_metrics;
+    m.uptime_ms = chrono::duration_cast<chrono::milliseconds>(now - server_start).count();
+    m.matches = matches.size();
+    m.connections = connections.size();
+    NetSendTotals sent;
+    net_send_totals(sent);
+    m.datagrams_out = 0;
+    for (int t = 0; t < NET_COUNTED_TYPES && t < METRICS_PACKET_TYPES; t++) {
+        m.datagrams_out_by_type[t] = sent.datagrams[t];
+        m.datagrams_out += sent.datagrams[t];
     }
-    client.pos_at_last_step = client.state.pos;
+    m.bytes_out = sent.bytes;
+    m.net_syscalls = net_syscalls.load(memory_order_relaxed);
+    m.log_records_dropped = log_dropped_count();
+    metrics_publish(metrics->server, m);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) { cerr << "Usage: " << argv[0] << " <port>\n"; return 1; }
+    if (argc < 2) { cerr << "Usage: " << argv[0] << " <port> [--deterministic <seed>] [--hash-log <file>] [--record <file>] [--mtu <bytes>] [--client-bandwidth <bytes/s>] [--aoi-radius <voxels>] [--no-pvs] [--no-adaptive-bandwidth] [--net epoll|io_uring] [--no-gso] [--trace <file>] [--perf-counters] [--log-level debug|info|warning|error] [--no-metrics] [--threads <n>] [--max-matches <n>] [--max-players <n>] [--max-projectiles <n>]\n"; return 1; }
     int port = atoi(argv[1]);
-    char buf[BUFLEN];
-    memset(projectiles, 0, sizeof(projectiles));
+    base_seed = time(NULL);
+    int num_threads = max(1u, thread::hardware_concurrency());
+    NetBackendKind net_kind = NET_EPOLL;
+    bool use_gso = true;
+    const char* trace_path = nullptr;
+    bool use_metrics = true;
+    bool use_perf_counters = false;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--deterministic") == 0 && i + 1 < argc) {
+            match_config.deterministic_mode = true;
+            base_seed = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--hash-log") == 0 && i + 1 < argc) {
+            hash_log_path = argv[++i];
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--mtu") == 0 && i + 1 < argc) {
+            match_config.mtu = strtoul(argv[++i], nullptr, 10);
+            if (match_config.mtu < 576 || match_config.mtu > MAX_MTU) { cerr << "MTU must be between 576 and " << MAX_MTU << "\n"; return 1; }
+        } else if (strcmp(argv[i], "--client-bandwidth") == 0 && i + 1 < argc) {
+            match_config.client_bandwidth = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--aoi-radius") == 0 && i + 1 < argc) {
+            match_config.aoi_radius = max(0.0f, strtof(argv[++i], nullptr));
+        } else if (strcmp(argv[i], "--net") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "epoll") == 0) {
+                net_kind = NET_EPOLL;
+            } else if (strcmp(argv[i], "io_uring") == 0) {
+                net_kind = NET_IO_URING;
+            } else {
+                cerr << "Unknown network backend " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--perf-counters") == 0) {
+            use_perf_counters = true;
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            LogLevel level;
+            if (!log_parse_level(argv[++i], &level)) { cerr << "Unknown log level " << argv[i] << "\n"; return 1; }
+            log_min_level = level;
+        } else if (strcmp(argv[i], "--no-metrics") == 0) {
+            use_metrics = false;
+        } else if (strcmp(argv[i], "--no-gso") == 0) {
+            use_gso = false;
+        } else if (strcmp(argv[i], "--no-adaptive-bandwidth") == 0) {
+            match_config.adaptive_bandwidth = false;
+        } else if (strcmp(argv[i], "--no-pvs") == 0) {
+            match_config.pvs_culling = false;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            num_threads = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--max-matches") == 0 && i + 1 < argc) {
+            max_matches = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--max-players") == 0 && i + 1 < argc) {
+            match_config.max_players = strtoul(argv[++i], nullptr, 10);
+            if (match_config.max_players < 1 || match_config.max_players > MAX_PLAYERS_LIMIT) { cerr << "Max players must be between 1 and " << MAX_PLAYERS_LIMIT << "\n"; return 1; }
+        } else if (strcmp(argv[i], "--max-projectiles") == 0 && i + 1 < argc) {
+            match_config.max_projectiles = strtoul(argv[++i], nullptr, 10);
+            if (match_config.max_projectiles < 1 || match_config.max_projectiles > MAX_PROJECTILES_LIMIT) { cerr << "Max projectiles must be between 1 and " << MAX_PROJECTILES_LIMIT << "\n"; return 1; }
+        } else {
+            cerr << "Unknown option " << argv[i] << "\n";
+            return 1;
+        }
+    }
+    log_start();
     int udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
     struct sockaddr_in serv_addr{};
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_port = htons(port);
     serv_addr.sin_addr.s_addr = INADDR_ANY;
     bind(udp_socket, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
-    cout << "Server started on port " << port << endl;
-    int epfd = epoll_create1(0);
-    struct epoll_event ev;
-    ev.events = EPOLLIN;
-    ev.data.fd = udp_socket;
-    epoll_ctl(epfd, EPOLL_CTL_ADD, udp_socket, &ev);
-    struct epoll_event events[MAX_EVENTS];
-    auto last_tick_time = Clock::now();
-    const int tick_interval_ms = 33;
-    srand(time(NULL));
-    generate_map();
-
-    while (true) {
-        int nfds = epoll_wait(epfd, events, MAX_EVENTS, 5);
-        for (int i = 0; i < nfds; i++) {
-            if (events[i].data.fd == udp_socket) {
-                sockaddr_in client_addr;
-                socklen_t len = sizeof(client_addr);
-                size_t recv_len = recvfrom(udp_socket, buf, sizeof(buf), 0, (sockaddr*) &client_addr, &len);
-                if (recv_len < sizeof(ProtoHeader)) continue;
-                ProtoHeader *hdr = (ProtoHeader *)buf;
-                ostringstream oss;
-                oss << inet_ntoa(client_addr.sin_addr) << ":" << ntohs(client_addr.sin_port);
-                string client_key = oss.str();
-                if (hdr->type == JOIN) {
-                    if (addr_to_id.count(client_key) == 0 && clients.size() < MAX_PLAYERS) {
-                        uint32_t new_id = next_player_id++;
-                        addr_to_id[client_key] = new_id;
-                        ClientInfo new_client;
-                        new_client.addr = client_addr;
-                        new_client.state.player_id = new_id;
-                        respawn_player(new_client);
-                        new_client.last_fire_time = Clock::now();
-                        new_client.last_packet_time = Clock::now();
-                        new_client.client_key = client_key;
-                        new_client.pos_at_last_step = new_client.state.pos;
-                        clients[new_id] = new_client;
-                        JoinAckPacket pkt;
-                        pkt.hdr.type = JOIN_ACK;
-                        pkt.your_id = new_id;
-                        sendto(udp_socket, &pkt, sizeof(pkt), 0, (sockaddr*)&client_addr, len);
-                        MapPacket map_pkt;
-                        map_pkt.hdr.type = MAP_DATA;
-                        memcpy(map_pkt.map, game_map, sizeof(game_map));
-                        sendto(udp_socket, &map_pkt, sizeof(map_pkt), 0, (sockaddr*)&client_addr, len);
-                        cout << "Player " << new_id << " joined from " << client_key << "\n";
-                    }
-                } else if (hdr->type == ACT) {
-                    if (addr_to_id.count(client_key)) {
-                        uint32_t id = addr_to_id[client_key];
-                        if (clients.count(id) && recv_len >= sizeof(ActionPacket)) {
-                            ActionPacket* pkt = (ActionPacket*)buf;
-                            clients[id].state.movement_dir = pkt->movement_dir;
-                            clients[id].state.view_dir = pkt->view_dir;
-                            clients[id].last_packet_time = Clock::now();
-
-                            if (pkt->is_jumping && clients[id].state.on_ground) {
-                                clients[id].velocityY = JUMP_POWER;
-                                clients[id].state.on_ground = false;
-                            }
-
-                            auto now = Clock::now();
-                            if (pkt->is_firing && clients[id].state.is_alive &&
-                                chrono::duration_cast<chrono::milliseconds>(now - clients[id].last_fire_time).count() >= FIRE_COOLDOWN_MS) {
-                                clients[id].last_fire_time = now;
-                                glm::vec3 spawn_pos = clients[id].state.pos;
-                                spawn_pos.y += 0.2f; // Eye height offset
-                                spawn_projectile(id, spawn_pos, pkt->view_dir);
-
-                                SoundEventPacket sound_pkt;
-                                sound_pkt.hdr.type = SOUND_EVENT;
-                                sound_pkt.sound_type = GUNSHOT;
-                                sound_pkt.pos = spawn_pos;
-
-                                for (auto const& [pid, p_client] : clients) {
-                                    sendto(udp_socket, &sound_pkt, sizeof(sound_pkt), 0, (sockaddr*)&p_client.addr, sizeof(p_client.addr));
-                                }
-                            }
-                        }
-                    }
-                } else if (hdr->type == LEAVE) {
-                    if (addr_to_id.count(client_key)) {
-                        uint32_t id = addr_to_id[client_key];
-                        cout << "Player " << id << " has left the game." << endl;
-                        clients.erase(id);
-                        addr_to_id.erase(client_key);
-                    }
-                }
-            }
-        }
-        auto current_time = Clock::now();
-        auto elapsed_ms = chrono::duration_cast<chrono::milliseconds>(current_time - last_tick_time).count();
-        if (elapsed_ms >= tick_interval_ms) {
-            last_tick_time = current_time;
-            float dt = elapsed_ms / 1000.0f;
-            std::vector<uint32_t> timed_out_ids;
-            for (auto const& [id, client] : clients) {
-                if (chrono::duration_cast<chrono::seconds>(current_time - client.last_packet_time).count() > CLIENT_TIMEOUT_S) {
-                    timed_out_ids.push_back(id);
-                }
-            }
-
-            for (uint32_t id : timed_out_ids) {
-                cout << "Player " << id << " timed out. Removing." << endl;
-                addr_to_id.erase(clients[id].client_key);
-                clients.erase(id);
-            }
-
-            for (auto& [id, client] : clients) {
-                if (!client.state.is_alive && current_time >= client.respawn_time) {
-                    respawn_player(client);
-                }
-            }
-            update_players(dt, udp_socket);
-            update_projectiles(dt);
-            StatePacket spkt{};
-            spkt.hdr.type = STATE;
-            spkt.hdr.tick_id = current_tick++;
-            spkt.num_players = 0;
-            for (auto const& [id, client] : clients) {
-                if (spkt.num_players < MAX_PLAYERS) { spkt.players[spkt.num_players++] = client.state; }
-            }
-            spkt.num_projectiles = 0;
-            for(int i = 0; i < MAX_PROJECTILES; ++i) {
-                if (projectiles[i].is_active) {
-                     if (spkt.num_projectiles < MAX_PROJECTILES) { spkt.projectiles[spkt.num_projectiles++] = projectiles[i]; }
+    match_config.udp_socket = udp_socket;
+    NetBackend net;
+    if (!net_open(net, udp_socket, net_kind)) {
+        log_warning("{} is not available, falling back to epoll", net_backend_name(net_kind));
+        net_kind = NET_EPOLL;
+        net_open(net, udp_socket, net_kind);
+    }
+    net_enable_batching(net_kind == NET_IO_URING);
+    bool gso = net_enable_gso(udp_socket, use_gso);
+    log_info("Server started on port {} with {} worker threads, {} network backend, UDP GSO {}", port, num_threads,
+             net_backend_name(net_kind), gso ? "on" : "off");
+    server_start = Clock::now();
+    char metrics_path[64];
+    metrics_name(port, metrics_path, sizeof(metrics_path));
+    if (use_metrics) {
+        if (metrics_create(metrics_path, max_matches)) log_info("Metrics in shared memory {}", metrics_path);
+        else log_warning("metrics segment {}: {}", metrics_path, strerror(errno));
+    }
+    trace_thread_name("network");
+    if (trace_path && trace_start(trace_path)) log_info("Tracing to {}", trace_path);
+    if (use_perf_counters) {
+        if (perf_counters_enable()) log_info("Counting cycles, instructions, cache and branch misses per tick phase");
+        else log_warning("hardware counters: {}; timing phases only", perf_counters_error(errno));
+    }
+    // Stop cleanly so the trace is complete
+    signal(SIGINT, [](int) { stop_requested = 1; });
+    signal(SIGTERM, [](int) { stop_requested = 1; });
+    job_system_start(jobs, num_threads);
+    match_config.jobs = &jobs;
+    // The first match exists up front so a fixed seed always maps to the same first map
+    matchmake();
+
+    int wait_ms = 0;
+    while (!stop_requested) {
+        int received = 0;
+        {
+            TraceScope trace("net_poll");
+            net_poll(net, wait_ms, [&received](const uint8_t* data, size_t len, const sockaddr_in& from) {
+                server_metrics.bytes_in += len;
+                if (len >= sizeof(ProtoHeader)) {
+                    server_metrics.datagrams_in_by_type[min((int)data[0], METRICS_PACKET_TYPES - 1)]++;
+                    route_datagram(data, len, from, Clock::now());
                 }
-            }
-            for (auto const& [id, client] : clients) {
-                sendto(udp_socket, &spkt, sizeof(spkt), 0, (sockaddr*)&client.addr, sizeof(client.addr));
-            }
+                received++;
+            });
         }
+        server_metrics.datagrams_in += received;
+        if (received) trace_counter("datagrams received", received);
+        TraceScope trace("schedule_ticks");
+        auto now = Clock::now();
+        wait_ms = schedule_ticks(now);
+        if (metrics) publish_server_metrics(now);
+    }
+    net_close(net);
+    job_system_stop(jobs);
+    for (auto& m : matches) {
+        if (m->hash_log) fclose(m->hash_log);
+        if (m->record) fclose(m->record);
     }
     close(udp_socket);
+    metrics_destroy();
+    trace_stop();
+    log_stop();
     return 0;
-}
\ No newline at end of file
+}
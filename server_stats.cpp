@@ -0,0 +1,172 @@
+// Reads a running server's metrics from its shared-memory segment and prints
+// them, once or every few seconds, as text or as one JSON object per sample.
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <string>
+
+#include "protocol.h"
+#include "metrics.h"
+
+using namespace std;
+
+static string type_name(int t) {
+    if (t < NUM_PACKET_TYPES) return packet_type_name(t);
+    return t == METRICS_PACKET_TYPES - 1 ? "other" : to_string(t);
+}
+
+static void print_types(const char* label, const uint64_t* counts) {
+    printf("  %s:", label);
+    for (int t = 0; t < METRICS_PACKET_TYPES; t++) {
+        if (counts[t]) printf(" %s %llu", type_name(t).c_str(), (unsigned long long)counts[t]);
+    }
+    printf("\n");
+}
+
+static void print_text(const MetricsSegment* seg, const MetricsServer& s, const MetricsServer* prev, double interval_s) {
+    bool alive = kill((pid_t)seg->pid, 0) == 0 || errno == EPERM;
+    printf("server pid %u%s, up %.1f s, %llu matches, %llu connections, %llu joins denied\n", seg->pid,
+           alive ? "" : " (not running)", s.uptime_ms / 1000.0, (unsigned long long)s.matches,
+           (unsigned long long)s.connections, (unsigned long long)s.joins_denied);
+    printf("  in: %llu datagrams, %llu bytes", (unsigned long long)s.datagrams_in, (unsigned long long)s.bytes_in);
+    if (prev) {
+        printf(" (%.0f/s, %.0f B/s)", (s.datagrams_in - prev->datagrams_in) / interval_s, (s.bytes_in - prev->bytes_in) / interval_s);
+    }
+    printf("\n  out: %llu datagrams, %llu bytes", (unsigned long long)s.datagrams_out, (unsigned long long)s.bytes_out);
+    if (prev) {
+        printf(" (%.0f/s, %.0f B/s)", (s.datagrams_out - prev->datagrams_out) / interval_s, (s.bytes_out - prev->bytes_out) / interval_s);
+    }
+    printf("\n");
+    print_types("in by type", s.datagrams_in_by_type);
+    print_types("out by type", s.datagrams_out_by_type);
+    printf("  %llu network syscalls, %llu log records dropped\n", (unsigned long long)s.net_syscalls,
+           (unsigned long long)s.log_records_dropped);
+    uint32_t num_matches = min(seg->num_matches.load(memory_order_acquire), seg->max_matches);
+    for (uint32_t i = 0; i < num_matches; i++) {
+        const MetricsMatch* m = metrics_match_at(seg, i);
+        MetricsTick tick;
+        MetricsSnapshot snap;
+        if (!metrics_read(m->tick, tick) || !metrics_read(m->snapshot, snap)) continue;
+        printf("match %u: tick %llu, %llu players, %llu projectiles, tick %.0f us (max %.0f), %llu overruns, "
+               "%llu datagrams in, %llu sounds dropped\n", i, (unsigned long long)tick.tick, (unsigned long long)tick.players,
+               (unsigned long long)tick.projectiles, tick.tick_ns / 1e3, tick.tick_ns_max / 1e3, (unsigned long long)tick.overruns,
+               (unsigned long long)tick.datagrams_in, (unsigned long long)tick.sounds_dropped);
+        printf("  rtt %.1f ms avg, %.1f ms max; jitter %.1f ms avg; loss %.1f%% avg, %.1f%% max\n", tick.rtt_us_avg / 1e3,
+               tick.rtt_us_max / 1e3, tick.jitter_us_avg / 1e3, tick.loss_permille_avg / 10.0, tick.loss_permille_max / 10.0);
+        printf("  snapshot %.0f us, %llu datagrams, %llu bytes; %llu snapshots, %llu bytes in all\n", snap.snapshot_ns / 1e3,
+               (unsigned long long)snap.datagrams_out, (unsigned long long)snap.bytes_out, (unsigned long long)snap.snapshots,
+               (unsigned long long)snap.bytes_out_total);
+    }
+}
+
+static void json_types(const char* key, const uint64_t* counts) {
+    printf(",\"%s\":{", key);
+    bool first = true;
+    for (int t = 0; t < METRICS_PACKET_TYPES; t++) {
+        if (!counts[t]) continue;
+        printf("%s\"%s\":%llu", first ? "" : ",", type_name(t).c_str(), (unsigned long long)counts[t]);
+        first = false;
+    }
+    printf("}");
+}
+
+#define JSON_FIELD(obj, name) printf(",\"" #name "\":%llu", (unsigned long long)(obj).name)
+
+static void print_json(const MetricsSegment* seg, const MetricsServer& s) {
+    printf("{\"pid\":%u", seg->pid);
+    JSON_FIELD(s, uptime_ms);
+    JSON_FIELD(s, matches);
+    JSON_FIELD(s, connections);
+    JSON_FIELD(s, datagrams_in);
+    JSON_FIELD(s, bytes_in);
+    json_types("datagrams_in_by_type", s.datagrams_in_by_type);
+    JSON_FIELD(s, datagrams_out);
+    JSON_FIELD(s, bytes_out);
+    json_types("datagrams_out_by_type", s.datagrams_out_by_type);
+    JSON_FIELD(s, joins_denied);
+    JSON_FIELD(s, net_syscalls);
+    JSON_FIELD(s, log_records_dropped);
+    printf(",\"match\":[");
+    uint32_t num_matches = min(seg->num_matches.load(memory_order_acquire), seg->max_matches);
+    bool first = true;
+    for (uint32_t i = 0; i < num_matches; i++) {
+        const MetricsMatch* m = metrics_match_at(seg, i);
+        MetricsTick tick;
+        MetricsSnapshot snap;
+        if (!metrics_read(m->tick, tick) || !metrics_read(m->snapshot, snap)) continue;
+        printf("%s{\"id\":%u", first ? "" : ",", i);
+        first = false;
+        JSON_FIELD(tick, tick);
+        JSON_FIELD(tick, ticks);
+        JSON_FIELD(tick, players);
+        JSON_FIELD(tick, projectiles);
+        JSON_FIELD(tick, tick_ns);
+        JSON_FIELD(tick, tick_ns_max);
+        JSON_FIELD(tick, overruns);
+        JSON_FIELD(tick, datagrams_in);
+        JSON_FIELD(tick, sounds_dropped);
+        JSON_FIELD(tick, rtt_us_avg);
+        JSON_FIELD(tick, rtt_us_max);
+        JSON_FIELD(tick, jitter_us_avg);
+        JSON_FIELD(tick, loss_permille_avg);
+        JSON_FIELD(tick, loss_permille_max);
+        JSON_FIELD(snap, snapshots);
+        JSON_FIELD(snap, snapshot_ns);
+        JSON_FIELD(snap, datagrams_out);
+        JSON_FIELD(snap, bytes_out);
+        JSON_FIELD(snap, datagrams_out_total);
+        JSON_FIELD(snap, bytes_out_total);
+        printf("}");
+    }
+    printf("]}\n");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) { cerr << "Usage: " << argv[0] << " <port> [--json] [--watch <s>]\n"; return 1; }
+    int port = atoi(argv[1]);
+    bool json = false;
+    double watch_s = 0.0;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else if (strcmp(argv[i], "--watch") == 0 && i + 1 < argc) {
+            watch_s = max(0.1, atof(argv[++i]));
+        } else {
+            cerr << "Unknown option " << argv[i] << "\n";
+            return 1;
+        }
+    }
+    char name[64];
+    metrics_name(port, name, sizeof(name));
+    const MetricsSegment* seg = metrics_attach(name);
+    if (!seg) {
+        if (errno == EPROTO) cerr << name << ": not a metrics segment of this version\n";
+        else cerr << name << ": " << strerror(errno) << " (is a server running on port " << port << "?)\n";
+        return 1;
+    }
+    MetricsServer prev{};
+    bool have_prev = false;
+    while (true) {
+        MetricsServer s;
+        if (!metrics_read(seg->server, s)) {
+            cerr << "metrics kept changing while being read\n";
+            return 1;
+        }
+        if (json) {
+            print_json(seg, s);
+        } else {
+            print_text(seg, s, have_prev ? &prev : nullptr, watch_s);
+        }
+        fflush(stdout);
+        if (watch_s <= 0.0) break;
+        prev = s;
+        have_prev = true;
+        usleep((useconds_t)(watch_s * 1e6));
+        if (!json) printf("\n");
+    }
+    return 0;
+}
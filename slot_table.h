@@ -0,0 +1,123 @@
+#ifndef SLOT_TABLE_H
+#define SLOT_TABLE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Values in a contiguous slot array, addressed by 32-bit handles: the slot
+// index in the low bits and the slot's generation above it. Freeing a slot
+// bumps its generation, so a handle to a removed value never finds the value
+// that reuses the slot. Handles are never 0. Iteration visits the live slots
+// in index order, which depends only on the order of inserts and erases.
+template <typename T>
+struct SlotTable {
+    static const uint32_t INDEX_BITS = 16;
+    static const uint32_t INDEX_MASK = (1u << INDEX_BITS) - 1;
+
+    struct Slot {
+        uint32_t generation = 1;
+        bool used = false;
+        T value{};
+    };
+
+    std::vector<Slot> slots;
+    std::vector<uint32_t> free_slots;  // popped from the back, so low indices are reused first
+    size_t count = 0;
+
+    static uint32_t index_of(uint32_t handle) { return handle & INDEX_MASK; }
+
+    // Fixes the capacity; at most 1 << INDEX_BITS slots
+    void init(size_t capacity) {
+        slots.assign(capacity, Slot{});
+        free_slots.clear();
+        for (size_t i = capacity; i > 0; i--) {
+            free_slots.push_back((uint32_t)(i - 1));
+        }
+        count = 0;
+    }
+
+    size_t size() const { return count; }
+    size_t capacity() const { return slots.size(); }
+    bool full() const { return free_slots.empty(); }
+
+    uint32_t handle_at(uint32_t index) const {
+        return (slots[index].generation << INDEX_BITS) | index;
+    }
+
+    // Returns the new value's handle, or 0 when full. The value starts out as T{}.
+    uint32_t insert() {
+        if (free_slots.empty()) return 0;
+        uint32_t index = free_slots.back();
+        free_slots.pop_back();
+        Slot& slot = slots[index];
+        slot.used = true;
+        slot.value = T{};
+        count++;
+        return handle_at(index);
+    }
+
+    T* get(uint32_t handle) {
+        uint32_t index = index_of(handle);
+        if (index >= slots.size()) return nullptr;
+        Slot& slot = slots[index];
+        return slot.used && handle_at(index) == handle ? &slot.value : nullptr;
+    }
+
+    const T* get(uint32_t handle) const {
+        return const_cast<SlotTable*>(this)->get(handle);
+    }
+
+    bool contains(uint32_t handle) const { return get(handle) != nullptr; }
+
+    void erase(uint32_t handle) {
+        if (!get(handle)) return;
+        uint32_t index = index_of(handle);
+        Slot& slot = slots[index];
+        slot.used = false;
+        // Generation 0 would let a handle be 0
+        slot.generation = (slot.generation + 1) & (UINT32_MAX >> INDEX_BITS);
+        if (slot.generation == 0) slot.generation = 1;
+        free_slots.push_back(index);
+        count--;
+    }
+
+    // Yields (handle, value&) pairs for live slots
+    template <typename Table, typename Ref>
+    struct Iterator {
+        Table* table;
+        uint32_t index;
+
+        void skip_free() {
+            while (index < table->slots.size() && !table->slots[index].used) index++;
+        }
+        std::pair<uint32_t, Ref> operator*() const {
+            return {table->handle_at(index), table->slots[index].value};
+        }
+        Iterator& operator++() {
+            index++;
+            skip_free();
+            return *this;
+        }
+        bool operator!=(const Iterator& other) const { return index != other.index; }
+    };
+
+    using iterator = Iterator<SlotTable, T&>;
+    using const_iterator = Iterator<const SlotTable, const T&>;
+
+    iterator begin() {
+        iterator it{this, 0};
+        it.skip_free();
+        return it;
+    }
+    iterator end() { return {this, (uint32_t)slots.size()}; }
+    const_iterator begin() const {
+        const_iterator it{this, 0};
+        it.skip_free();
+        return it;
+    }
+    const_iterator end() const { return {this, (uint32_t)slots.size()}; }
+};
+
+#endif
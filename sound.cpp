@@ -0,0 +1,75 @@
+#include <cmath>
+#include <cstring>
+
+#include "sound.h"
+
+using namespace std;
+
+int sound_voxel(const glm::vec3& pos) {
+    int x = (int)floor(pos.x), y = (int)floor(pos.y), z = (int)floor(pos.z);
+    if (x < 0 || x >= MAP_WIDTH || y < 0 || y >= MAP_HEIGHT || z < 0 || z >= MAP_LENGTH) return -1;
+    return (x * MAP_HEIGHT + y) * MAP_LENGTH + z;
+}
+
+// Costs are small integers, so Dijkstra runs on one bucket per cost
+void sound_propagate(const VoxelMap& map, int source, uint8_t* field) {
+    memset(field, SOUND_UNREACHED, MAP_VOXELS);
+    if (source < 0) return;
+    const int* voxels = &map[0][0][0];
+    vector<int> buckets[SOUND_MAX_PATH_COST + 1];
+    field[source] = 0;
+    buckets[0].push_back(source);
+    for (int cost = 0; cost <= SOUND_MAX_PATH_COST; cost++) {
+        for (int v : buckets[cost]) {
+            if (field[v] != cost) continue;
+            int x = v / (MAP_HEIGHT * MAP_LENGTH), y = v / MAP_LENGTH % MAP_HEIGHT, z = v % MAP_LENGTH;
+            int neighbours[6];
+            int n = 0;
+            if (x > 0) neighbours[n++] = v - MAP_HEIGHT * MAP_LENGTH;
+            if (x < MAP_WIDTH - 1) neighbours[n++] = v + MAP_HEIGHT * MAP_LENGTH;
+            if (y > 0) neighbours[n++] = v - MAP_LENGTH;
+            if (y < MAP_HEIGHT - 1) neighbours[n++] = v + MAP_LENGTH;
+            if (z > 0) neighbours[n++] = v - 1;
+            if (z < MAP_LENGTH - 1) neighbours[n++] = v + 1;
+            for (int i = 0; i < n; i++) {
+                int next = neighbours[i];
+                int next_cost = cost + (voxels[next] == SOLID ? SOUND_SOLID_COST : SOUND_AIR_COST);
+                if (next_cost <= SOUND_MAX_PATH_COST && next_cost < field[next]) {
+                    field[next] = next_cost;
+                    buckets[next_cost].push_back(next);
+                }
+            }
+        }
+    }
+}
+
+void sound_cache_init(SoundFieldCache& cache, size_t entries) {
+    cache.fields.resize(entries * MAP_VOXELS);
+    cache.sources.assign(entries, -1);
+    cache.last_used.assign(entries, 0);
+}
+
+void sound_cache_begin(SoundFieldCache& cache) {
+    cache.generation++;
+}
+
+const uint8_t* sound_cache_get(SoundFieldCache& cache, const VoxelMap& map, int source) {
+    size_t victim = cache.sources.size();
+    for (size_t i = 0; i < cache.sources.size(); i++) {
+        if (cache.sources[i] == source) {
+            cache.last_used[i] = cache.generation;
+            cache.hits++;
+            return &cache.fields[i * MAP_VOXELS];
+        }
+        if (cache.last_used[i] != cache.generation
+            && (victim == cache.sources.size() || cache.last_used[i] < cache.last_used[victim])) {
+            victim = i;
+        }
+    }
+    if (victim == cache.sources.size()) return nullptr;
+    cache.misses++;
+    cache.sources[victim] = source;
+    cache.last_used[victim] = cache.generation;
+    sound_propagate(map, source, &cache.fields[victim * MAP_VOXELS]);
+    return &cache.fields[victim * MAP_VOXELS];
+}
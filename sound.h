@@ -0,0 +1,37 @@
+#ifndef SOUND_H
+#define SOUND_H
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "protocol.h"
+
+const uint8_t SOUND_UNREACHED = 255;
+
+// Index of the voxel containing pos in a flattened VoxelMap, or -1 off the map
+int sound_voxel(const glm::vec3& pos);
+
+// Fills field (MAP_VOXELS entries) with the cheapest path cost from source to
+// every voxel, stepping between face neighbours. Voxels costing more than
+// SOUND_MAX_PATH_COST are left at SOUND_UNREACHED.
+void sound_propagate(const VoxelMap& map, int source, uint8_t* field);
+
+// Least recently used cache of propagation fields keyed by source voxel.
+// Fields fetched since the last sound_cache_begin() are never evicted, so
+// their pointers stay valid until the next call.
+struct SoundFieldCache {
+    std::vector<uint8_t> fields;      // MAP_VOXELS per entry
+    std::vector<int> sources;         // source voxel per entry, -1 when unused
+    std::vector<uint64_t> last_used;  // generation of the last fetch
+    uint64_t generation = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+void sound_cache_init(SoundFieldCache& cache, size_t entries);
+void sound_cache_begin(SoundFieldCache& cache);
+// Returns nullptr when every entry is in use this generation
+const uint8_t* sound_cache_get(SoundFieldCache& cache, const VoxelMap& map, int source);
+
+#endif
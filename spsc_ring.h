@@ -0,0 +1,35 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <cstddef>
+
+// Fixed-size lock-free queue for exactly one producer and one consumer
+// thread. N must be a power of two.
+template <typename T, size_t N>
+struct SpscRing {
+    static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+    T items[N];
+    std::atomic<size_t> head{0};  // next to pop, written by the consumer
+    std::atomic<size_t> tail{0};  // next to push, written by the producer
+
+    // Returns false when full
+    bool push(const T& item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N) return false;
+        items[t & (N - 1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
+        item = items[h & (N - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,167 @@
+#include <cstdio>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "trace.h"
+#include "spsc_ring.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+const size_t TRACE_RING_EVENTS = 16384;
+const int TRACE_FLUSH_INTERVAL_MS = 100;
+
+struct TraceEvent {
+    const char* name;
+    const char* arg_name;
+    int64_t arg;
+    uint64_t ts_ns;
+    char phase;  // B, E, i or C
+};
+
+struct TraceRing {
+    SpscRing<TraceEvent, TRACE_RING_EVENTS> events;
+    atomic<const char*> thread_name{nullptr};
+    atomic<uint64_t> dropped{0};
+    int tid = 0;
+    const char* named_as = nullptr;  // writer side: name already written
+};
+
+atomic<bool> trace_enabled{false};
+
+// Rings are never freed, so events from a thread that has exited still drain
+static mutex rings_mutex;
+static vector<TraceRing*> rings;
+static thread_local TraceRing* thread_ring = nullptr;
+static thread_local const char* thread_name = nullptr;
+
+static FILE* trace_file = nullptr;
+static Clock::time_point trace_epoch;
+static bool first_event = true;
+static thread writer;
+static mutex writer_mutex;
+static condition_variable writer_wake;
+static bool writer_stopping = false;
+
+void trace_thread_name(const char* name) {
+    thread_name = name;
+    if (thread_ring) thread_ring->thread_name = name;
+}
+
+static TraceRing* get_ring() {
+    if (!thread_ring) {
+        thread_ring = new TraceRing;
+        thread_ring->thread_name = thread_name;
+        lock_guard<mutex> lock(rings_mutex);
+        thread_ring->tid = (int)rings.size() + 1;
+        rings.push_back(thread_ring);
+    }
+    return thread_ring;
+}
+
+static void record(char phase, const char* name, const char* arg_name, int64_t arg) {
+    if (!trace_enabled.load(memory_order_relaxed)) return;
+    TraceRing* ring = get_ring();
+    uint64_t ts = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - trace_epoch).count();
+    if (!ring->events.push({name, arg_name, arg, ts, phase})) {
+        ring->dropped.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+void trace_begin(const char* name, const char* arg_name, int64_t arg) {
+    record('B', name, arg_name, arg);
+}
+
+void trace_end(const char* name) {
+    record('E', name, nullptr, 0);
+}
+
+void trace_instant(const char* name, const char* arg_name, int64_t arg) {
+    record('i', name, arg_name, arg);
+}
+
+void trace_counter(const char* name, int64_t value) {
+    record('C', name, "value", value);
+}
+
+static void write_separator() {
+    fputs(first_event ? "\n" : ",\n", trace_file);
+    first_event = false;
+}
+
+static void drain_rings() {
+    vector<TraceRing*> snapshot;
+    {
+        lock_guard<mutex> lock(rings_mutex);
+        snapshot = rings;
+    }
+    int pid = getpid();
+    for (TraceRing* ring : snapshot) {
+        const char* name = ring->thread_name.load();
+        if (name && name != ring->named_as) {
+            write_separator();
+            fprintf(trace_file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    pid, ring->tid, name);
+            ring->named_as = name;
+        }
+        TraceEvent e;
+        while (ring->events.pop(e)) {
+            write_separator();
+            fprintf(trace_file, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d", e.name, e.phase,
+                    e.ts_ns / 1e3, pid, ring->tid);
+            if (e.phase == 'i') fputs(",\"s\":\"t\"", trace_file);
+            if (e.arg_name) fprintf(trace_file, ",\"args\":{\"%s\":%lld}", e.arg_name, (long long)e.arg);
+            fputc('}', trace_file);
+        }
+    }
+    // Flushed as it goes, so a trace cut short by a crash still loads
+    fflush(trace_file);
+}
+
+static void writer_main() {
+    unique_lock<mutex> lock(writer_mutex);
+    while (!writer_stopping) {
+        writer_wake.wait_for(lock, chrono::milliseconds(TRACE_FLUSH_INTERVAL_MS));
+        drain_rings();
+    }
+}
+
+bool trace_start(const char* path) {
+    trace_file = fopen(path, "w");
+    if (!trace_file) {
+        perror("trace");
+        return false;
+    }
+    // JSON array format; viewers accept it without the closing bracket
+    fputc('[', trace_file);
+    trace_epoch = Clock::now();
+    writer_stopping = false;
+    writer = thread(writer_main);
+    trace_enabled = true;
+    return true;
+}
+
+void trace_stop() {
+    if (!trace_file) return;
+    trace_enabled = false;
+    {
+        lock_guard<mutex> lock(writer_mutex);
+        writer_stopping = true;
+    }
+    writer_wake.notify_one();
+    writer.join();
+    drain_rings();
+    uint64_t dropped = 0;
+    {
+        lock_guard<mutex> lock(rings_mutex);
+        for (TraceRing* ring : rings) dropped += ring->dropped;
+    }
+    fputs("\n]\n", trace_file);
+    fclose(trace_file);
+    trace_file = nullptr;
+    if (dropped) fprintf(stderr, "trace: %llu events dropped on full buffers\n", (unsigned long long)dropped);
+}
@@ -0,0 +1,42 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+
+// Chrome trace-event recording (chrome://tracing, ui.perfetto.dev). Each
+// thread writes events into a ring of its own; a background thread drains the
+// rings into a JSON trace file. While tracing is off, recording an event is
+// one relaxed load. A thread whose ring is full drops events until it drains.
+
+extern std::atomic<bool> trace_enabled;
+
+// Starts writing path; returns false if it can't be opened
+bool trace_start(const char* path);
+// Writes out what is left and closes the file
+void trace_stop();
+
+// Name shown for the calling thread; call before its first event. name must
+// outlive the trace.
+void trace_thread_name(const char* name);
+
+// Event names and arg names must be string literals. arg_name may be null.
+void trace_begin(const char* name, const char* arg_name = nullptr, int64_t arg = 0);
+void trace_end(const char* name);
+void trace_instant(const char* name, const char* arg_name = nullptr, int64_t arg = 0);
+void trace_counter(const char* name, int64_t value);
+
+// A begin event now and the matching end when the scope closes
+struct TraceScope {
+    const char* name;
+
+    explicit TraceScope(const char* name, const char* arg_name = nullptr, int64_t arg = 0)
+        : name(trace_enabled.load(std::memory_order_relaxed) ? name : nullptr) {
+        if (this->name) trace_begin(name, arg_name, arg);
+    }
+    ~TraceScope() {
+        if (name) trace_end(name);
+    }
+};
+
+#endif
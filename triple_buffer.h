@@ -0,0 +1,43 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <atomic>
+#include <cstdint>
+
+// Lock-free handoff of the latest value from one writer thread to one reader
+// thread. The writer fills write_slot() and publishes it; the reader picks up
+// the newest published value and skips any it was too slow to see. Neither
+// side ever waits for the other.
+template <typename T>
+struct TripleBuffer {
+    static const uint8_t FRESH = 4;
+
+    T slots[3];
+    // Index of the slot between writer and reader, plus FRESH when it holds a
+    // value the reader hasn't taken yet
+    std::atomic<uint8_t> middle{1};
+    uint8_t back = 0;   // writer's slot
+    uint8_t front = 2;  // reader's slot
+
+    T& write_slot() { return slots[back]; }
+
+    void publish() {
+        back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & 3;
+    }
+
+    bool has_fresh() const {
+        return middle.load(std::memory_order_acquire) & FRESH;
+    }
+
+    // Moves the newest published value to read_slot(). Returns false if
+    // nothing was published since the last call.
+    bool take_latest() {
+        if (!has_fresh()) return false;
+        front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+        return true;
+    }
+
+    const T& read_slot() const { return slots[front]; }
+};
+
+#endif